@@ -0,0 +1,224 @@
+/*
+  Group commit of webserver state changes (CABLE_SYNC=group).
+
+  Webserver threads call wait_commit() after a successful request, with
+  a descriptor of the (r)queue directory.  A commit thread collects the
+  waiting requests for a short window (or until enough are waiting), calls
+  syncfs() once per filesystem in the batch, and wakes up the waiters, so
+  that the response is sent only after the files and directory entries
+  written by the request are on stable storage.
+
+  With SYNC_NONE, wait_commit() returns immediately.
+
+  thread-safe
+*/
+
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "commit.h"
+#include "util.h"
+
+
+/* batch collection window (sec), and batch size that triggers immediate commit */
+#define COMMIT_DELAY    0.005
+#define COMMIT_MAX         64
+
+
+/* request waiting for commit (allocated on waiter's stack) */
+struct waiter {
+    struct waiter *next;
+    int           fd, synced, ok, done;
+    double        time;
+};
+
+
+static enum SYNC_Mode  syncmode;
+static int             started, stop;
+static pthread_t       thread;
+static pthread_mutex_t lock      = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  workcond  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  donecond  = PTHREAD_COND_INITIALIZER;
+
+/* pending waiters (newest first) */
+static struct waiter   *pending;
+static int             npending;
+
+/* statistics */
+static unsigned long   nbatches, nrequests;
+static double          synctime;
+
+
+static void abs_timeout(struct timespec *ts, double sec) {
+    double t;
+
+    clock_gettime(CLOCK_REALTIME, ts);
+
+    t = ts->tv_nsec / 1e9 + sec;
+    ts->tv_sec  += (time_t) t;
+    ts->tv_nsec  = (long) ((t - (time_t) t) * 1e9);
+}
+
+
+/* syncfs() once per filesystem, setting ok for each waiter (done is not touched) */
+static void sync_batch(struct waiter *batch) {
+    struct waiter *w, *v;
+    struct stat   st, sv;
+
+    for (w = batch;  w;  w = w->next)
+        w->synced = 0;
+
+    for (w = batch;  w;  w = w->next) {
+        if (w->synced)
+            continue;
+
+        if (fstat(w->fd, &st)) {
+            warning("fstat failed");
+            w->ok = 0;
+        }
+        else {
+            if (!((w->ok = !syscall(SYS_syncfs, w->fd))))
+                warning("syncfs failed");
+
+            /* waiters on the same filesystem share the result */
+            for (v = w->next;  v;  v = v->next)
+                if (!v->synced  &&  !fstat(v->fd, &sv)  &&  sv.st_dev == st.st_dev) {
+                    v->ok     = w->ok;
+                    v->synced = 1;
+                }
+        }
+
+        w->synced = 1;
+    }
+}
+
+
+static void* commit_thread(void *arg) {
+    struct waiter   *batch, *w, *next;
+    struct timespec ts;
+    double          start, oldest;
+    int             n;
+
+    pthread_mutex_lock(&lock);
+
+    while (!stop  ||  pending) {
+        while (!stop  &&  !pending)
+            pthread_cond_wait(&workcond, &lock);
+
+        /* collect more requests for a short window */
+        abs_timeout(&ts, COMMIT_DELAY);
+        while (!stop  &&  npending < COMMIT_MAX)
+            if (pthread_cond_timedwait(&workcond, &lock, &ts) == ETIMEDOUT)
+                break;
+
+        if (!((batch = pending)))
+            continue;
+
+        n        = npending;
+        pending  = NULL;
+        npending = 0;
+
+        pthread_mutex_unlock(&lock);
+
+        start = getmontime();
+        sync_batch(batch);
+
+        for (oldest = start, w = batch;  w;  w = w->next)
+            if (w->time < oldest)
+                oldest = w->time;
+
+        flog(LOG_DEBUG, "group commit: %d requests, sync %.1f ms, max. wait %.1f ms",
+             n, (getmontime() - start) * 1e3, (getmontime() - oldest) * 1e3);
+
+        pthread_mutex_lock(&lock);
+
+        ++nbatches;
+        nrequests += n;
+        synctime  += getmontime() - start;
+
+        /* waiters may return (and free w) as soon as the lock is released */
+        for (w = batch;  w;  w = next) {
+            next    = w->next;
+            w->done = 1;
+        }
+
+        pthread_cond_broadcast(&donecond);
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    return NULL;
+}
+
+
+int init_commit(enum SYNC_Mode mode) {
+    syncmode = mode;
+    stop     = 0;
+    started  = 0;
+
+    if (syncmode == SYNC_GROUP) {
+        if ((errno = pthread_create(&thread, NULL, commit_thread, NULL))) {
+            warning("failed to start commit thread");
+            return 0;
+        }
+
+        started = 1;
+        flog(LOG_INFO, "group commit enabled");
+    }
+
+    return 1;
+}
+
+
+/* webserver threads must have finished */
+void shutdown_commit() {
+    if (started) {
+        pthread_mutex_lock(&lock);
+        stop = 1;
+        pthread_cond_signal(&workcond);
+        pthread_mutex_unlock(&lock);
+
+        if ((errno = pthread_join(thread, NULL)))
+            warning("failed to join commit thread");
+        started = 0;
+
+        if (nbatches)
+            flog(LOG_INFO, "group commits: %lu batches, %.1f requests/batch, %.1f ms/sync",
+                 nbatches, (double) nrequests / nbatches, synctime * 1e3 / nbatches);
+    }
+}
+
+
+int wait_commit(int fd) {
+    struct waiter w;
+
+    if (syncmode == SYNC_NONE)
+        return 1;
+
+    /* commit thread is not running, sync directly */
+    if (!started)
+        return !syscall(SYS_syncfs, fd);
+
+    w.fd   = fd;
+    w.done = w.ok = 0;
+    w.time = getmontime();
+
+    pthread_mutex_lock(&lock);
+
+    w.next  = pending;
+    pending = &w;
+    if (++npending == 1  ||  npending >= COMMIT_MAX)
+        pthread_cond_signal(&workcond);
+
+    while (!w.done)
+        pthread_cond_wait(&donecond, &lock);
+
+    pthread_mutex_unlock(&lock);
+
+    return w.ok;
+}
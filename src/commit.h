@@ -0,0 +1,16 @@
+#ifndef COMMIT_H
+#define COMMIT_H
+
+/* durability modes (CABLE_SYNC) */
+enum SYNC_Mode {
+    SYNC_NONE  = 0,
+    SYNC_GROUP = 1
+};
+
+int init_commit(enum SYNC_Mode mode);
+void shutdown_commit();
+
+/* wait until changes on fd's filesystem are committed (1 if successful) */
+int wait_commit(int fd);
+
+#endif
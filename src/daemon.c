@@ -1,6 +1,13 @@
 /*
   The following environment variables are used (from /etc/cable/profile):
-  CABLE_HOME, CABLE_QUEUES, CABLE_CERTS, CABLE_HOST, CABLE_PORT
+  CABLE_HOME, CABLE_QUEUES, CABLE_CERTS, CABLE_HOST, CABLE_PORT,
+  CABLE_IDENTITIES, CABLE_SHARDS (optional, see identity.c), CABLE_SYNC (optional, see commit.c),
+  CABLE_QUEUE_MAXMSGS, CABLE_QUEUE_MAXBYTES (optional, 0 or empty for no limit),
+  CABLE_TMOUT (message expiry, 0 or empty to disable),
+  CABLE_WATCH (optional, see watch.c),
+  CABLE_GC_RATE (.del directories removed per second, 0 or empty for no limit),
+  CABLE_SESSION_MSGS, CABLE_SESSION_TTL (ephemeral key sessions, 0 or empty to disable),
+  CABLE_PREKEYS (published prekeys and prefetch from contacts, 0 or empty to disable)
 
   Testing environment:
   CABLE_NOLOOP, CABLE_NOWATCH
@@ -14,29 +21,52 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/file.h>
 #include <sys/inotify.h>
-#include <sys/select.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
 
 #include "daemon.h"
 #include "server.h"
+#include "service.h"
 #include "process.h"
+#include "event.h"
+#include "watch.h"
+#include "identity.h"
+#include "index.h"
+#include "sched.h"
+#include "wakeup.h"
+#include "commit.h"
+#include "purge.h"
+#include "worker.h"
 #include "util.h"
 
 
 /* environment variables */
 #define CABLE_HOME   "CABLE_HOME"
-#define CABLE_QUEUES "CABLE_QUEUES"
-#define CABLE_CERTS  "CABLE_CERTS"
 #define CABLE_HOST   "CABLE_HOST"
 #define CABLE_PORT   "CABLE_PORT"
-
-/* executables and subdirectories */
+#define CABLE_SYNC   "CABLE_SYNC"
+#define CABLE_QUEUE_MAXMSGS  "CABLE_QUEUE_MAXMSGS"
+#define CABLE_QUEUE_MAXBYTES "CABLE_QUEUE_MAXBYTES"
+#define CABLE_TMOUT  "CABLE_TMOUT"
+#define CABLE_WATCH  "CABLE_WATCH"
+#define CABLE_GC_RATE "CABLE_GC_RATE"
+#define CABLE_SESSION_MSGS "CABLE_SESSION_MSGS"
+#define CABLE_SESSION_TTL  "CABLE_SESSION_TTL"
+#define CABLE_PREKEYS      "CABLE_PREKEYS"
+
+/* executables */
 #define LOOP_NAME    "loop"
-#define QUEUE_NAME   "queue"
-#define RQUEUE_NAME  "rqueue"
-#define CERTS_NAME   "certs"
+#define LOOP_EXPIRE  "expire"
+#define PREKEYS_EXEC "prekeys"
+
+/* message creation time is the modification time of this file */
+#define TIMESTAMP_NAME "username"
 
 
 /* waiting strategy for inotify setup retries (e.g., after fs unmount) */
@@ -44,132 +74,272 @@
 #define WAIT_MULT   1.5
 #define WAIT_MAX     60
 
+/* max. wait for probe events after watches registration (sec) */
+#ifndef TESTING
+#define PROBE_TMOUT   2
+#else
+#define PROBE_TMOUT   1
+#endif
+
+/* temporary directories (tmp.*, <msgid>.new) are stale after (sec), as find -mtime +1 */
+#define STALE_AGE     (2*24*60*60)
+
 /*
   retry and limits strategies
+  retries of each entry back off exponentially from RETRY_TMOUT to RETRY_MAX
+  directories are rescanned every RESCAN_TMOUT, to catch missed events
+  disk usage of (r)queues is measured every USAGE_TMOUT (if limited)
   wait time for too many processes can be long, since SIGCHLD interrupts sleep
+  expiry handling which could not run (e.g., loop is busy) is retried after RETRY_TMOUT
+  launches beyond MAX_PROC running network-bound processes (or one per CPU core for
+  CPU-bound ones, at most MAX_PROC) are queued (up to MAX_PENDING)
 */
 #ifndef TESTING
-#define RETRY_TMOUT 150
-#define MAX_PROC    100
-#define WAIT_PROC   300
+#define RETRY_TMOUT  150
+#define RETRY_MAX   3600
+#define RESCAN_TMOUT 1800
+#define USAGE_TMOUT    60
+#define MAX_PROC     100
+#define MAX_PENDING 1000
 #else
-#define RETRY_TMOUT 5
-#define MAX_PROC    5
-#define WAIT_PROC   5
+#define RETRY_TMOUT    5
+#define RETRY_MAX     10
+#define RESCAN_TMOUT  30
+#define USAGE_TMOUT    5
+#define MAX_PROC       5
+#define MAX_PENDING   10
 #endif
 
-/* inotify mask for for (r)queue directories */
-#define INOTIFY_MASK (IN_ATTRIB | IN_MOVED_TO | IN_MOVE_SELF | IN_DONT_FOLLOW | IN_ONLYDIR)
+/* directory reading buffer */
+#define DENTS_BUFSZ   (256 * 1024)
 
+/* mode of created shard directories (as for message directories) */
+#define DCREAT_MODE   (S_IRWXU | S_IRWXG | S_IRWXO)
 
-/* inotify file descriptor and (r)queue directories watch descriptors */
-static int inotfd = -1, inotqwd = -1, inotrqwd = -1;
+/* change events for an entry within this window (sec) are coalesced */
+#define DEBOUNCE      0.1
 
+/* change events which run the loop (other events only maintain the msgid indexes) */
+#define INOTIFY_RUN  (IN_ATTRIB | IN_MOVED_TO)
+
+
+/* served identities */
+static struct identity *ids;
+static int             nids;
+
+/* ready fds, set by event callbacks */
+#define READ_WAKEUP  1
+#define READ_TIMER   2
+
+static int ready;
+
+/* watches must be re-registered (set by queue_changed()) */
+static int rereg;
+
+/* main loop events: timers are for retries / periodic checks (monotonic) and expiry (wall clock) */
+static struct event wakeev  = { -1, NULL },
+                    timerev = { -1, NULL }, expiryev = { -1, NULL };
+
+/* retry schedule of all (r)queue entries */
+static struct sched *sched;
+
+/* per-(r)queue bytes limit, and whether sizes are measured during scans (no collector) */
+static unsigned long long maxbytes;
+static int                scanbytes;
+
+/* message expiry timeout (sec) */
+static unsigned long long msgtmout;
+
+/* .del directories are removed by the collector thread (see purge.c) */
+static int gcok;
+
+/* prekeys maintenance executable (NULL if prekeys are disabled) */
+static char *prekeyspath;
+
+/* max. age of saved key sessions (sec, 0 if sessions are disabled) */
+static unsigned long long sessionttl;
 
-/* unregister inotify watches and dispose of allocated file descriptor */
-static void unreg_watches() {
-    if (inotfd != -1) {
-        /* ignore errors due to automatically removed watches (IN_IGNORED) */
-        if (inotqwd != -1) {
-            if (inotify_rm_watch(inotfd, inotqwd)  &&  errno != EINVAL)
-                warning("failed to remove inotify watch");
-            inotqwd = -1;
-        }
 
-        /* ignore errors due to automatically removed watches (IN_IGNORED) */
-        if (inotrqwd != -1) {
-            if (inotify_rm_watch(inotfd, inotrqwd)  &&  errno != EINVAL)
-                warning("failed to remove inotify watch");
-            inotrqwd = -1;
+/* register (r)queue (or all shards) watches of an identity, returning 1 if successful */
+static int reg_watches(struct identity *id) {
+    char path[PATH_MAX], pfx[SHARD_LENGTH+1];
+    int  ret = 1, rq, i;
+
+    for (rq = 0;  ret  &&  rq <= 1;  ++rq)
+        for (i = 0;  ret  &&  i < (id->sharded ? SHARD_COUNT : 1);  ++i) {
+            snprintf(pfx, sizeof(pfx), "%02x", (unsigned) i % SHARD_COUNT);
+
+            if (!queue_dir(id, rq, pfx, path, sizeof(path)))
+                ret = 0;
+
+            /* shards are created here, so that they can be watched */
+            else if (id->sharded  &&  mkdir(path, DCREAT_MODE)  &&  errno != EEXIST) {
+                flog(LOG_NOTICE, "could not create %s", path);
+                ret = 0;
+            }
+
+#ifdef TESTING
+            else if (getenv("CABLE_NOWATCH"))
+                continue;
+#endif
+
+            else
+                ret = watch_add(id, rq, path);
         }
 
-        /*
-          closing/reopening an inotify fd is an expensive operation, but must be done
-          because otherwise fd provides infinite stream of IN_IGNORED events
-        */
-        if (close(inotfd))
-            warning("could not close inotify fd");
-        inotfd = -1;
-    }
+    return ret;
 }
 
 
-/* register (r)queue-specific inotify watches, returning 1 if successful */
-static int reg_watches(const char *qpath, const char *rqpath) {
-    /* don't block on read(), since select() is used for polling */
-    if (inotfd == -1  &&  (inotfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
-        warning("failed to initialize inotify instance");
-        return 0;
+/*
+  try to register watches, unregistering them if not compeltely successful
+  hold an open fd during the attempt, to prevent unmount during the process
+*/
+static int try_reg_watches() {
+    int    mpfd, ret = 1, i;
+    struct stat st;
+
+    /* unregister existing watches */
+    watch_clear();
+
+    for (i = 0;  ret  &&  i < nids;  ++i) {
+        const char *qpath = ids[i].qpath, *rqpath = ids[i].rqpath;
+        ret = 0;
+
+        /* try to quickly open a fd (expect read access on qpath) */
+        if ((mpfd = open(qpath, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) != -1) {
+            if      (lstat(qpath,  &st) == -1  ||  !S_ISDIR(st.st_mode))
+                flog(LOG_NOTICE, "%s is not a directory, waiting...", qpath);
+            else if (lstat(rqpath, &st) == -1  ||  !S_ISDIR(st.st_mode))
+                flog(LOG_NOTICE, "%s is not a directory, waiting...", rqpath);
+            else
+                ret = reg_watches(&ids[i]);
+
+            /* free the pin fd */
+            if (close(mpfd))
+                warning("could not close pin directory");
+        }
+        else
+            flog(LOG_NOTICE, "failed to pin %s, waiting...", qpath);
     }
 
-#ifdef TESTING
-    if (getenv("CABLE_NOWATCH"))
-        return 1;
-#endif
+    /* if registering watches is unsuccessful, immediately unregister */
+    if (!ret)
+        watch_clear();
 
-    /* existing watch is ok */
-    if ((inotqwd  = inotify_add_watch(inotfd, qpath,  INOTIFY_MASK)) == -1) {
-        warning("could not add inotify watch");
-        return 0;
+    return ret;
+}
+
+
+/* arm timer at given absolute time (seconds of the timer's clock), or disarm if negative */
+static void arm_timer(int fd, double at) {
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+
+    if (at >= 0) {
+        its.it_value.tv_sec  = (time_t) at;
+        its.it_value.tv_nsec = (long) ((at - its.it_value.tv_sec) * 1e9);
+
+        /* zero value disarms the timer */
+        if (!its.it_value.tv_sec  &&  !its.it_value.tv_nsec)
+            its.it_value.tv_nsec = 1;
     }
 
-    /* existing watch is ok */
-    if ((inotrqwd = inotify_add_watch(inotfd, rqpath, INOTIFY_MASK)) == -1) {
-        warning("could not add inotify watch");
+    if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL))
+        warning("failed to arm timer");
+}
+
+
+static void wakeup_event(struct event *ev) {
+    ready |= READ_WAKEUP;
+}
+
+
+static void timer_event(struct event *ev) {
+    uint64_t count;
+
+    /* expiration count is not needed, timers are re-armed by the main loop */
+    if (read(ev->fd, &count, sizeof(count)) == -1  &&  errno != EAGAIN)
+        warning("reading timer failed");
+
+    ready |= READ_TIMER;
+}
+
+
+static int init_timer(struct event *ev, int clock) {
+    if ((ev->fd = timerfd_create(clock, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+        warning("failed to create timer");
         return 0;
     }
 
-    return 1;
+    ev->fn = timer_event;
+    return event_add(ev);
+}
+
+
+static void close_timer(struct event *ev) {
+    if (ev->fd != -1) {
+        event_del(ev);
+        if (close(ev->fd))
+            warning("could not close timer");
+        ev->fd = -1;
+    }
 }
 
 
 /*
-  try to register inotify watches, unregistering them if not compeltely successful
-  hold an open fd during the attempt, to prevent unmount during the process
+  wait for given number of seconds, while handling signals and child processes
+  (wakeup items are left queued, and watches are not registered)
 */
-static int try_reg_watches(const char *qpath, const char *rqpath) {
-    int    mpfd, ret = 0;
-    struct stat st;
+static void wait_events(double sec) {
+    arm_timer(timerev.fd, getmontime() + sec);
 
-    /* unregister existing inotify watches */
-    unreg_watches();
+    for (ready = 0;  !stop_requested()  &&  !(ready & READ_TIMER); ) {
+        event_run(-1);
 
-    /* try to quickly open a fd (expect read access on qpath) */
-    if ((mpfd = open(qpath, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) != -1) {
-        if      (lstat(qpath,  &st) == -1  ||  !S_ISDIR(st.st_mode))
-            flog(LOG_NOTICE, "%s is not a directory, waiting...", qpath);
-        else if (lstat(rqpath, &st) == -1  ||  !S_ISDIR(st.st_mode))
-            flog(LOG_NOTICE, "%s is not a directory, waiting...", rqpath);
+        if ((ready & READ_WAKEUP))
+            wakeup_clear();
+    }
+}
 
-        /* if registering inotify watches is unsuccessful, immediately unregister */
-        else if (reg_watches(qpath, rqpath))
-            ret = 1;
-        else
-            unreg_watches();
 
+/*
+  wait until probe events of registered watches arrive (directories without
+  them are polled), while handling signals, child processes and change events
+  returns 0 if watches must be re-registered
+*/
+static int probe_watches() {
+    if (!watch_probe_start())
+        return 1;
+
+    arm_timer(timerev.fd, getmontime() + PROBE_TMOUT);
+
+    for (rereg = 0, ready = 0;  !stop_requested()  &&  !rereg  &&  !(ready & READ_TIMER)  &&  watch_probing(); ) {
+        event_run(-1);
 
-        /* free the pin fd */
-        if (close(mpfd))
-            warning("could not close pin directory");
+        if ((ready & READ_WAKEUP))
+            wakeup_clear();
     }
-    else
-        flog(LOG_NOTICE, "failed to pin %s, waiting...", qpath);
 
-    return ret;
+    if (!rereg)
+        watch_probe_finish();
+
+    return !rereg;
 }
 
 
-/* retry registering inotify watches, using the retry strategy parameters */
-static void wait_reg_watches(const char *qpath, const char *rqpath) {
-    double slp = WAIT_INIT;
+/* retry registering watches, using the retry strategy parameters */
+static void wait_reg_watches() {
+    double slp = WAIT_INIT, start = getmontime();
 
     while (!stop_requested()) {
-        if (try_reg_watches(qpath, rqpath)) {
-            flog(LOG_DEBUG, "registered watches");
+        if (try_reg_watches()  &&  probe_watches()) {
+            flog(LOG_DEBUG, "registered watches, %.1f ms", (getmontime() - start) * 1e3);
             break;
         }
-        else {
-            sleepsec(slp);
+        else if (!stop_requested()) {
+            wait_events(slp);
 
             slp = (slp * WAIT_MULT);
             if (slp > WAIT_MAX)
@@ -180,133 +350,649 @@ static void wait_reg_watches(const char *qpath, const char *rqpath) {
 
 
 /* lower-case hexadecimal of correct length, possibly ending with ".del" */
-static int is_msgdir(char *s) {
+static int is_msgdir(const char *s) {
     size_t len = strlen(s);
-    int    res = 0;
 
-    if (len == MSGID_LENGTH)
-        res = vfyhex(MSGID_LENGTH, s);
+    return (len == MSGID_LENGTH  ||  (len == MSGID_LENGTH+4  &&  !strcmp(".del", s + MSGID_LENGTH)))
+        && vfyhexn(MSGID_LENGTH, s);
+}
+
+
+/* temporary directory of [send] (tmp.<10 alnum>, see mktemp) or [service] (<msgid>.new) */
+static int is_tmpdir(const char *s) {
+    size_t len = strlen(s), i;
 
-    else if (len == MSGID_LENGTH+4  &&  strcmp(".del", s + MSGID_LENGTH) == 0) {
-        s[MSGID_LENGTH] = '\0';
-        res = vfyhex(MSGID_LENGTH, s);
-        s[MSGID_LENGTH] = '.';
+    if (len == 4+10  &&  !strncmp("tmp.", s, 4)) {
+        for (i = 4;  i < len;  ++i)
+            if (!((s[i] >= '0'  &&  s[i] <= '9')  ||  (s[i] >= 'a'  &&  s[i] <= 'z')  ||  (s[i] >= 'A'  &&  s[i] <= 'Z')))
+                return 0;
+        return 1;
     }
 
-    return res;
+    return len == MSGID_LENGTH+4  &&  !strcmp(".new", s + MSGID_LENGTH)  &&  vfyhexn(MSGID_LENGTH, s);
 }
 
 
-/* run loop for given queue type and msgid[.del]; msgid is a volatile string */
-static void run_loop(const char *qtype, const char *msgid, const char *looppath) {
-    const char *args[] = { looppath, qtype, msgid, NULL };
+/* entries of interest during crash recovery */
+static int is_recoverable(const char *s) {
+    return is_msgdir(s)  ||  is_tmpdir(s);
+}
 
-    if (run_process(MAX_PROC, WAIT_PROC, args))
-        flog(LOG_INFO, "processing: %s %s", qtype, msgid);
-    else
-        flog(LOG_WARNING, "failed to launch: %s %s", qtype, msgid);
+
+/* launched loop, passed to loop_exited() */
+struct loop_run {
+    const struct identity *id;
+    int                   rq;
+    const char            *looppath;
+    char                  name[MSGID_LENGTH+4+1];
+};
+
+
+/*
+  queue msgid.del directory for the collector, instead of running the loop
+  (takes lr, which is passed to loop_exited() after removal)
+*/
+static int collect_del(const struct identity *id, int rq, const char *msgid, struct loop_run *lr) {
+    char dir[PATH_MAX], path[PATH_MAX];
+
+    if (!queue_dir(id, rq, msgid, dir, sizeof(dir))
+        ||  snprintf(path, sizeof(path), "%s/%s", dir, msgid) >= (int) sizeof(path)) {
+        free(lr);
+        return 0;
+    }
+
+    return purge_collect(path, lr);
+}
+
+
+/* flag file in a message directory */
+static int has_flag(int fd, const char *name) {
+    return !faccessat(fd, name, F_OK, AT_SYMLINK_NOFOLLOW);
 }
 
 
-/* return whether an event is ready on the inotify fd, with timeout */
-static int wait_read(int fd, double sec) {
-    struct timeval tv;
-    fd_set rfds;
-    int    ret;
+/*
+  launch class by the first stage [loop] will run (same order of flag file checks)
+  CPU-bound: crypto (ack.req, send.rdy, recv.rdy, peer.req) and expiry handling
+  network-bound: fetch and comm (ack.ok, send.req, send.ok, recv.ok, recv.req, .del)
+  completion work (ack, recv, fin, expiry) is urgent, since it frees resources
+*/
+static enum PROC_Class classify(const struct identity *id, int rq, const char *msgid,
+                                const char *mode, int *urgent) {
+    enum PROC_Class cls = PROC_NET;
+    char            dir[PATH_MAX], path[PATH_MAX];
+    int             fd;
+
+    *urgent = 1;
+
+    if (mode)
+        return PROC_CPU;
+
+    /* the entry may have vanished meanwhile */
+    if (msgid[MSGID_LENGTH]
+        ||  !queue_dir(id, rq, msgid, dir, sizeof(dir))
+        ||  snprintf(path, sizeof(path), "%s/%s", dir, msgid) >= (int) sizeof(path)
+        ||  (fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1)
+        return PROC_NET;
+
+    if (!rq) {
+        if (has_flag(fd, "ack.ok"))
+            cls = PROC_NET;
+        else if (has_flag(fd, "ack.req"))
+            cls = PROC_CPU;
+        else {
+            *urgent = 0;
+            if (!has_flag(fd, "send.req")  &&  has_flag(fd, "send.rdy"))
+                cls = PROC_CPU;
+        }
+    }
+    else {
+        if (has_flag(fd, "recv.rdy"))
+            cls = PROC_CPU;
+        else if (!has_flag(fd, "recv.ok")  &&  !has_flag(fd, "recv.req")) {
+            *urgent = 0;
+            if (has_flag(fd, "peer.req"))
+                cls = PROC_CPU;
+        }
+    }
+
+    if (close(fd))
+        warning("could not close message directory");
+
+    return cls;
+}
 
-    /* support negative arguments */
-    if (sec < 0)
-        sec = 0;
 
-    tv.tv_sec  = (time_t)      sec;
-    tv.tv_usec = (suseconds_t) ((sec - tv.tv_sec) * 1e6);
+/*
+  run loop for given identity, queue type and msgid[.del], with optional mode
+  msgid is a volatile string; process budget is shared by all identities
+  if a loop is already running for the entry, it is rerun once after exit instead
+  (.del entries are handed to the collector thread if it is running)
+*/
+static void run_loop(const struct identity *id, int rq, const char *msgid,
+                     const char *mode, const char *looppath) {
+    const char      *qtype  = rq ? RQUEUE_NAME : QUEUE_NAME;
+    const char      *args[] = { looppath, qtype, msgid, mode, NULL };
+    struct loop_run *lr;
+    enum PROC_Class cls;
+    int             urgent;
+
+    if (!sched_start(sched, id, rq, msgid)) {
+        flog(LOG_DEBUG, "already running: %s %s %s", id->username, qtype, msgid);
+        return;
+    }
 
-    FD_ZERO(&rfds);
-    FD_SET(fd, &rfds);
+    if (!((lr = (struct loop_run*) malloc(sizeof(struct loop_run)))))
+        error("malloc failed");
 
-    ret = select(fd+1, &rfds, NULL, NULL, &tv);
+    lr->id       = id;
+    lr->rq       = rq;
+    lr->looppath = looppath;
+    strncpy(lr->name, msgid, sizeof(lr->name) - 1);
+    lr->name[sizeof(lr->name) - 1] = '\0';
 
-    if (ret == -1  &&  errno != EINTR)
-        warning("waiting on inotify queue failed");
-    else if (ret > 0  &&  !(ret == 1  &&  FD_ISSET(fd, &rfds))) {
-        flog(LOG_WARNING, "unexpected fd while waiting on inotify queue");
-        ret = 0;
+    if (gcok  &&  msgid[MSGID_LENGTH]  &&  !mode) {
+        if (collect_del(id, rq, msgid, lr))
+            flog(LOG_DEBUG, "collecting: %s %s %s", id->username, qtype, msgid);
+        else {
+            sched_finish(sched, id, rq, msgid);
+            flog(LOG_WARNING, "failed to collect: %s %s %s", id->username, qtype, msgid);
+        }
+        return;
     }
 
-    return ret > 0;
+    cls = classify(id, rq, msgid, mode, &urgent);
+
+    switch (run_process(args, id->envp, cls, urgent, lr)) {
+    case PROC_STARTED:
+        flog(LOG_INFO, "processing: %s %s %s%s%s", id->username, qtype, msgid,
+             mode ? " " : "", mode ? mode : "");
+        break;
+
+    case PROC_QUEUED:
+        flog(LOG_DEBUG, "queued (%s%s): %s %s %s%s%s", cls == PROC_CPU ? "cpu" : "net",
+             urgent ? ", urgent" : "", id->username, qtype, msgid, mode ? " " : "", mode ? mode : "");
+        break;
+
+    /* failed launch was already finished by loop_exited() */
+    default:
+        flog(LOG_WARNING, "failed to launch: %s %s %s", id->username, qtype, msgid);
+    }
 }
 
 
+/* directory entry, as returned by getdents64 */
+struct linux_dirent64 {
+    uint64_t       d_ino;
+    int64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+
 /*
-  exec run_loop for all correct entries in (r)queue directory
-  NOT thread-safe, since readdir_r is unreliable with filenames > NAME_MAX
-  (e.g., NTFS + 255 unicode chars get truncated to 256 chars w/o terminating NUL)
+  invoke fn for all subdirectories in (r)queue directory with names accepted by match
+  uses getdents64 with a large buffer, so that big directories are read with
+  few system calls (names are NUL-terminated, even if longer than NAME_MAX)
 */
-static void retry_dir(const char *qtype, const char *qpath, const char *looppath) {
-    /* [offsetof(struct dirent, d_name) + fpathconf(fd, _PC_NAME_MAX) + 1] */
-    struct dirent *de;
-    struct stat   st;
-    DIR    *qdir;
+static void foreach_msgdir(const char *qpath, int (*match)(const char *name),
+                           void (*fn)(int qfd, const char *name, void *arg), void *arg) {
+    struct linux_dirent64 *de;
+    struct stat     st;
+    char   *buf;
+    long   sz, offset;
     int    fd, run;
 
-    flog(LOG_DEBUG, "retrying %s directories", qtype);
-
-    /* open directory (O_CLOEXEC is implied) */
-    if ((qdir = opendir(qpath))) {
-        /* get corresponding file descriptor for stat */
-        if ((fd = dirfd(qdir)) != -1) {
-            for (errno = 0;  !stop_requested()  &&  ((de = readdir(qdir))); ) {
-                run = 0;
-
-                /* some filesystems don't support d_type, need to stat entry */
-                if (de->d_type == DT_UNKNOWN  &&  is_msgdir(de->d_name)) {
-                    if (!fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW))
-                        run = S_ISDIR(st.st_mode);
-                    else
-                        warning("fstat failed");
-                }
-                else
-                    run = (de->d_type == DT_DIR  &&  is_msgdir(de->d_name));
+    if ((fd = open(qpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        warning("could not open directory");
+        return;
+    }
+
+    if (!((buf = (char*) malloc(DENTS_BUFSZ))))
+        error("malloc failed");
+
+    while (!stop_requested()  &&  (sz = syscall(SYS_getdents64, fd, buf, DENTS_BUFSZ)) > 0) {
+        /* signals are otherwise handled by the event loop only */
+        poll_signals();
 
-                if (run)
-                    run_loop(qtype, de->d_name, looppath);
+        for (offset = 0;  offset < sz  &&  !stop_requested();  offset += de->d_reclen) {
+            de  = (struct linux_dirent64*) (buf + offset);
+            run = 0;
+
+            /* some filesystems don't support d_type, need to stat entry */
+            if (de->d_type == DT_UNKNOWN  &&  match(de->d_name)) {
+                if (!fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+                    run = S_ISDIR(st.st_mode);
+                else
+                    warning("fstat failed");
             }
+            else
+                run = (de->d_type == DT_DIR  &&  match(de->d_name));
 
-            if (errno  &&  errno != EINTR)
-                warning("reading directory failed");
+            if (run)
+                fn(fd, de->d_name, arg);
         }
+    }
+
+    if (sz == -1  &&  errno != EINTR)
+        warning("reading directory failed");
+
+    free(buf);
+
+    if (close(fd))
+        warning("could not close directory");
+}
+
+
+/* update msgid index from an inotify event or directory entry (.del entries are not live) */
+static void update_index(struct msgid_index *idx, uint32_t mask, const char *name) {
+    if (!name[MSGID_LENGTH]) {
+        if ((mask & (IN_DELETE | IN_MOVED_FROM)))
+            index_remove(idx, name);
         else
-            warning("dirfd failed");
+            index_add(idx, name);
+    }
+}
+
+
+/* disk usage of files in (r)queue/<name> (message directories are flat) */
+static unsigned long long msgdir_size(int qfd, const char *name) {
+    unsigned long long size = 0;
+    struct dirent *de;
+    struct stat   st;
+    DIR    *mdir;
+    int    fd;
 
-        /* close directory */
-        if (closedir(qdir))
-            warning("could not close directory");
+    if (!fstatat(qfd, name, &st, AT_SYMLINK_NOFOLLOW))
+        size += st.st_blocks * 512ULL;
+
+    if ((fd = openat(qfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) != -1) {
+        /* closedir() closes fd */
+        if ((mdir = fdopendir(fd))) {
+            while ((de = readdir(mdir)))
+                if (!fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)  &&  !S_ISDIR(st.st_mode))
+                    size += st.st_blocks * 512ULL;
+
+            if (closedir(mdir))
+                warning("could not close directory");
+        }
+        else
+            close(fd);
     }
+
+    return size;
+}
+
+
+/* measured (r)queue disk usage (called from the collector thread) */
+static void queue_usage(void *arg, unsigned long long bytes) {
+    index_set_bytes((struct msgid_index*) arg, bytes);
+}
+
+
+struct scan_arg {
+    const struct identity *id;
+    int                   rq;
+    const char            *path;
+    int                   recover;
+    double                now;
+    unsigned long long    bytes;
+    unsigned long         flat, stale;
+};
+
+/*
+  arm expiry timer of a scheduled msgid entry (not .del), unless already armed
+  messages expire CABLE_TMOUT seconds after creation (as recorded by username file)
+*/
+static void set_expiry(const struct identity *id, int rq, const char *name) {
+    char        dir[PATH_MAX], path[PATH_MAX];
+    struct stat st;
+
+    if (!msgtmout  ||  name[MSGID_LENGTH]  ||  sched_has_expiry(sched, id, rq, name))
+        return;
+
+    /* username is not yet written during message creation, timer is set later */
+    if (queue_dir(id, rq, name, dir, sizeof(dir))
+        &&  snprintf(path, sizeof(path), "%s/%s/" TIMESTAMP_NAME, dir, name) < (int) sizeof(path)
+        &&  !stat(path, &st))
+        sched_set_expiry(sched, id, rq, name, st.st_mtime + (time_t) msgtmout);
+}
+
+
+/* hand a stale temporary directory (left by a crash) over for removal */
+static void stale_entry(int qfd, const char *name, struct scan_arg *sa) {
+    char        path[PATH_MAX];
+    struct stat st;
+
+    if (!fstatat(qfd, name, &st, AT_SYMLINK_NOFOLLOW)  &&  st.st_mtime <= time(NULL) - STALE_AGE
+        &&  snprintf(path, sizeof(path), "%s/%s", sa->path, name) < (int) sizeof(path)) {
+        purge_stale(path);
+        ++sa->stale;
+    }
+}
+
+
+static void scan_entry(int qfd, const char *name, void *arg) {
+    struct scan_arg *sa = (struct scan_arg*) arg;
+
+    /* temporary directories are only matched during recovery */
+    if (!is_msgdir(name)) {
+        stale_entry(qfd, name, sa);
+        return;
+    }
+
+    update_index(sa->rq ? sa->id->rqidx : sa->id->qidx, 0, name);
+
+    /*
+      entries pending since startup are due immediately (launches are throttled by
+      process accounting), entries missed by inotify are spread over the retry period
+    */
+    sched_put(sched, sa->id, sa->rq, name,
+              sa->now + (sa->recover ? 0 : RETRY_TMOUT * (rand_shift() + 1) / 2));
+    set_expiry(sa->id, sa->rq, name);
+
+    if (scanbytes)
+        sa->bytes += msgdir_size(qfd, name);
+}
+
+
+/* counts entries left in (r)queue itself by a sharded layout */
+static void count_entry(int qfd, const char *name, void *arg) {
+    struct scan_arg *sa = (struct scan_arg*) arg;
+
+    if (!is_msgdir(name))
+        stale_entry(qfd, name, sa);
     else
-        warning("could not open directory");
+        ++sa->flat;
+}
+
+
+/*
+  rebuild msgid index and retry schedule from (r)queue directory
+  (after inotify watches registration, or in background)
+  during recovery, stale temporary directories are collected in the same pass
+  the index is left untrusted if the scan was interrupted or watches are disabled
+  returns the number of stale directories
+*/
+static unsigned long scan_queue(const struct identity *id, int rq, int recover) {
+    struct msgid_index *idx = rq ? id->rqidx : id->qidx;
+    struct scan_arg    sa;
+    char               path[PATH_MAX], pfx[SHARD_LENGTH+1];
+    int                (*match)(const char*) = recover ? is_recoverable : is_msgdir;
+    int                i;
+
+    sa.id      = id;
+    sa.rq      = rq;
+    sa.path    = path;
+    sa.recover = recover;
+    sa.now     = getmontime();
+    sa.bytes   = 0;
+    sa.flat    = 0;
+    sa.stale   = 0;
+
+    index_invalidate(idx);
+
+    for (i = 0;  i < (id->sharded ? SHARD_COUNT : 1)  &&  !stop_requested();  ++i) {
+        snprintf(pfx, sizeof(pfx), "%02x", (unsigned) i % SHARD_COUNT);
+        if (queue_dir(id, rq, pfx, path, sizeof(path)))
+            foreach_msgdir(path, match, scan_entry, &sa);
+    }
+
+    /* entries of a flat layout are not served (see cable/shard) */
+    if (id->sharded  &&  !stop_requested()) {
+        snprintf(path, sizeof(path), "%s", rq ? id->rqpath : id->qpath);
+        foreach_msgdir(path, match, count_entry, &sa);
+
+        if (sa.flat)
+            flog(LOG_WARNING, "%s has %lu unsharded entries", path, sa.flat);
+    }
+
+    if (!stop_requested()) {
+        index_validate(idx);
+#ifdef TESTING
+        /* events are not delivered, so the index cannot be trusted */
+        if (getenv("CABLE_NOWATCH"))
+            index_invalidate(idx);
+#endif
+
+        if (scanbytes)
+            index_set_bytes(idx, sa.bytes);
+
+        if (index_full(idx))
+            flog(LOG_NOTICE, "%s %s is full", id->username, rq ? RQUEUE_NAME : QUEUE_NAME);
+    }
+
+    return sa.stale;
+}
+
+
+/*
+  scan (r)queue directories of all identities, dropping vanished entries from schedule
+  recovery (at startup) schedules all entries immediately, and removes stale
+  temporary directories in background (see purge.c)
+*/
+static void scan_all(int recover) {
+    double        start = getmontime();
+    unsigned long stale = 0;
+    int           i;
+
+    sched_begin_scan(sched);
+
+    for (i = 0;  i < nids  &&  !stop_requested();  ++i) {
+        stale += scan_queue(&ids[i], 0, recover);
+        stale += scan_queue(&ids[i], 1, recover);
+    }
+
+    if (!stop_requested()) {
+        sched_end_scan(sched);
+
+        if (recover) {
+            flog(LOG_INFO, "recovery: %lu entries, %lu stale directories, %.1f ms",
+                 sched_count(sched), stale, (getmontime() - start) * 1e3);
+            purge_start();
+        }
+        else
+            flog(LOG_DEBUG, "scanned directories: %lu entries, %.1f ms",
+                 sched_count(sched), (getmontime() - start) * 1e3);
+    }
+}
+
+
+/*
+  refill published prekeys (CPU-bound) and prefetch contacts' prekeys
+  (network-bound) of all identities, queued behind message work
+  (untagged launches, see loop_exited())
+*/
+static void run_prekeys() {
+    const char *refill[] = { prekeyspath, "refill", NULL },
+               *fetch[]  = { prekeyspath, "fetch",  NULL };
+    int        i;
+
+    for (i = 0;  prekeyspath  &&  i < nids  &&  !stop_requested();  ++i)
+        if (run_process(refill, ids[i].envp, PROC_CPU, 0, NULL) == PROC_ERR
+            ||  run_process(fetch, ids[i].envp, PROC_NET, 0, NULL) == PROC_ERR)
+            flog(LOG_WARNING, "failed to launch prekeys: %s", ids[i].username);
+}
+
+
+/*
+  queue saved key sessions (session/ of senders, rsession/ of recipients)
+  older than CABLE_SESSION_TTL for the collector, so that their private keys
+  don't outlive the forward secrecy window (age of derive.pem, as claims
+  check it; of the directory, if there is none)
+*/
+static void expire_sessions() {
+    const char    *sesdirs[2];
+    char          path[PATH_MAX];
+    struct stat   st;
+    struct dirent *de;
+    DIR           *dir;
+    time_t        now = time(NULL);
+    unsigned long count = 0;
+    int           i, s;
+
+    for (i = 0;  gcok  &&  i < nids  &&  !stop_requested();  ++i) {
+        sesdirs[0] = ids[i].spath;
+        sesdirs[1] = ids[i].rspath;
+
+        for (s = 0;  s < 2;  ++s) {
+            if (!((dir = opendir(sesdirs[s]))))
+                continue;
+
+            while ((de = readdir(dir))) {
+                if (de->d_name[0] == '.'
+                    ||  snprintf(path, sizeof(path), "%s/derive.pem", de->d_name) >= (int) sizeof(path)
+                    ||  (fstatat(dirfd(dir), path, &st, 0)  &&  fstatat(dirfd(dir), de->d_name, &st, 0))
+                    ||  (unsigned long long) (now - st.st_mtime) < sessionttl
+                    ||  snprintf(path, sizeof(path), "%s/%s", sesdirs[s], de->d_name) >= (int) sizeof(path))
+                    continue;
+
+                if (purge_collect(path, NULL))
+                    ++count;
+            }
+
+            if (closedir(dir))
+                warning("could not close session directory");
+        }
+    }
+
+    if (count)
+        flog(LOG_INFO, "expired %lu key sessions", count);
+}
+
+
+/* run loop for an entry now, and schedule a retry */
+static void run_entry(const struct identity *id, int rq, const char *name, const char *looppath) {
+    sched_reset(sched, id, rq, name, getmontime());
+    run_loop(id, rq, name, NULL, looppath);
+    set_expiry(id, rq, name);
+}
+
+
+/* exit hook: rerun loop if requested while it was running (prekeys runs are untagged) */
+static void loop_exited(void *tag, int status) {
+    struct loop_run *lr = (struct loop_run*) tag;
+
+    if (lr  &&  sched_finish(sched, lr->id, lr->rq, lr->name)  &&  !stop_requested())
+        run_entry(lr->id, lr->rq, lr->name, lr->looppath);
+}
+
+
+/* run loops for entries whose retry deadline has passed */
+static void run_due(const char *looppath) {
+    const struct identity *id;
+    char   name[MSGID_LENGTH+4+1];
+    int    rq, count = 0;
+
+    /* launches resume as children exit */
+    while (!stop_requested()  &&  !process_full()  &&  sched_due(sched, getmontime(), &id, &rq, name)) {
+        run_loop(id, rq, name, NULL, looppath);
+        ++count;
+    }
+
+    if (count)
+        flog(LOG_DEBUG, "retried %d entries", count);
+}
+
+
+/*
+  run expiry handling (rejection notice, rename to .del) for timed out messages
+  the timer is re-armed, in case the entry is not renamed (e.g., loop holds the lock)
+*/
+static void run_expired(const char *looppath) {
+    const struct identity *id;
+    char   name[MSGID_LENGTH+4+1];
+    int    rq;
+
+    while (!stop_requested()  &&  sched_expired(sched, time(NULL), &id, &rq, name)) {
+        run_loop(id, rq, name, LOOP_EXPIRE, looppath);
+        sched_set_expiry(sched, id, rq, name, time(NULL) + RETRY_TMOUT);
+    }
+}
+
+
+/* watch handler: maintain index and schedule of changed (r)queue entries */
+static void queue_changed(struct identity *id, int rq, uint32_t mask, const char *name) {
+    if (!id)
+        rereg = 1;
+
+    /* ignore non-subdirectory events, and events with incorrect name */
+    else if (!rereg  &&  (mask & IN_ISDIR)  &&  is_msgdir(name)) {
+        /* index is updated before loop possibly contacts the peer */
+        update_index(rq ? id->rqidx : id->qidx, mask, name);
+
+        /* bursts of events for the same entry result in a single run */
+        if ((mask & INOTIFY_RUN)) {
+            sched_kick(sched, id, rq, name, getmontime() + DEBOUNCE);
+            set_expiry(id, rq, name);
+        }
+        else if ((mask & (IN_DELETE | IN_MOVED_FROM)))
+            sched_remove(sched, id, rq, name);
+        else {
+            sched_put(sched, id, rq, name, getmontime() + RETRY_TMOUT);
+            set_expiry(id, rq, name);
+        }
+    }
+}
+
+
+/* run loops for work items handed over by webserver threads */
+static void run_wakeups(const char *looppath) {
+    const struct identity *id;
+    char   msgid[MSGID_LENGTH+1];
+    int    rq;
+
+    wakeup_clear();
+
+    while (!stop_requested()  &&  wakeup_pop(&id, &rq, msgid))
+        run_entry(id, rq, msgid, looppath);
+}
+
+
+/* non-negative integer environment variable, 0 if not set or empty */
+static unsigned long long env_limit(const char *var) {
+    const char         *value = getenv(var);
+    char               *end;
+    unsigned long long res = 0;
+
+    if (value  &&  *value) {
+        errno = 0;
+        res   = strtoull(value, &end, 10);
+
+        if (errno  ||  *end  ||  *value == '-') {
+            flog(LOG_WARNING, "bad %s value: %s", var, value);
+            res = 0;
+        }
+    }
+
+    return res;
 }
 
 
 int main() {
-    /* using NAME_MAX prevents EINVAL on read() (twice for UTF-16 on NTFS) */
-    char   buf[sizeof(struct inotify_event) + NAME_MAX*2 + 1];
-    char   *crtpath, *qpath, *rqpath, *looppath, *lsthost, *lstport;
-    int    sz, offset, rereg, evqok, retryid;
-    struct inotify_event *iev;
-    double retrytmout, lastclock;
+    char   *looppath, *lsthost, *lstport, *syncmode, *watchmode;
+    int    i, recover = 1;
+    long   ncpu;
+    double rescantmout, lastscan, next;
+    size_t maxmsgs;
 
 
     /* init logging */
     syslog_init();
 
 
+    /* fork the worker zygote while the process is small and single-threaded */
+    if (!init_workers())
+        flog(LOG_WARNING, "failed to start zygote, launching loops directly");
+
+
     /* extract environment */
-    crtpath  = alloc_env(CABLE_CERTS,  "/" CERTS_NAME);
-    qpath    = alloc_env(CABLE_QUEUES, "/" QUEUE_NAME);
-    rqpath   = alloc_env(CABLE_QUEUES, "/" RQUEUE_NAME);
     looppath = alloc_env(CABLE_HOME,   "/" LOOP_NAME);
     lsthost  = alloc_env(CABLE_HOST,   "");
     lstport  = alloc_env(CABLE_PORT,   "");
+    syncmode = getenv(CABLE_SYNC);
+    watchmode = getenv(CABLE_WATCH);
 
 
     /* initialize rng */
@@ -314,103 +1000,210 @@ int main() {
         warning("failed to initialize RNG");
 
 
-    /* initialize process accounting */
-    if (!init_process_acc())
+    /* initialize event loop and process accounting (signals are blocked for all threads) */
+    if (!init_events()  ||  !init_timer(&timerev, CLOCK_MONOTONIC)  ||  !init_timer(&expiryev, CLOCK_REALTIME)) {
+        flog(LOG_ERR, "failed to initialize event loop");
+        return EXIT_FAILURE;
+    }
+
+    /* CPU-bound stages are capped at the number of cores */
+    if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        ncpu = 1;
+    else if (ncpu > MAX_PROC)
+        ncpu = MAX_PROC;
+
+    if (!init_process_acc(ncpu, MAX_PROC, MAX_PENDING, loop_exited))
         warning("failed to initialize process accounting");
 
+    /* workers for the startup backlog */
+    worker_prefork(ncpu);
+
+    /* removal of .del directories, reported like loop exits */
+    if (!((gcok = init_purge(env_limit(CABLE_GC_RATE), loop_exited))))
+        flog(LOG_WARNING, "failed to start collector, .del directories are removed by loops");
+
+    if (!init_watch(watchmode, queue_changed))
+        flog(LOG_WARNING, "unknown %s mode: %s", CABLE_WATCH, watchmode);
+
+
+    /* load served identities (msgid indexes are untrusted until first scan) */
+    if (!((nids = load_identities(&ids)))) {
+        flog(LOG_ERR, "failed to load identities");
+        return EXIT_FAILURE;
+    }
+
+
+    /* (r)queue limits (webserver refuses new messages if rqueue is full) */
+    maxmsgs  = env_limit(CABLE_QUEUE_MAXMSGS);
+    maxbytes = env_limit(CABLE_QUEUE_MAXBYTES);
+    msgtmout = env_limit(CABLE_TMOUT);
+
+    if (!msgtmout)
+        flog(LOG_WARNING, "%s is not set, messages do not expire", CABLE_TMOUT);
+
+    for (i = 0;  i < nids;  ++i) {
+        index_set_limits(ids[i].qidx,  maxmsgs, maxbytes);
+        index_set_limits(ids[i].rqidx, maxmsgs, maxbytes);
+    }
+
+    /* disk usage is measured by the collector thread (or by full scans, as fallback) */
+    for (i = 0;  maxbytes  &&  i < nids;  ++i)
+        if (!purge_usage(ids[i].qpath,  USAGE_TMOUT, queue_usage, ids[i].qidx)
+            ||  !purge_usage(ids[i].rqpath, USAGE_TMOUT, queue_usage, ids[i].rqidx))
+            scanbytes = 1;
+
+
+    /* retry schedule and expiry timers (initially filled by directory scans) */
+    sched = sched_create(RETRY_TMOUT, RETRY_MAX);
+
+
+    /* initialize wakeup queue (webserver threads touch message directories if failed) */
+    if (wakeup_init()) {
+        wakeev.fd = wakeup_fd();
+        wakeev.fn = wakeup_event;
+        if (!event_add(&wakeev))
+            wakeev.fd = -1;
+    }
+
+
+    /* initialize durability mode (before webserver threads use it) */
+    if (syncmode  &&  *syncmode  &&  strcmp(syncmode, "group"))
+        flog(LOG_WARNING, "unknown %s mode: %s", CABLE_SYNC, syncmode);
+
+    if (!init_commit(syncmode  &&  !strcmp(syncmode, "group") ? SYNC_GROUP : SYNC_NONE))
+        flog(LOG_WARNING, "failed to start group commit, syncing each request");
+
+
+    /* ephemeral key sessions offered to peers (ses/... requests; all saved ones expire if disabled) */
+    if (env_limit(CABLE_SESSION_MSGS))
+        sessionttl = env_limit(CABLE_SESSION_TTL);
+    service_set_session(env_limit(CABLE_SESSION_MSGS), sessionttl);
+
+    /* prekeys claimed by peers (pre/... requests), and maintained at each scan */
+    if (env_limit(CABLE_PREKEYS)) {
+        prekeyspath = alloc_env(CABLE_HOME, "/" PREKEYS_EXEC);
+        service_set_prekeys(1);
+    }
+
 
     /* initialize webserver */
-    if (!init_server(crtpath, qpath, rqpath, lsthost, lstport)) {
+    if (!init_server(lsthost, lstport)) {
         flog(LOG_ERR, "failed to initialize webserver");
         return EXIT_FAILURE;
     }
 
 
+    /* slow background rescans */
+    rescantmout = RESCAN_TMOUT;
+#ifdef TESTING
+    /* events are not delivered, so rescan at retry rate */
+    if (getenv("CABLE_NOWATCH"))
+        rescantmout = RETRY_TMOUT;
+#endif
+
+
     /* try to reregister watches as long as no signal caught */
-    for (lastclock = getmontime(), retryid = 0;  !stop_requested(); ) {
+    while (!stop_requested()) {
         /* support empty CABLE_NOLOOP when testing, to act as pure server */
 #ifdef TESTING
         if (getenv("CABLE_NOLOOP")) {
-            sleepsec(RETRY_TMOUT);
+            wait_events(RETRY_TMOUT);
             continue;
         }
 #endif
 
-        wait_reg_watches(qpath, rqpath);
-
-        /* read events as long as no signal caught and no unmount / move_self / etc. events read */
-        for (rereg = evqok = 0;  !stop_requested()  &&  !rereg; ) {
-            /* wait for an event, or timeout (later blocking read() results in error) */
-            retrytmout = RETRY_TMOUT + RETRY_TMOUT * (rand_shift() / 2);
-
-            if (wait_read(inotfd, retrytmout - (getmontime() - lastclock))) {
-                /* read events (non-blocking), taking care to handle interrupts due to signals */
-                if ((sz = read(inotfd, buf, sizeof(buf))) == -1  &&  errno != EINTR) {
-                    /* happens buffer is too small (e.g., NTFS + 255 unicode chars) */
-                    warning("error while reading from inotify queue");
-                    rereg = 1;
-                }
-
-                /* process all events in buffer, sz = -1 and 0 are automatically ignored */
-                for (offset = 0;  offset < sz  &&  !stop_requested()  &&  !rereg;  evqok = 1) {
-                    /* get handler to next event in read buffer, and update offset */
-                    iev     = (struct inotify_event*) (buf + offset);
-                    offset += sizeof(struct inotify_event) + iev->len;
-
-                    /*
-                      IN_IGNORED is triggered by watched directory removal / fs unmount
-                      IN_MOVE_SELF is only triggered by move of actual watched directory
-                      (i.e., not its parent)
-                    */
-                    if ((iev->mask & (IN_IGNORED | IN_UNMOUNT | IN_Q_OVERFLOW | IN_MOVE_SELF)))
-                        rereg = 1;
-
-                    /* ignore non-subdirectory events, and events with incorrect name */
-                    else if (iev->len > 0  &&  (iev->mask & IN_ISDIR)  &&  is_msgdir(iev->name)) {
-                        assert(iev->wd == inotqwd  ||  iev->wd == inotrqwd);
-                        if (iev->wd == inotqwd  ||  iev->wd == inotrqwd) {
-                            /* stop can be indicated here (while waiting for less processes) */
-                            const char *qtype = (iev->wd == inotqwd) ? QUEUE_NAME : RQUEUE_NAME;
-                            run_loop(qtype, iev->name, looppath);
-                        }
-                        else
-                            flog(LOG_WARNING, "unknown watch descriptor");
-                    }
-                }
-            }
+        /* events may have been lost since the last scan */
+        for (i = 0;  i < nids;  ++i) {
+            index_invalidate(ids[i].qidx);
+            index_invalidate(ids[i].rqidx);
+        }
 
-            /*
-              if sufficient time passed since last retries, retry again
-            */
-            if (!stop_requested()  &&  getmontime() - lastclock >= retrytmout) {
-                /* alternate between queue dirs to prevent lock starvation on self-send */
-                if ((retryid ^= 1))
-                    retry_dir(QUEUE_NAME,  qpath,  looppath);
-                else
-                    retry_dir(RQUEUE_NAME, rqpath, looppath);
+        wait_reg_watches();
+
+        /* startup scan is the crash recovery pass */
+        scan_all(recover);
+        lastscan = getmontime();
+        recover  = 0;
+
+        /* work items left queued while waiting for watches */
+        run_wakeups(looppath);
 
-                lastclock = getmontime();
+        /* prekeys are maintained, and key sessions expired, in otherwise idle time */
+        run_prekeys();
+        expire_sessions();
 
-                /* inotify is apparently unreliable on fuse, so reregister when no events */
-                if (!evqok)
-                    rereg = 1;
-                evqok = 0;
+        /* handle events as long as no signal caught and no unmount / move_self / etc. events seen */
+        for (rereg = 0;  !stop_requested()  &&  !rereg; ) {
+            /*
+              wait for an event, next due retry, expiry, directory poll, or periodic check
+              (due retries wait for child exit if no launches are possible)
+            */
+            next = lastscan + rescantmout;
+            if (sched_next(sched) >= 0  &&  next > sched_next(sched)  &&  !process_full())
+                next = sched_next(sched);
+            if (watch_next_poll() >= 0  &&  next > watch_next_poll())
+                next = watch_next_poll();
+
+            arm_timer(timerev.fd,  next);
+            arm_timer(expiryev.fd, sched_next_expiry(sched));
+
+            /* change events are handled by queue_changed() */
+            ready = 0;
+            event_run(-1);
+
+            /* work items from webserver threads */
+            if ((ready & READ_WAKEUP))
+                run_wakeups(looppath);
+
+            /* directories on filesystems without change notification */
+            if (!stop_requested())
+                watch_poll();
+
+            /* launch due retries and expiry handling */
+            if (!stop_requested())
+                run_due(looppath);
+            if (!stop_requested())
+                run_expired(looppath);
+
+            /* slow background rescan, for entries missed by change notification */
+            if (!stop_requested()  &&  getmontime() - lastscan >= rescantmout) {
+                scan_all(0);
+                lastscan = getmontime();
+
+                run_prekeys();
+                expire_sessions();
+
+                log_process_load(LOG_DEBUG);
             }
         }
     }
 
 
-    unreg_watches();
+    shutdown_watch();
+    shutdown_purge();
 
     if (!shutdown_server())
         flog(LOG_WARNING, "failed to shutdown webserver");
 
+    shutdown_commit();
+
+    if (wakeev.fd != -1)
+        event_del(&wakeev);
+    wakeup_close();
+
+    shutdown_workers();
+    shutdown_process_acc();
+    close_timer(&timerev);
+    close_timer(&expiryev);
+    shutdown_events();
+
+    free_identities(ids, nids);
+    sched_destroy(sched);
+
+    dealloc_env(prekeyspath);
     dealloc_env(lstport);
     dealloc_env(lsthost);
     dealloc_env(looppath);
-    dealloc_env(rqpath);
-    dealloc_env(qpath);
-    dealloc_env(crtpath);
 
     flog(LOG_INFO, "exiting");
     closelog();
@@ -7,4 +7,16 @@
 #define MSGID_LENGTH    40
 #define USERNAME_LENGTH 32
 
+/* (r)queue and certificates subdirectories */
+#define QUEUE_NAME      "queue"
+#define RQUEUE_NAME     "rqueue"
+#define SESSION_NAME    "session"
+#define RSESSION_NAME   "rsession"
+#define PREKEYS_NAME    "prekeys"
+#define CERTS_NAME      "certs"
+
+/* sharded (r)queue layout: (r)queue/<first SHARD_LENGTH msgid digits>/<msgid> */
+#define SHARD_LENGTH    2
+#define SHARD_COUNT     256
+
 #endif
@@ -0,0 +1,98 @@
+/*
+  Event loop of the daemon's main thread: an epoll instance multiplexing
+  the inotify, wakeup, signal, timer and child process descriptors.
+
+  Callbacks run in the main thread, and may add or remove events (events
+  removed by a callback are not reported later in the same round).
+
+  NOT thread-safe
+*/
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include "event.h"
+#include "util.h"
+
+
+/* max. events handled per event_run() */
+#define MAX_EVENTS 64
+
+
+static int                epfd = -1;
+
+/* events of the current round, for invalidation by event_del() */
+static struct epoll_event evs[MAX_EVENTS];
+static int                nevs;
+
+
+int init_events() {
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        warning("failed to create epoll instance");
+        return 0;
+    }
+
+    return 1;
+}
+
+
+void shutdown_events() {
+    if (epfd != -1) {
+        if (close(epfd))
+            warning("could not close epoll instance");
+        epfd = -1;
+    }
+}
+
+
+int event_add(struct event *ev) {
+    struct epoll_event ee;
+
+    ee.events   = EPOLLIN;
+    ee.data.ptr = ev;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, ev->fd, &ee)) {
+        warning("failed to add epoll event");
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/* must be called before ev->fd is closed */
+void event_del(struct event *ev) {
+    int i;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_DEL, ev->fd, NULL))
+        warning("failed to remove epoll event");
+
+    for (i = 0;  i < nevs;  ++i)
+        if (evs[i].data.ptr == ev)
+            evs[i].data.ptr = NULL;
+}
+
+
+int event_run(int timeout) {
+    struct event *ev;
+    int          i;
+
+    if ((nevs = epoll_wait(epfd, evs, MAX_EVENTS, timeout)) == -1) {
+        nevs = 0;
+
+        if (errno != EINTR) {
+            warning("waiting for events failed");
+            return -1;
+        }
+    }
+
+    for (i = 0;  i < nevs;  ++i)
+        if ((ev = (struct event*) evs[i].data.ptr))
+            ev->fn(ev);
+
+    i    = nevs;
+    nevs = 0;
+
+    return i;
+}
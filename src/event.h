@@ -0,0 +1,20 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+/* registered descriptor, embedded in the caller's structure */
+struct event {
+    int  fd;
+    void (*fn)(struct event *ev);
+};
+
+int init_events();
+void shutdown_events();
+
+/* watch ev->fd for input, fn is called from event_run() */
+int event_add(struct event *ev);
+void event_del(struct event *ev);
+
+/* wait for events (timeout in ms, -1 for none) and run callbacks */
+int event_run(int timeout);
+
+#endif
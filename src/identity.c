@@ -0,0 +1,326 @@
+/*
+  Identities (cables usernames) served by a single daemon.
+
+  By default, the daemon serves the identity given by CABLE_CERTS and
+  CABLE_QUEUES.  If CABLE_IDENTITIES is set, it names a file with one
+  identity per line (empty lines and lines starting with '#' are ignored):
+
+    <CABLE_CERTS> <CABLE_QUEUES> <CABLE_INBOX>
+
+  Loop processes for such identities are executed with the corresponding
+  environment variables replaced.
+
+  If CABLE_SHARDS is non-empty, (r)queue entries of all identities are
+  kept in subdirectories named by the first two msgid digits.
+
+  Identities are read-only after loading, so lookups are thread-safe.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "identity.h"
+#include "index.h"
+#include "util.h"
+
+
+/* environment variables */
+#define CABLE_IDENTITIES "CABLE_IDENTITIES"
+#define CABLE_CERTS      "CABLE_CERTS"
+#define CABLE_QUEUES     "CABLE_QUEUES"
+#define CABLE_INBOX      "CABLE_INBOX"
+#define CABLE_SHARDS     "CABLE_SHARDS"
+
+#define USERNAME_SFX     "username"
+
+/* max. identities file line length */
+#define MAX_LINE_LENGTH  4096
+
+
+extern char **environ;
+
+
+/* open-addressing username -> identity map (power of 2 size) */
+static const struct identity **idmap;
+static size_t               idmapsz;
+
+
+static char* concat(const char *s, const char *sfx) {
+    char *buf;
+
+    if (!((buf = (char*) malloc(strlen(s) + strlen(sfx) + 1))))
+        error("malloc failed");
+
+    strcpy(buf, s);
+    strcat(buf, sfx);
+
+    return buf;
+}
+
+
+static int read_username(struct identity *id) {
+    int  res = 0, len;
+    FILE *file;
+    char path[strlen(id->crtpath) + sizeof("/" USERNAME_SFX)];
+
+    strcpy(path, id->crtpath);
+    strcat(path, "/" USERNAME_SFX);
+
+    if ((file = fopen(path, "re"))) {
+        char username[USERNAME_LENGTH+2];
+
+        if(fgets(username, sizeof(username), file)  &&  fgetc(file) == EOF) {
+            len = strlen(username);
+            if (username[len-1] == '\n')
+                username[len-1] = '\0';
+
+            if (vfybase32(USERNAME_LENGTH, username)) {
+                strcpy(id->username, username);
+                res = 1;
+            }
+        }
+
+        if (fclose(file))
+            res = 0;
+    }
+
+    if (!res)
+        flog(LOG_ERR, "could not read %s/%s", id->crtpath, USERNAME_SFX);
+
+    return res;
+}
+
+
+/* copy of environment with CABLE_{CERTS,QUEUES,INBOX} replaced */
+static char** alloc_envp(const char *certs, const char *queues, const char *inbox) {
+    const char *const vars[] = { CABLE_CERTS, CABLE_QUEUES, CABLE_INBOX };
+    const char *const vals[] = { certs,       queues,       inbox       };
+    char   **envp;
+    size_t count, i, j, k, len;
+
+    for (count = 0;  environ[count];  ++count)
+        ;
+
+    if (!((envp = (char**) malloc((count + 3 + 1) * sizeof(char*)))))
+        error("malloc failed");
+
+    for (i = k = 0;  i < count;  ++i) {
+        for (j = 0;  j < 3;  ++j) {
+            len = strlen(vars[j]);
+            if (!strncmp(environ[i], vars[j], len)  &&  environ[i][len] == '=')
+                break;
+        }
+
+        if (j == 3)
+            envp[k++] = concat(environ[i], "");
+    }
+
+    for (j = 0;  j < 3;  ++j) {
+        char var[strlen(vars[j]) + 2];
+
+        strcpy(var, vars[j]);
+        strcat(var, "=");
+        envp[k++] = concat(var, vals[j]);
+    }
+
+    envp[k] = NULL;
+    return envp;
+}
+
+
+static size_t hash(const char *username, size_t len) {
+    unsigned h = 2166136261u;
+
+    while (len--)
+        h = (h ^ (unsigned char) *username++) * 16777619u;
+
+    return h & (idmapsz - 1);
+}
+
+
+static int build_map(struct identity *ids, int count) {
+    size_t h;
+    int    i;
+
+    for (idmapsz = 16;  idmapsz < (size_t) count * 2;  idmapsz *= 2)
+        ;
+
+    if (!((idmap = (const struct identity**) calloc(idmapsz, sizeof(struct identity*)))))
+        error("calloc failed");
+
+    for (i = 0;  i < count;  ++i) {
+        for (h = hash(ids[i].username, USERNAME_LENGTH);  idmap[h];  h = (h+1) & (idmapsz-1))
+            if (!strcmp(idmap[h]->username, ids[i].username)) {
+                flog(LOG_ERR, "duplicate identity: %s", ids[i].username);
+                return 0;
+            }
+
+        idmap[h] = &ids[i];
+    }
+
+    return 1;
+}
+
+
+static void init_identity(struct identity *id, const char *certs, const char *queues) {
+    id->crtpath = concat(certs,  "/" CERTS_NAME);
+    id->qpath   = concat(queues, "/" QUEUE_NAME);
+    id->rqpath  = concat(queues, "/" RQUEUE_NAME);
+    id->spath   = concat(queues, "/" SESSION_NAME);
+    id->rspath  = concat(queues, "/" RSESSION_NAME);
+    id->pkpath  = concat(queues, "/" PREKEYS_NAME);
+    id->envp    = NULL;
+    id->qidx    = index_create();
+    id->rqidx   = index_create();
+}
+
+
+/* parse identities file, returning number of identities (0 if failed) */
+static int read_identities(const char *path, struct identity **ids) {
+    char line[MAX_LINE_LENGTH], *saveptr, *certs, *queues, *inbox;
+    FILE *file;
+    int  count = 0, alloc = 0, ok = 1;
+
+    *ids = NULL;
+
+    if (!((file = fopen(path, "re")))) {
+        flog(LOG_ERR, "could not open %s", path);
+        return 0;
+    }
+
+    while (ok  &&  fgets(line, sizeof(line), file)) {
+        certs  = strtok_r(line, " \t\n", &saveptr);
+        queues = strtok_r(NULL, " \t\n", &saveptr);
+        inbox  = strtok_r(NULL, " \t\n", &saveptr);
+
+        if (!certs  ||  certs[0] == '#')
+            continue;
+
+        if (!inbox  ||  strtok_r(NULL, " \t\n", &saveptr)) {
+            flog(LOG_ERR, "malformed line in %s", path);
+            ok = 0;
+            break;
+        }
+
+        if (count == alloc) {
+            alloc = alloc ? alloc * 2 : 8;
+            if (!((*ids = (struct identity*) realloc(*ids, alloc * sizeof(struct identity)))))
+                error("realloc failed");
+        }
+
+        init_identity(&(*ids)[count], certs, queues);
+        (*ids)[count].envp = alloc_envp(certs, queues, inbox);
+        ok = read_username(&(*ids)[count++]);
+    }
+
+    if (fclose(file)  ||  !count)
+        ok = 0;
+
+    if (!ok) {
+        free_identities(*ids, count);
+        *ids  = NULL;
+        count = 0;
+    }
+
+    return count;
+}
+
+
+/*
+  load identities from CABLE_IDENTITIES, or default identity
+  returns the number of identities, or 0 if failed
+*/
+int load_identities(struct identity **ids) {
+    const char *path = getenv(CABLE_IDENTITIES);
+    char       *certs, *queues;
+    const char *shards = getenv(CABLE_SHARDS);
+    int        count = 1, i;
+
+    if (path  &&  *path)
+        count = read_identities(path, ids);
+    else {
+        if (!((*ids = (struct identity*) malloc(sizeof(struct identity)))))
+            error("malloc failed");
+
+        certs  = alloc_env(CABLE_CERTS,  "");
+        queues = alloc_env(CABLE_QUEUES, "");
+
+        init_identity(*ids, certs, queues);
+        if (!read_username(*ids)) {
+            free_identities(*ids, 1);
+            count = 0;
+        }
+
+        dealloc_env(queues);
+        dealloc_env(certs);
+    }
+
+    if (count  &&  !build_map(*ids, count)) {
+        free_identities(*ids, count);
+        count = 0;
+    }
+
+    for (i = 0;  i < count;  ++i)
+        (*ids)[i].sharded = shards  &&  *shards;
+
+    return count;
+}
+
+
+void free_identities(struct identity *ids, int count) {
+    char **envp;
+    int  i;
+
+    for (i = 0;  i < count;  ++i) {
+        if (ids[i].envp) {
+            for (envp = ids[i].envp;  *envp;  ++envp)
+                free(*envp);
+            free(ids[i].envp);
+        }
+
+        index_destroy(ids[i].rqidx);
+        index_destroy(ids[i].qidx);
+
+        free(ids[i].pkpath);
+        free(ids[i].rspath);
+        free(ids[i].spath);
+        free(ids[i].rqpath);
+        free(ids[i].qpath);
+        free(ids[i].crtpath);
+    }
+
+    free(ids);
+
+    free(idmap);
+    idmap   = NULL;
+    idmapsz = 0;
+}
+
+
+/* find identity by username (not necessarily NUL-terminated) */
+const struct identity* find_identity(const char *username, size_t len) {
+    size_t h;
+
+    if (len != USERNAME_LENGTH  ||  !idmap)
+        return NULL;
+
+    for (h = hash(username, len);  idmap[h];  h = (h+1) & (idmapsz-1))
+        if (!strncmp(idmap[h]->username, username, len))
+            return idmap[h];
+
+    return NULL;
+}
+
+
+char* queue_dir(const struct identity *id, int rq, const char *msgid, char *buf, size_t size) {
+    const char *path = rq ? id->rqpath : id->qpath;
+    int        len;
+
+    if (id->sharded)
+        len = snprintf(buf, size, "%s/%.*s", path, SHARD_LENGTH, msgid);
+    else
+        len = snprintf(buf, size, "%s", path);
+
+    return len >= 0  &&  (size_t) len < size ? buf : NULL;
+}
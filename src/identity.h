@@ -0,0 +1,35 @@
+#ifndef IDENTITY_H
+#define IDENTITY_H
+
+#include <stddef.h>
+
+#include "daemon.h"
+
+struct msgid_index;
+
+/*
+  cables identity served by the daemon
+  envp is NULL for the default identity (environment is inherited)
+*/
+struct identity {
+    char   username[USERNAME_LENGTH+1];
+    char   *crtpath, *qpath, *rqpath, *spath, *rspath, *pkpath;
+    char   **envp;
+    struct msgid_index *qidx, *rqidx;
+
+    /* (r)queue entries are in shard subdirectories (CABLE_SHARDS) */
+    int    sharded;
+};
+
+int load_identities(struct identity **ids);
+void free_identities(struct identity *ids, int count);
+
+const struct identity* find_identity(const char *username, size_t len);
+
+/*
+  directory holding (r)queue entries which start with msgid prefix (the
+  (r)queue itself, or its shard); returns buf, or NULL if too long
+*/
+char* queue_dir(const struct identity *id, int rq, const char *msgid, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,258 @@
+/*
+  In-memory set of live msgids in a (r)queue directory, maintained by the
+  daemon (from directory scans and inotify events) and consulted by the
+  webserver threads before touching the filesystem.
+
+  The index also tracks usage of the directory (number of live msgids, and
+  total bytes as last measured by the daemon) against configured limits.
+
+  The index is authoritative only after a complete directory scan that
+  follows inotify watches registration: index_invalidate() starts a new
+  generation, the scan re-adds all existing entries, and index_validate()
+  purges entries which were not seen.  Otherwise, lookups are inconclusive.
+
+  thread-safe
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "index.h"
+#include "daemon.h"
+#include "util.h"
+
+
+/* initial number of hash buckets, and max. average chain length */
+#define INIT_BUCKETS 1024
+#define MAX_LOAD     2
+
+
+struct entry {
+    struct entry  *next;
+    unsigned long gen;
+    char          msgid[MSGID_LENGTH+1];
+};
+
+struct msgid_index {
+    pthread_rwlock_t   lock;
+    struct entry       **buckets;
+    size_t             nbuckets, count, maxcount;
+    unsigned long long bytes, maxbytes;
+    unsigned long      gen;
+    unsigned           seed;
+    int                valid;
+};
+
+
+/* msgids are chosen by peers, so use a seeded hash (FNV-1a) */
+static size_t hash(const struct msgid_index *idx, const char *msgid) {
+    unsigned h = 2166136261u ^ idx->seed;
+    int      i;
+
+    for (i = 0;  i < MSGID_LENGTH;  ++i)
+        h = (h ^ (unsigned char) msgid[i]) * 16777619u;
+
+    return h & (idx->nbuckets - 1);
+}
+
+
+static struct entry** find(struct msgid_index *idx, const char *msgid) {
+    struct entry **pe;
+
+    for (pe = &idx->buckets[hash(idx, msgid)];  *pe;  pe = &(*pe)->next)
+        if (!strncmp((*pe)->msgid, msgid, MSGID_LENGTH))
+            break;
+
+    return pe;
+}
+
+
+static void alloc_buckets(struct msgid_index *idx, size_t nbuckets) {
+    if (!((idx->buckets = (struct entry**) calloc(nbuckets, sizeof(struct entry*)))))
+        error("calloc failed");
+    idx->nbuckets = nbuckets;
+}
+
+
+/* double number of buckets, rehashing all entries (under write lock) */
+static void grow(struct msgid_index *idx) {
+    struct entry **old = idx->buckets, *e, *next;
+    size_t       oldn  = idx->nbuckets, i, h;
+
+    alloc_buckets(idx, oldn * 2);
+
+    for (i = 0;  i < oldn;  ++i)
+        for (e = old[i];  e;  e = next) {
+            next = e->next;
+            h    = hash(idx, e->msgid);
+
+            e->next         = idx->buckets[h];
+            idx->buckets[h] = e;
+        }
+
+    free(old);
+}
+
+
+struct msgid_index* index_create() {
+    struct msgid_index *idx;
+
+    if (!((idx = (struct msgid_index*) malloc(sizeof(struct msgid_index)))))
+        error("malloc failed");
+
+    if (pthread_rwlock_init(&idx->lock, NULL))
+        error("failed to initialize rwlock");
+
+    alloc_buckets(idx, INIT_BUCKETS);
+    idx->count = 0;
+    idx->gen   = 0;
+    idx->seed  = (unsigned) random();
+    idx->valid = 0;
+
+    idx->maxcount = 0;
+    idx->bytes    = idx->maxbytes = 0;
+
+    return idx;
+}
+
+
+void index_destroy(struct msgid_index *idx) {
+    struct entry *e, *next;
+    size_t       i;
+
+    for (i = 0;  i < idx->nbuckets;  ++i)
+        for (e = idx->buckets[i];  e;  e = next) {
+            next = e->next;
+            free(e);
+        }
+
+    pthread_rwlock_destroy(&idx->lock);
+    free(idx->buckets);
+    free(idx);
+}
+
+
+/* add msgid (first MSGID_LENGTH chars), or refresh its generation */
+void index_add(struct msgid_index *idx, const char *msgid) {
+    struct entry **pe, *e;
+
+    pthread_rwlock_wrlock(&idx->lock);
+
+    if (*(pe = find(idx, msgid)))
+        (*pe)->gen = idx->gen;
+    else {
+        if (!((e = (struct entry*) malloc(sizeof(struct entry)))))
+            error("malloc failed");
+
+        strncpy(e->msgid, msgid, MSGID_LENGTH);
+        e->msgid[MSGID_LENGTH] = '\0';
+        e->gen  = idx->gen;
+        e->next = NULL;
+        *pe     = e;
+
+        if (++idx->count > idx->nbuckets * MAX_LOAD)
+            grow(idx);
+    }
+
+    pthread_rwlock_unlock(&idx->lock);
+}
+
+
+void index_remove(struct msgid_index *idx, const char *msgid) {
+    struct entry **pe, *e;
+
+    pthread_rwlock_wrlock(&idx->lock);
+
+    if ((e = *(pe = find(idx, msgid)))) {
+        *pe = e->next;
+        free(e);
+        --idx->count;
+    }
+
+    pthread_rwlock_unlock(&idx->lock);
+}
+
+
+/* start a new generation; lookups are inconclusive until index_validate() */
+void index_invalidate(struct msgid_index *idx) {
+    pthread_rwlock_wrlock(&idx->lock);
+
+    idx->valid = 0;
+    ++idx->gen;
+
+    pthread_rwlock_unlock(&idx->lock);
+}
+
+
+/* purge entries not seen since index_invalidate(), and trust the index */
+void index_validate(struct msgid_index *idx) {
+    struct entry **pe, *e;
+    size_t       i;
+
+    pthread_rwlock_wrlock(&idx->lock);
+
+    for (i = 0;  i < idx->nbuckets;  ++i)
+        for (pe = &idx->buckets[i];  (e = *pe); ) {
+            if (e->gen != idx->gen) {
+                *pe = e->next;
+                free(e);
+                --idx->count;
+            }
+            else
+                pe = &e->next;
+        }
+
+    idx->valid = 1;
+
+    pthread_rwlock_unlock(&idx->lock);
+}
+
+
+enum IDX_Status index_lookup(struct msgid_index *idx, const char *msgid) {
+    enum IDX_Status res = IDX_UNKNOWN;
+
+    pthread_rwlock_rdlock(&idx->lock);
+
+    if (idx->valid)
+        res = *find(idx, msgid) ? IDX_PRESENT : IDX_ABSENT;
+
+    pthread_rwlock_unlock(&idx->lock);
+
+    return res;
+}
+
+
+/* 0 is unlimited */
+void index_set_limits(struct msgid_index *idx, size_t maxcount, unsigned long long maxbytes) {
+    pthread_rwlock_wrlock(&idx->lock);
+
+    idx->maxcount = maxcount;
+    idx->maxbytes = maxbytes;
+
+    pthread_rwlock_unlock(&idx->lock);
+}
+
+
+void index_set_bytes(struct msgid_index *idx, unsigned long long bytes) {
+    pthread_rwlock_wrlock(&idx->lock);
+
+    idx->bytes = bytes;
+
+    pthread_rwlock_unlock(&idx->lock);
+}
+
+
+/* whether a limit is reached (count limit is checked only if index is trusted) */
+int index_full(struct msgid_index *idx) {
+    int res;
+
+    pthread_rwlock_rdlock(&idx->lock);
+
+    res =  (idx->maxcount  &&  idx->valid  &&  idx->count >= idx->maxcount)
+        || (idx->maxbytes  &&  idx->bytes >= idx->maxbytes);
+
+    pthread_rwlock_unlock(&idx->lock);
+
+    return res;
+}
@@ -0,0 +1,30 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stddef.h>
+
+/* lookup results */
+enum IDX_Status {
+    IDX_ABSENT  = 0,
+    IDX_PRESENT = 1,
+    IDX_UNKNOWN = 2
+};
+
+struct msgid_index;
+
+struct msgid_index* index_create();
+void index_destroy(struct msgid_index *idx);
+
+void index_add(struct msgid_index *idx, const char *msgid);
+void index_remove(struct msgid_index *idx, const char *msgid);
+
+void index_invalidate(struct msgid_index *idx);
+void index_validate(struct msgid_index *idx);
+
+enum IDX_Status index_lookup(struct msgid_index *idx, const char *msgid);
+
+void index_set_limits(struct msgid_index *idx, size_t maxcount, unsigned long long maxbytes);
+void index_set_bytes(struct msgid_index *idx, unsigned long long bytes);
+int index_full(struct msgid_index *idx);
+
+#endif
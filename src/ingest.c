@@ -0,0 +1,1097 @@
+/*
+  Native message ingestion (queueing) for [send]
+
+  Reads RFC 822 messages (stdin, given files, or all files of a spool
+  directory), and for each one:
+    + removes X-* headers, and extracts the local MUA confirmation headers
+      (message.hdr, with "[vfy] " Subject: prefix)
+    + validates From: and To:/Cc:/Bcc: addresses against CABLE_REGEX
+    + selects the sender's queue (CABLE_IDENTITIES), and enforces
+      CABLE_QUEUE_MAXMSGS / CABLE_QUEUE_MAXBYTES (exit status 75)
+    + removes Bcc:, replaces Date: with a UTC one, and compresses the
+      message (gzip -n format, level CABLE_GZIP_LEVEL or -l, default 9);
+      large messages are compressed by several threads (-j), as
+      concatenated gzip members
+    + creates /cables/queue/<msgid>/{message{,.hdr},{,s}{user,host}name,send.req}
+      per recipient, atomically via rename from /cables/queue/tmp.<random>/
+      (msgids are from getrandom()); a message is queued for all of its
+      recipients or for none
+    + for several recipients and CABLE_SHARED, also links a shared random
+      content key and (empty) content.enc into each <msgid> directory, for
+      encrypt-once messages (see [cms])
+
+  Spool mode (-d <dir>) ingests all files of dir, removing each one once it
+  is queued; messages which fail are left in place.
+
+  Errors are printed to stderr, since invocation is interactive.
+*/
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <regex.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+
+#include <zlib.h>
+
+
+#define MSGID_BYTES   20
+#define KEY_BYTES     32
+#define TMPDIR_CHARS  10
+
+/* compression chunk size per thread, min. size for threaded compression, max. threads */
+#define CHUNK_SIZE    (1024 * 1024)
+#define PAR_MIN       (4 * CHUNK_SIZE)
+#define MAX_THREADS   16
+
+/* max. message size */
+#define MAX_MSG       (256 * 1024 * 1024)
+
+/* exit status if queue limits would be exceeded (EX_TEMPFAIL) */
+#define EXIT_TEMPFAIL 75
+
+
+/* message buffer */
+struct buf {
+    char   *data;
+    size_t len, alloc;
+};
+
+/* header field (name includes the colon, if any; text is the whole field) */
+struct field {
+    const char *text;
+    size_t     len, namelen;
+};
+
+/* compression job for one thread */
+struct zjob {
+    const char *in;
+    size_t     inlen, chunk, nchunks, first, stride;
+    struct buf *out;
+    int        level, ok;
+};
+
+
+static const char *hdrfields[] = { "From:", "To:", "Cc:", "Bcc:", "Subject:", "Date:",
+                                   "Message-ID:", "In-Reply-To:", "References:", NULL };
+
+static regex_t addrre, anglere;
+static int     level = 9, nthreads = 1;
+
+static const char *queuedir, *identities;
+static int        shards, enconce;
+static long long  maxmsgs, maxbytes;
+
+/* queue usage, computed once per run and updated with queued messages */
+struct queue {
+    char         *dir;
+    long long    nmsgs, nbytes;
+    struct queue *next;
+};
+
+static struct queue *queues;
+
+
+static void fatal(const char *msg) {
+    fprintf(stderr, "ingest: %s: %s\n", msg, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+
+static void buf_add(struct buf *b, const char *data, size_t len) {
+    if (b->len + len > b->alloc) {
+        while (b->len + len > b->alloc)
+            b->alloc = b->alloc ? b->alloc * 2 : 4096;
+
+        if (!((b->data = (char*) realloc(b->data, b->alloc))))
+            fatal("realloc failed");
+    }
+
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void buf_str(struct buf *b, const char *s) {
+    buf_add(b, s, strlen(s));
+}
+
+
+/* read whole file (returns 0 on error, with errno set) */
+static int read_all(int fd, struct buf *b) {
+    char    tmp[65536];
+    ssize_t sz;
+
+    while ((sz = read(fd, tmp, sizeof(tmp))) > 0) {
+        if (b->len + sz > MAX_MSG) {
+            errno = EFBIG;
+            return 0;
+        }
+        buf_add(b, tmp, sz);
+    }
+
+    return sz == 0;
+}
+
+static int write_file(int dirfd, const char *name, const char *data, size_t len) {
+    ssize_t sz;
+    int     fd;
+
+    if ((fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666)) == -1)
+        return 0;
+
+    for (;  len;  len -= sz, data += sz)
+        if ((sz = write(fd, data, len)) <= 0) {
+            close(fd);
+            return 0;
+        }
+
+    return !close(fd);
+}
+
+
+static void random_bytes(unsigned char *b, size_t len) {
+    ssize_t sz;
+
+    for (;  len;  len -= sz, b += sz)
+        if ((sz = getrandom(b, len, 0)) == -1) {
+            if (errno != EINTR)
+                fatal("getrandom failed");
+            sz = 0;
+        }
+}
+
+
+/*
+  split header into fields (continuation lines included), returning body offset
+  fields is allocated by the caller for the max. number of lines
+*/
+static size_t parse_header(const struct buf *msg, struct field *fields, size_t *nfields) {
+    const char *p = msg->data, *end = msg->data + msg->len, *eol, *colon;
+    size_t     n = 0;
+
+    while (p < end  &&  *p != '\n') {
+        if (!((eol = memchr(p, '\n', end - p))))
+            eol = end - 1;
+
+        if ((*p == ' '  ||  *p == '\t')  &&  n)
+            fields[n-1].len = eol + 1 - fields[n-1].text;
+        else {
+            fields[n].text    = p;
+            fields[n].len     = eol + 1 - p;
+            colon             = memchr(p, ':', eol - p);
+            fields[n].namelen = colon ? (size_t) (colon + 1 - p) : 0;
+            ++n;
+        }
+
+        p = eol + 1;
+    }
+
+    *nfields = n;
+
+    /* blank line separating the body */
+    return p < end ? p + 1 - msg->data : msg->len;
+}
+
+
+static int field_is(const struct field *f, const char *name) {
+    return f->namelen == strlen(name)  &&  !strncasecmp(f->text, name, f->namelen);
+}
+
+/* field value without leading / trailing blanks */
+static int field_blank(const struct field *f) {
+    size_t i;
+
+    for (i = f->namelen;  i < f->len;  ++i)
+        if (!isspace((unsigned char) f->text[i]))
+            return 0;
+
+    return 1;
+}
+
+/* append field, with a space after the name (as formail -z), and optional value prefix */
+static void add_field(struct buf *b, const struct field *f, const char *prefix) {
+    const char *v = f->text + f->namelen, *end = f->text + f->len;
+
+    buf_add(b, f->text, f->namelen);
+    if (f->namelen  &&  v < end  &&  *v != '\t') {
+        buf_str(b, " ");
+        if (*v == ' ')
+            ++v;
+        if (prefix)
+            buf_str(b, prefix);
+    }
+    buf_add(b, v, end - v);
+
+    if (b->data[b->len-1] != '\n')
+        buf_str(b, "\n");
+}
+
+
+/* field value, with continuation lines joined (as formail -c) */
+static char* field_value(const struct field *f) {
+    char   *v, *q;
+    size_t i;
+
+    if (!((v = q = (char*) malloc(f->len - f->namelen + 1))))
+        fatal("malloc failed");
+
+    for (i = f->namelen;  i < f->len;  ++i)
+        if (f->text[i] != '\n'  &&  f->text[i] != '\r')
+            *q++ = f->text[i];
+    *q = '\0';
+
+    return v;
+}
+
+
+/* bare address from "Name <x@y>" (text after '>' is kept, as in [send]), lower-case */
+static void bare_address(char *s) {
+    regmatch_t m[2];
+    size_t     len;
+    char       *p;
+
+    if (!regexec(&anglere, s, 2, m, 0)) {
+        len = m[1].rm_eo - m[1].rm_so;
+        memmove(s, s + m[1].rm_so, len);
+        memmove(s + len, s + m[0].rm_eo, strlen(s + m[0].rm_eo) + 1);
+    }
+
+    for (p = s;  *p;  ++p)
+        *p = tolower((unsigned char) *p);
+}
+
+
+static int cmp_str(const void *a, const void *b) {
+    return strcmp(*(char *const*) a, *(char *const*) b);
+}
+
+/* unique recipient addresses of To:, Cc: and Bcc: fields (sorted) */
+static size_t recipients(const struct field *fields, size_t nfields, char ***addrs) {
+    char   **list = NULL, *v, *part, *tok, *save1, *save2;
+    size_t i, n = 0, alloc = 0, j;
+
+    for (i = 0;  i < nfields;  ++i) {
+        if (!field_is(&fields[i], "To:")  &&  !field_is(&fields[i], "Cc:")  &&  !field_is(&fields[i], "Bcc:"))
+            continue;
+
+        v = field_value(&fields[i]);
+
+        for (part = strtok_r(v, ",", &save1);  part;  part = strtok_r(NULL, ",", &save1)) {
+            bare_address(part);
+
+            for (tok = strtok_r(part, " \t", &save2);  tok;  tok = strtok_r(NULL, " \t", &save2)) {
+                if (n == alloc) {
+                    alloc = alloc ? alloc * 2 : 8;
+                    if (!((list = (char**) realloc(list, alloc * sizeof(char*)))))
+                        fatal("realloc failed");
+                }
+                if (!((list[n++] = strdup(tok))))
+                    fatal("strdup failed");
+            }
+        }
+
+        free(v);
+    }
+
+    if (n)
+        qsort(list, n, sizeof(char*), cmp_str);
+
+    /* remove duplicates */
+    for (i = j = 0;  i < n;  ++i)
+        if (j  &&  !strcmp(list[i], list[j-1]))
+            free(list[i]);
+        else
+            list[j++] = list[i];
+
+    *addrs = list;
+    return j;
+}
+
+
+static int valid_address(const char *addr) {
+    return !regexec(&addrre, addr, 0, NULL, 0);
+}
+
+
+/* compress chunks first, first + stride, ... of a job into separate gzip members */
+static void* compress_job(void *arg) {
+    struct zjob *j = (struct zjob*) arg;
+    z_stream    zs;
+    size_t      c, off, len;
+
+    j->ok = 1;
+
+    for (c = j->first;  c < j->nchunks;  c += j->stride) {
+        off = c * j->chunk;
+        len = j->inlen - off < j->chunk ? j->inlen - off : j->chunk;
+
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, j->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            j->ok = 0;
+            break;
+        }
+
+        j->out[c].alloc = deflateBound(&zs, len);
+        if (!((j->out[c].data = (char*) malloc(j->out[c].alloc))))
+            fatal("malloc failed");
+
+        zs.next_in   = (Bytef*) j->in + off;
+        zs.avail_in  = len;
+        zs.next_out  = (Bytef*) j->out[c].data;
+        zs.avail_out = j->out[c].alloc;
+
+        if (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+            j->ok = 0;
+        j->out[c].len = zs.total_out;
+
+        deflateEnd(&zs);
+    }
+
+    return NULL;
+}
+
+/* gzip -n compatible output (one member per chunk if compressed by several threads) */
+static int compress_msg(const struct buf *in, struct buf *out) {
+    struct zjob jobs[MAX_THREADS];
+    pthread_t   threads[MAX_THREADS];
+    struct buf  *chunks;
+    size_t      nchunks, c;
+    int         n, t, started, ok = 1;
+
+    /* single member for small messages */
+    nchunks = in->len >= PAR_MIN  &&  nthreads > 1 ? (in->len + CHUNK_SIZE - 1) / CHUNK_SIZE : 1;
+    n       = nchunks < (size_t) nthreads ? (int) nchunks : nthreads;
+
+    if (!((chunks = (struct buf*) calloc(nchunks, sizeof(struct buf)))))
+        fatal("calloc failed");
+
+    for (t = 0;  t < n;  ++t) {
+        jobs[t].in      = in->data;
+        jobs[t].inlen   = in->len;
+        jobs[t].chunk   = nchunks > 1 ? CHUNK_SIZE : in->len;
+        jobs[t].nchunks = nchunks;
+        jobs[t].first   = t;
+        jobs[t].stride  = n;
+        jobs[t].out     = chunks;
+        jobs[t].level   = level;
+    }
+
+    /* extra threads only for several chunks; remaining jobs run in this thread */
+    for (started = 0;  started < n-1;  ++started)
+        if (pthread_create(&threads[started], NULL, compress_job, &jobs[started+1]))
+            break;
+
+    compress_job(&jobs[0]);
+    for (t = started+1;  t < n;  ++t)
+        compress_job(&jobs[t]);
+
+    for (t = 0;  t < started;  ++t)
+        pthread_join(threads[t], NULL);
+
+    for (t = 0;  t < n;  ++t)
+        ok = ok  &&  jobs[t].ok;
+
+    for (c = 0;  c < nchunks;  ++c) {
+        if (ok)
+            buf_add(out, chunks[c].data, chunks[c].len);
+        free(chunks[c].data);
+    }
+    free(chunks);
+
+    return ok;
+}
+
+
+/* queue selected by CABLE_IDENTITIES for the sender's username (NULL if unknown) */
+static char* identity_queue(const char *user) {
+    char   *line = NULL, *certs, *queues, *save, path[PATH_MAX], name[256];
+    char   *result = NULL;
+    size_t alloc = 0, len;
+    FILE   *file;
+    int    fd;
+    ssize_t sz;
+
+    if (!((file = fopen(identities, "r"))))
+        fatal("could not open identities file");
+
+    while (!result  &&  getline(&line, &alloc, file) != -1) {
+        if (!((certs = strtok_r(line, " \t\n", &save)))  ||  certs[0] == '#')
+            continue;
+        if (!((queues = strtok_r(NULL, " \t\n", &save))))
+            continue;
+
+        snprintf(path, sizeof(path), "%s/certs/username", certs);
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+            continue;
+
+        sz = read(fd, name, sizeof(name) - 1);
+        close(fd);
+
+        for (len = sz > 0 ? sz : 0;  len  &&  isspace((unsigned char) name[len-1]);  --len)
+            ;
+        name[len] = '\0';
+
+        if (!strcmp(name, user)) {
+            snprintf(path, sizeof(path), "%s/queue", queues);
+            if (!((result = strdup(path))))
+                fatal("strdup failed");
+        }
+    }
+
+    free(line);
+    fclose(file);
+
+    return result;
+}
+
+
+/* number of <msgid> entries in a queue directory (msgid may be followed by a suffix) */
+static long long count_msgs(const char *dir, int recurse) {
+    char          path[PATH_MAX];
+    struct dirent *de;
+    long long     n = 0;
+    size_t        i;
+    DIR           *d;
+
+    if (!((d = opendir(dir))))
+        return 0;
+
+    while ((de = readdir(d))) {
+        for (i = 0;  isxdigit((unsigned char) de->d_name[i])  &&  !isupper((unsigned char) de->d_name[i]);  ++i)
+            ;
+
+        if (i == 2*MSGID_BYTES  &&  !de->d_name[i])
+            ++n;
+        else if (recurse  &&  i == 2  &&  !de->d_name[i]) {
+            snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+            n += count_msgs(path, 0);
+        }
+    }
+
+    closedir(d);
+    return n;
+}
+
+
+/* hardlinked file, counted once */
+struct inode {
+    ino_t     ino;
+    long long bytes;
+};
+
+static int cmp_inode(const void *a, const void *b) {
+    ino_t x = ((const struct inode*) a)->ino, y = ((const struct inode*) b)->ino;
+    return x < y ? -1 : x > y;
+}
+
+/* disk usage of a directory tree (as du, hardlinked files are collected separately) */
+static long long sum_blocks(int dirfd, struct inode **links, size_t *nlinks, size_t *alloc) {
+    struct dirent *de;
+    struct stat   st;
+    long long     bytes = 0;
+    int           fd;
+    DIR           *d;
+
+    if (!((d = fdopendir(dirfd)))) {
+        close(dirfd);
+        return 0;
+    }
+
+    while ((de = readdir(d))) {
+        if (!strcmp(de->d_name, ".")  ||  !strcmp(de->d_name, "..")
+            ||  fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+            continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            bytes += (long long) st.st_blocks * 512;
+            if ((fd = openat(dirfd, de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1)
+                bytes += sum_blocks(fd, links, nlinks, alloc);
+        }
+        else if (st.st_nlink > 1) {
+            if (*nlinks == *alloc) {
+                *alloc = *alloc ? *alloc * 2 : 1024;
+                if (!((*links = (struct inode*) realloc(*links, *alloc * sizeof(struct inode)))))
+                    fatal("realloc failed");
+            }
+
+            (*links)[*nlinks].ino   = st.st_ino;
+            (*links)[*nlinks].bytes = (long long) st.st_blocks * 512;
+            ++*nlinks;
+        }
+        else
+            bytes += (long long) st.st_blocks * 512;
+    }
+
+    closedir(d);
+    return bytes;
+}
+
+static long long queue_bytes(const char *dir) {
+    struct inode *links = NULL;
+    struct stat  st;
+    size_t       nlinks = 0, alloc = 0, i;
+    long long    bytes = 0;
+    int          fd;
+
+    if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+        return 0;
+
+    if (!fstat(fd, &st))
+        bytes = (long long) st.st_blocks * 512;
+    bytes += sum_blocks(fd, &links, &nlinks, &alloc);
+
+    if (nlinks)
+        qsort(links, nlinks, sizeof(struct inode), cmp_inode);
+
+    for (i = 0;  i < nlinks;  ++i)
+        if (!i  ||  links[i].ino != links[i-1].ino)
+            bytes += links[i].bytes;
+
+    free(links);
+    return bytes;
+}
+
+
+static struct queue* get_queue(const char *dir) {
+    struct queue *q;
+
+    for (q = queues;  q;  q = q->next)
+        if (!strcmp(q->dir, dir))
+            return q;
+
+    if (!((q = (struct queue*) calloc(1, sizeof(struct queue))))  ||  !((q->dir = strdup(dir))))
+        fatal("malloc failed");
+
+    if (maxmsgs)
+        q->nmsgs  = count_msgs(dir, shards);
+    if (maxbytes)
+        q->nbytes = queue_bytes(dir);
+
+    q->next = queues;
+    queues  = q;
+
+    return q;
+}
+
+
+/* report a message error (name is NULL for stdin) */
+static int fail(const char *name, const char *msg, const char *arg) {
+    fprintf(stderr, "ingest: %s%s%s%s%s\n", name ? name : "", name ? ": " : "",
+            msg, arg ? ": " : "", arg ? arg : "");
+    return EXIT_FAILURE;
+}
+
+
+/* remove a directory tree, used for cleanup */
+static void remove_tree(int parent, const char *name) {
+    struct dirent *de;
+    int           fd;
+    DIR           *d;
+
+    if (!unlinkat(parent, name, 0)  ||  errno == ENOENT)
+        return;
+
+    if ((fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) != -1) {
+        if ((d = fdopendir(fd))) {
+            while ((de = readdir(d)))
+                if (strcmp(de->d_name, ".")  &&  strcmp(de->d_name, ".."))
+                    remove_tree(fd, de->d_name);
+            closedir(d);
+        }
+        else
+            close(fd);
+    }
+
+    unlinkat(parent, name, AT_REMOVEDIR);
+}
+
+
+/* create <queuedir>/tmp.<10 alphanumerics> (name format is ignored by the daemon) */
+static int make_tmpdir(int queuefd, char *name) {
+    static const char chars[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    unsigned char     rnd[TMPDIR_CHARS];
+    int               i, tries;
+
+    for (tries = 0;  tries < 100;  ++tries) {
+        random_bytes(rnd, sizeof(rnd));
+
+        strcpy(name, "tmp.");
+        for (i = 0;  i < TMPDIR_CHARS;  ++i)
+            name[4+i] = chars[rnd[i] % (sizeof(chars) - 1)];
+        name[4+i] = '\0';
+
+        if (!mkdirat(queuefd, name, 0777))
+            return 1;
+        if (errno != EEXIST)
+            return 0;
+    }
+
+    return 0;
+}
+
+
+/*
+  content key (64 hex digits) and empty content.enc, shared by all recipients
+  of an encrypt-once message (content.enc is written in place by [cms])
+*/
+static int write_content(int tmpfd) {
+    unsigned char rnd[KEY_BYTES];
+    char          key[2*KEY_BYTES+2];
+    size_t        i;
+
+    random_bytes(rnd, sizeof(rnd));
+    for (i = 0;  i < KEY_BYTES;  ++i)
+        sprintf(key + 2*i, "%02x", rnd[i]);
+    strcat(key, "\n");
+
+    return write_file(tmpfd, "content.key", key, strlen(key))
+        && write_file(tmpfd, "content.enc", "", 0);
+}
+
+
+/* queue path of <msgid> (<xx>/<msgid> if sharded) */
+static void queue_path(char *path, size_t size, const char *msgid) {
+    if (shards)
+        snprintf(path, size, "%.2s/%s", msgid, msgid);
+    else
+        snprintf(path, size, "%s", msgid);
+}
+
+
+/*
+  create one <msgid> directory per recipient, and move all of them to the
+  queue once complete; if a move fails, the directories already moved are
+  moved back (removed with the temporary directory), or marked as .del
+  (removed by the daemon), so that a message is queued for all or none of
+  its recipients, and can be retried
+*/
+static int queue_msgdirs(int queuefd, int tmpfd, char *const *addrs, size_t naddrs) {
+    static const char *shared[] = { "message", "message.hdr", "susername", "shostname",
+                                    "content.key", "content.enc" };
+    size_t            nshared = enconce  &&  naddrs > 1 ? 6 : 4;
+    unsigned char     rnd[MSGID_BYTES];
+    char              (*msgids)[2*MSGID_BYTES+1], path[2+1+2*MSGID_BYTES+1], del[sizeof(path)+4], line[256];
+    const char        *at;
+    size_t            i, j, moved = 0;
+    int               fd, ok = 1, err;
+
+    if (!((msgids = malloc(naddrs * sizeof(*msgids)))))
+        fatal("malloc failed");
+
+    for (i = 0;  ok  &&  i < naddrs;  ++i) {
+        /* generate <msgid> and create as subdirectory */
+        random_bytes(rnd, sizeof(rnd));
+        for (j = 0;  j < MSGID_BYTES;  ++j)
+            sprintf(msgids[i] + 2*j, "%02x", rnd[j]);
+
+        if (mkdirat(tmpfd, msgids[i], 0777)
+            ||  (fd = openat(tmpfd, msgids[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+            ok = 0;
+            break;
+        }
+
+        /* username and hostname files of the recipient (addresses are validated) */
+        at = strchr(addrs[i], '@');
+        ok = (size_t) snprintf(line, sizeof(line), "%.*s\n", (int) (at - addrs[i]), addrs[i]) < sizeof(line)
+             &&  write_file(fd, "username", line, strlen(line))
+             &&  (size_t) snprintf(line, sizeof(line), "%s\n", at + 1) < sizeof(line)
+             &&  write_file(fd, "hostname", line, strlen(line));
+
+        /* link the sanitized message (the files are not modified later) */
+        for (j = 0;  ok  &&  j < nshared;  ++j)
+            ok = !linkat(tmpfd, shared[j], fd, shared[j], 0);
+
+        ok = ok  &&  write_file(fd, "send.req", "", 0);
+        close(fd);
+
+        /* shard is normally created by the daemon */
+        if (ok  &&  shards) {
+            snprintf(path, sizeof(path), "%.2s", msgids[i]);
+            ok = !mkdirat(queuefd, path, 0777)  ||  errno == EEXIST;
+        }
+    }
+
+    /* atomically move directories to the queue */
+    while (ok  &&  moved < naddrs) {
+        queue_path(path, sizeof(path), msgids[moved]);
+        if ((ok = !renameat(tmpfd, msgids[moved], queuefd, path)))
+            ++moved;
+    }
+
+    /* undo partial queueing */
+    if (!ok) {
+        err = errno;
+
+        while (moved--) {
+            queue_path(path, sizeof(path), msgids[moved]);
+            snprintf(del, sizeof(del), "%s.del", path);
+
+            if (renameat(queuefd, path, tmpfd, msgids[moved])  &&  renameat(queuefd, path, queuefd, del))
+                fprintf(stderr, "ingest: could not unqueue %s: %s\n", msgids[moved], strerror(errno));
+        }
+
+        errno = err;
+    }
+
+    free(msgids);
+    return ok;
+}
+
+
+/* ingest one message (name is NULL for stdin), returning the exit status */
+static int ingest(const char *name, int fd) {
+    struct buf   msg = { NULL, 0, 0 }, hdr = { NULL, 0, 0 }, plain = { NULL, 0, 0 }, gz = { NULL, 0, 0 };
+    struct field *fields = NULL;
+    struct queue *q;
+    char         **addrs = NULL, *from = NULL, *qdir = NULL, *p;
+    char         tmpname[4+TMPDIR_CHARS+1], date[64], line[256];
+    size_t       nfields, naddrs = 0, body, nlines, i;
+    int          queuefd = -1, tmpfd = -1, hassubj = 0, status = EXIT_FAILURE;
+    time_t       now;
+
+    tmpname[0] = '\0';
+
+    if (!read_all(fd, &msg)) {
+        status = fail(name, "could not read message", strerror(errno));
+        goto done;
+    }
+
+    /* header fields, parsed once */
+    for (nlines = 1, p = msg.data;  (p = memchr(p, '\n', msg.data + msg.len - p));  ++p)
+        ++nlines;
+    if (!((fields = (struct field*) malloc(nlines * sizeof(struct field)))))
+        fatal("malloc failed");
+
+    body = parse_header(&msg, fields, &nfields);
+
+    /* remove X-* fields, and empty fields (as formail -z) */
+    for (i = 0;  i < nfields;  ++i)
+        if ((fields[i].namelen > 2  &&  !strncasecmp(fields[i].text, "X-", 2))
+            ||  (fields[i].namelen  &&  field_blank(&fields[i])))
+            fields[i].len = 0;
+
+    /* bare recipient and From: addresses */
+    naddrs = recipients(fields, nfields, &addrs);
+
+    for (i = 0;  i < nfields;  ++i)
+        if (fields[i].len  &&  field_is(&fields[i], "From:")) {
+            if (from) {
+                status = fail(name, "multiple From: fields", NULL);
+                goto done;
+            }
+
+            from = field_value(&fields[i]);
+            bare_address(from);
+
+            /* trim blanks */
+            for (p = from;  isblank((unsigned char) *p);  ++p)
+                ;
+            memmove(from, p, strlen(p) + 1);
+            for (p = from + strlen(from);  p != from  &&  isblank((unsigned char) p[-1]);  --p)
+                ;
+            *p = '\0';
+        }
+
+    /* check address validity to prevent accidental information leaks */
+    if (!from  ||  !valid_address(from)) {
+        status = fail(name, "unsupported address", from ? from : "");
+        goto done;
+    }
+
+    for (i = 0;  i < naddrs;  ++i)
+        if (!valid_address(addrs[i])) {
+            status = fail(name, "unsupported address", addrs[i]);
+            goto done;
+        }
+
+    if (!naddrs) {
+        status = fail(name, "no recipients", NULL);
+        goto done;
+    }
+
+
+    /* when serving several identities, queue the message for the sender's one */
+    p = strchr(from, '@');
+    if (identities) {
+        *p = '\0';
+        qdir = identity_queue(from);
+        *p = '@';
+
+        if (!qdir) {
+            status = fail(name, "unknown identity", from);
+            goto done;
+        }
+    }
+    else if (!((qdir = strdup(queuedir))))
+        fatal("strdup failed");
+
+
+    /* refuse (temporary failure, EX_TEMPFAIL) if queue limits would be exceeded */
+    q = get_queue(qdir);
+
+    if (maxmsgs  &&  q->nmsgs + (long long) naddrs > maxmsgs) {
+        fprintf(stderr, "ingest: queue is full (%lld messages), try again later\n", q->nmsgs);
+        status = EXIT_TEMPFAIL;
+        goto done;
+    }
+
+    if (maxbytes  &&  q->nbytes >= maxbytes) {
+        fprintf(stderr, "ingest: queue is full (%lld bytes), try again later\n", q->nbytes);
+        status = EXIT_TEMPFAIL;
+        goto done;
+    }
+
+
+    /* headers for local MUA confirmation message */
+    for (i = 0;  i < nfields;  ++i) {
+        const char **h;
+
+        if (!fields[i].len)
+            continue;
+
+        for (h = hdrfields;  *h  &&  !field_is(&fields[i], *h);  ++h)
+            ;
+        if (!*h)
+            continue;
+
+        /* [vfy] Subject: prefix */
+        hassubj = hassubj  ||  !strcmp(*h, "Subject:");
+        add_field(&hdr, &fields[i], !strcmp(*h, "Subject:") ? "[vfy] " : NULL);
+    }
+
+    if (!hassubj)
+        buf_str(&hdr, "Subject: [vfy] \n");
+
+
+    /* message without Bcc:, and with Date: replaced by a UTC one */
+    for (i = 0;  i < nfields;  ++i)
+        if (fields[i].len  &&  !field_is(&fields[i], "Bcc:")  &&  !field_is(&fields[i], "Date:"))
+            add_field(&plain, &fields[i], NULL);
+
+    now = time(NULL);
+    strftime(date, sizeof(date), "Date: %a, %d %b %Y %H:%M:%S +0000\n\n", gmtime(&now));
+    buf_str(&plain, date);
+    buf_add(&plain, msg.data + body, msg.len - body);
+
+    free(msg.data);
+    msg.data = NULL;
+
+    if (!compress_msg(&plain, &gz)) {
+        status = fail(name, "compression failed", NULL);
+        goto done;
+    }
+
+
+    /* temporary directory on the queue filesystem, not visible to the daemon */
+    if ((queuefd = open(qdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1
+        ||  !make_tmpdir(queuefd, tmpname)
+        ||  (tmpfd = openat(queuefd, tmpname, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        status = fail(name, "could not create temporary directory", strerror(errno));
+        goto done;
+    }
+
+    /* from-user and from-host, and the shared message files */
+    p = strchr(from, '@');
+    if (!(snprintf(line, sizeof(line), "%.*s\n", (int) (p - from), from) < (int) sizeof(line)
+          &&  write_file(tmpfd, "susername", line, strlen(line))
+          &&  snprintf(line, sizeof(line), "%s\n", p + 1) < (int) sizeof(line)
+          &&  write_file(tmpfd, "shostname", line, strlen(line))
+          &&  write_file(tmpfd, "message.hdr", hdr.data, hdr.len)
+          &&  write_file(tmpfd, "message", gz.data, gz.len)
+          &&  (!enconce  ||  naddrs < 2  ||  write_content(tmpfd))
+          &&  queue_msgdirs(queuefd, tmpfd, addrs, naddrs))) {
+        status = fail(name, "could not queue message", strerror(errno));
+        goto done;
+    }
+
+    /* approximate usage of queued directories, until the next run */
+    q->nmsgs  += naddrs;
+    q->nbytes += ((gz.len + 4095) / 4096 + (hdr.len + 4095) / 4096 + 6 * naddrs) * 4096;
+
+    status = EXIT_SUCCESS;
+
+done:
+    if (tmpfd != -1)
+        close(tmpfd);
+    if (tmpname[0])
+        remove_tree(queuefd, tmpname);
+    if (queuefd != -1)
+        close(queuefd);
+
+    for (i = 0;  i < naddrs;  ++i)
+        free(addrs[i]);
+
+    free(addrs);
+    free(from);
+    free(qdir);
+    free(fields);
+    free(msg.data);
+    free(hdr.data);
+    free(plain.data);
+    free(gz.data);
+
+    return status;
+}
+
+
+/* ingest regular files of a spool directory, removing queued ones */
+static int ingest_spool(const char *dir) {
+    char          path[PATH_MAX];
+    struct dirent *de;
+    struct stat   st;
+    int           fd, st1, status = EXIT_SUCCESS;
+    DIR           *d;
+
+    if (!((d = opendir(dir))))
+        fatal("could not open spool directory");
+
+    while ((de = readdir(d))) {
+        if (de->d_name[0] == '.')
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if ((fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) == -1  ||  fstat(fd, &st)  ||  !S_ISREG(st.st_mode)) {
+            if (fd != -1)
+                close(fd);
+            continue;
+        }
+
+        st1 = ingest(path, fd);
+        close(fd);
+
+        if (st1 == EXIT_SUCCESS) {
+            if (unlink(path))
+                st1 = fail(path, "could not remove queued message", strerror(errno));
+        }
+        else if (st1 == EXIT_TEMPFAIL) {
+            status = st1;
+            break;
+        }
+
+        if (st1 != EXIT_SUCCESS)
+            status = st1;
+    }
+
+    closedir(d);
+    return status;
+}
+
+
+/* non-negative limit from the environment (0 if unset), exits if invalid */
+static long long env_num(const char *name) {
+    const char         *v = getenv(name);
+    char               *end;
+    unsigned long long n;
+
+    if (!v  ||  !*v)
+        return 0;
+
+    errno = 0;
+    n     = strtoull(v, &end, 10);
+
+    if (errno  ||  *end  ||  !isdigit((unsigned char) *v)  ||  n > LLONG_MAX) {
+        fprintf(stderr, "ingest: bad %s value: %s\n", name, v);
+        exit(EXIT_FAILURE);
+    }
+
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    const char *spool = NULL, *regex, *v;
+    char       *pattern;
+    int        opt, i, fd, st1, status = EXIT_SUCCESS;
+    long       ncpu;
+
+    if ((v = getenv("CABLE_GZIP_LEVEL"))  &&  *v)
+        level = atoi(v);
+
+    ncpu     = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = ncpu < 1 ? 1 : ncpu > MAX_THREADS ? MAX_THREADS : ncpu;
+
+    while ((opt = getopt(argc, argv, "l:j:d:")) != -1)
+        switch (opt) {
+        case 'l':
+            level = atoi(optarg);
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 'd':
+            spool = optarg;
+            break;
+        default:
+            fprintf(stderr, "Format: %s [-l <level>] [-j <threads>] [-d <spooldir> | <file>...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+
+    if (level < 1  ||  level > 9  ||  nthreads < 1  ||  nthreads > MAX_THREADS) {
+        fprintf(stderr, "ingest: bad compression level or thread count\n");
+        return EXIT_FAILURE;
+    }
+
+
+    /* environment (see conf/profile) */
+    if (!((v = getenv("CABLE_QUEUES")))  ||  !*v  ||  !((regex = getenv("CABLE_REGEX")))  ||  !*regex) {
+        fprintf(stderr, "ingest: CABLE_QUEUES and CABLE_REGEX must be set\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!((pattern = (char*) malloc(strlen(v) + strlen(regex) + 16))))
+        fatal("malloc failed");
+    sprintf(pattern, "%s/queue", v);
+    queuedir = strdup(pattern);
+
+    sprintf(pattern, "^(%s)$", regex);
+    if (!queuedir  ||  regcomp(&addrre, pattern, REG_EXTENDED | REG_NOSUB)  ||  regcomp(&anglere, "^.*<([^>]*)>", REG_EXTENDED)) {
+        fprintf(stderr, "ingest: bad CABLE_REGEX\n");
+        return EXIT_FAILURE;
+    }
+    free(pattern);
+
+    identities = (v = getenv("CABLE_IDENTITIES"))  &&  *v ? v : NULL;
+    shards     = (v = getenv("CABLE_SHARDS"))      &&  *v;
+    enconce    = (v = getenv("CABLE_SHARED"))      &&  *v;
+    maxmsgs    = env_num("CABLE_QUEUE_MAXMSGS");
+    maxbytes   = env_num("CABLE_QUEUE_MAXBYTES");
+
+
+    if (spool)
+        status = ingest_spool(spool);
+    else {
+        /* empty arguments are ignored (sudoers entry of [send]) */
+        for (i = optind;  i < argc  &&  !*argv[i];  ++i)
+            ;
+
+        if (i == argc)
+            status = ingest(NULL, STDIN_FILENO);
+
+        for (;  i < argc  &&  status != EXIT_TEMPFAIL;  ++i) {
+            if (!*argv[i])
+                continue;
+
+            if ((fd = open(argv[i], O_RDONLY | O_CLOEXEC)) == -1)
+                st1 = fail(argv[i], "could not open", strerror(errno));
+            else {
+                st1 = ingest(argv[i], fd);
+                close(fd);
+            }
+
+            if (st1 != EXIT_SUCCESS)
+                status = st1;
+        }
+    }
+
+    return status;
+}
@@ -11,12 +11,33 @@
 #include <sys/file.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
 #include <fcntl.h>
 
 
 /* flock timeout */
 #define LOCK_TMOUT 300
 
+/*
+  high-water mark sidecar (ignored by MH readers): "<max index> <dir mtime sec> <nsec>"
+  it is trusted while the directory's mtime is as recorded after the last delivery,
+  otherwise (e.g., messages added or removed by other programs) the directory is scanned
+*/
+#define HWM_NAME  ".mhdrop"
+#define HWM_LEN   64
+
+/* delivery attempts before rescanning, if names are taken by other programs */
+#define LINK_RETRIES 100
+
+/*
+  spool directory of concurrent deliveries, suffix of entries claimed by the lock holder,
+  and gathering window if the lock is busy (ms, waited before blocking on the lock)
+*/
+#define SPOOL_NAME      ".mhdrop.spool"
+#define CLAIM_SFX       ".d"
+#define COALESCE_WINDOW 20
+
 #define NOT_NUM ULLONG_MAX
 #define NUM_LEN 20
 typedef unsigned long long num_t;
@@ -24,6 +45,11 @@ typedef unsigned long long num_t;
 
 static volatile int alrm = 0;
 
+/* this run's spool entries (<pid>.<seq>), withdrawn on failure */
+static int  spoolfd = -1, nspooled;
+static int  *spoolseqs;
+static char **spoolmsgs;
+
 
 /* logging init */
 static void syslog_init() {
@@ -47,6 +73,8 @@ static void flog(int priority, const char *format, ...) {
     va_end(ap);
 }
 
+static void unspool();
+
 static void flogexit(int priority, const char *format, ...) {
     va_list ap;
 
@@ -62,6 +90,7 @@ static void flogexit(int priority, const char *format, ...) {
 
     va_end(ap);
 
+    unspool();
     exit(EXIT_FAILURE);
 }
 
@@ -122,24 +151,370 @@ static num_t getidx(const char *name) {
 }
 
 
+/* find max entry, don't bother with file types */
+static num_t scan_max(DIR *dir) {
+    struct dirent *de;
+    num_t         maxidx = 0, curidx;
+
+    rewinddir(dir);
+
+    for (errno = 0;  (de = readdir(dir)) != NULL; )
+        if ((curidx = getidx(de->d_name)) != NOT_NUM  &&  curidx > maxidx)
+            maxidx = curidx;
+
+    if (de == NULL  &&  errno)
+        error();
+
+    return maxidx;
+}
+
+
+/* recorded max entry, or NOT_NUM if the directory changed since */
+static num_t read_hwm(int hfd, const struct stat *st) {
+    char               buf[HWM_LEN+1];
+    ssize_t            len;
+    unsigned long long hwm;
+    long long          sec;
+    long               nsec;
+
+    if ((len = pread(hfd, buf, HWM_LEN, 0)) == -1)
+        error();
+    buf[len] = '\0';
+
+    if (sscanf(buf, "%llu %lld %ld", &hwm, &sec, &nsec) != 3
+        ||  sec != (long long) st->st_mtim.tv_sec  ||  nsec != st->st_mtim.tv_nsec  ||  hwm == NOT_NUM)
+        return NOT_NUM;
+
+    return hwm;
+}
+
+
+/* record max entry with current directory mtime (in place, so that mtime doesn't change) */
+static void write_hwm(int hfd, int dfd, num_t hwm) {
+    struct stat st;
+    char        buf[HWM_LEN+1];
+    int         len;
+
+    if (fstat(dfd, &st) == -1)
+        error();
+
+    len = snprintf(buf, sizeof(buf), "%llu %lld %ld\n", hwm, (long long) st.st_mtim.tv_sec, (long) st.st_mtim.tv_nsec);
+    if (len < 0  ||  len >= sizeof(buf))
+        flogexit(LOG_ERR, "could not format high-water mark");
+
+    if (pwrite(hfd, buf, len, 0) != len  ||  ftruncate(hfd, len) == -1)
+        error();
+}
+
+
+/*
+  make message readable by the inbox group (as its directory), and durable
+  if requested (before it becomes visible in a Maildir's new/)
+*/
+static void prepare(const char *msg, gid_t gid, int sync) {
+    int fd;
+
+    if ((fd = open(msg, O_RDONLY | O_CLOEXEC)) == -1)
+        error();
+
+    if (fchown(fd, -1, gid) == -1  ||  fchmod(fd, 0660) == -1)
+        error();
+
+    if (sync  &&  fsync(fd) == -1)
+        error();
+
+    if (close(fd) == -1)
+        error();
+}
+
+
+/*
+  spool messages for delivery by the current lock holder (names are <pid>.<n>;
+  names of a reused pid which are taken, also if claimed, are skipped)
+*/
+static void spool(int sfd, char *msgs[], int nmsgs) {
+    char name[NUM_LEN+NUM_LEN+2], claimed[sizeof(name)+sizeof(CLAIM_SFX)];
+    int  i, seq = 0;
+
+    if (!((spoolseqs = (int*) malloc(nmsgs * sizeof(int)))))
+        error();
+
+    spoolfd   = sfd;
+    spoolmsgs = msgs;
+
+    for (i = 0;  i < nmsgs;  ++i)
+        for (;;) {
+            snprintf(name, sizeof(name), "%ld.%d", (long) getpid(), ++seq);
+            snprintf(claimed, sizeof(claimed), "%s" CLAIM_SFX, name);
+
+            if (faccessat(sfd, claimed, F_OK, 0) == 0)
+                continue;
+            if (linkat(AT_FDCWD, msgs[i], sfd, name, 0) == 0) {
+                spoolseqs[nspooled++] = seq;
+                break;
+            }
+            if (errno != EEXIST)
+                error();
+        }
+}
+
+
+/*
+  withdraw this run's spool entries before exiting on failure, so that a retry
+  doesn't deliver them twice; an entry which is gone was claimed by a lock
+  holder (and is delivered by it, or by the next one if it crashed), so its
+  source is removed; if all entries were claimed, the run succeeded
+*/
+static void unspool() {
+    char name[NUM_LEN+NUM_LEN+2];
+    int  i, sfd = spoolfd, n = nspooled, nclaimed = 0;
+
+    if (sfd == -1)
+        return;
+
+    spoolfd  = -1;
+    nspooled = 0;
+
+    for (i = 0;  i < n;  ++i) {
+        snprintf(name, sizeof(name), "%ld.%d", (long) getpid(), spoolseqs[i]);
+
+        if (unlinkat(sfd, name, 0) == 0)
+            continue;
+
+        if (errno != ENOENT)
+            flog(LOG_ERR, "could not withdraw %s: %m", spoolmsgs[i]);
+        else if (unlink(spoolmsgs[i]) == -1)
+            flog(LOG_ERR, "could not remove delivered %s: %m", spoolmsgs[i]);
+        else
+            ++nclaimed;
+    }
+
+    if (nclaimed == n) {
+        flog(LOG_INFO, "delivered by a concurrent run");
+        exit(EXIT_SUCCESS);
+    }
+}
+
+
 /*
+  MH delivery: consecutive numbers, under exclusive directory lock
+  messages of all concurrent runs are linked to the spool directory first,
+  and the lock holder delivers whole spool (group delivery), so that each
+  run's messages are delivered once it gets the lock; sources are removed
+  only then, as before
+  (deliveries are coalesced here, rather than by gathering message files in
+  [crypto] / [validate], which run as independent loops per message; a run
+  which finds the lock busy waits the gathering window before blocking on
+  it, so that the holder is not delayed)
+  the holder claims each entry by renaming it to <name>.d before linking it,
+  so that a run which gives up (lock timeout, errors) withdraws its unclaimed
+  entries atomically (see unspool())
   locks are automatically released on program exit,
   so don't bother with unlocking on exceptions
  */
+static void deliver_mh(const char *mhdir, DIR *dir, int dfd, char *msgs[], int nmsgs) {
+    struct timespec ts = { 0, COALESCE_WINDOW * 1000000L };
+    struct stat     st;
+    struct dirent   *de;
+    DIR             *sdir;
+    int             hfd, sfd, i, spret, retries, linked, scanned = 0, ndelivered = 0;
+    num_t           maxidx;
+    char            numname[NUM_LEN+1], claimed[NAME_MAX+sizeof(CLAIM_SFX)];
+    size_t          len;
+
+    /* spool directory (inbox mtime changes if it is created) */
+    if (mkdirat(dfd, SPOOL_NAME, 0700) == -1  &&  errno != EEXIST)
+        error();
+    if ((sfd = openat(dfd, SPOOL_NAME, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+        error();
+
+    spool(sfd, msgs, nmsgs);
+
+    /* lock directory with timeout; if busy, let more messages gather first */
+    if (flock(dfd, LOCK_EX | LOCK_NB) == -1) {
+        if (errno != EWOULDBLOCK)
+            error();
+
+        nanosleep(&ts, NULL);
+
+        alarm(LOCK_TMOUT);
+        if (flock(dfd, LOCK_EX) == -1) {
+            if (errno == EINTR  &&  alrm)
+                flogexit(LOG_ERR, "timed out while locking %s", mhdir);
+            else
+                error();
+        }
+        alarm(0);
+    }
+
+    /* high-water mark (directory mtime changes if it is created) */
+    if ((hfd = openat(dfd, HWM_NAME, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1)
+        error();
+
+    if (fstat(dfd, &st) == -1)
+        error();
+
+    /* full scan only if the directory was changed by other programs */
+    if ((maxidx = read_hwm(hfd, &st)) == NOT_NUM) {
+        maxidx  = scan_max(dir);
+        scanned = 1;
+    }
+
+
+    /*
+      deliver spooled messages (own ones may have been delivered by a previous lock holder,
+      other runs' ones may be withdrawn meanwhile, and claimed ones left by a crashed holder)
+    */
+    if ((sdir = fdopendir(sfd)) == NULL)
+        error();
+
+    for (errno = 0;  (de = readdir(sdir)) != NULL;  errno = 0) {
+        if (!strcmp(de->d_name, ".")  ||  !strcmp(de->d_name, ".."))
+            continue;
+
+        /* claim entry (readdir may also return it under its claimed name) */
+        len = strlen(de->d_name);
+        if (len >= sizeof(CLAIM_SFX)  &&  !strcmp(de->d_name + len - (sizeof(CLAIM_SFX)-1), CLAIM_SFX))
+            snprintf(claimed, sizeof(claimed), "%s", de->d_name);
+        else {
+            snprintf(claimed, sizeof(claimed), "%s" CLAIM_SFX, de->d_name);
+
+            if (renameat(sfd, de->d_name, sfd, claimed) == -1) {
+                if (errno != ENOENT)
+                    error();
+                continue;
+            }
+        }
+
+        for (retries = 0; ; ++retries) {
+            /* names taken since the last delivery (e.g., in the same mtime tick) */
+            if (retries == LINK_RETRIES  &&  !scanned) {
+                maxidx  = scan_max(dir);
+                scanned = 1;
+            }
+
+            if (++maxidx == NOT_NUM  ||  maxidx == 0)
+                flogexit(LOG_ERR, "indexes exhausted, %llu not legal", maxidx);
+
+            /*
+              convert to string, but also check back due to possible locale-related problems
+              (unlikely if setlocale() is not explicitly invoked
+            */
+            spret = snprintf(numname, sizeof(numname), "%llu", maxidx);
+            if (spret < 0  ||  spret >= sizeof(numname)  ||  getidx(numname) != maxidx)
+                flogexit(LOG_ERR, "could not convert %llu to file name", maxidx);
+
+            /* rename() may replace an externally created file, so use link/unlink */
+            if ((linked = !linkat(sfd, claimed, dfd, numname, 0))  ||  errno != EEXIST)
+                break;
+        }
+
+        /* already delivered (claimed entry seen again) */
+        if (!linked) {
+            if (errno != ENOENT)
+                error();
+
+            --maxidx;
+            continue;
+        }
+
+        if (unlinkat(sfd, claimed, 0) == -1)
+            error();
+
+        flog(LOG_INFO, "delivered %s/%s", mhdir, numname);
+        ++ndelivered;
+    }
+
+    if (errno)
+        error();
+
+    if (ndelivered > nmsgs)
+        flog(LOG_DEBUG, "delivered %d messages in one run", ndelivered);
+
+    write_hwm(hfd, dfd, maxidx);
+
+    /* own entries are delivered (failures are reported as such from here on) */
+    spoolfd = -1;
+
+    if (close(hfd) == -1  ||  closedir(sdir) == -1)
+        error();
+
+
+    /* unlock (explicitly) */
+    if (flock(dfd, LOCK_UN) == -1)
+        error();
+
+    /* messages are delivered */
+    for (i = 0;  i < nmsgs;  ++i)
+        if (unlink(msgs[i]) == -1)
+            error();
+}
+
+
+/*
+  Maildir delivery: unique names (time.M<usec>P<pid>Q<n>.host), without locking
+  message is linked to tmp/, then to new/; the source is removed last, so that
+  an interrupted delivery is repeated (possibly duplicated), but never lost
+*/
+static void deliver_maildir(const char *mddir, int dfd, char *msgs[], int nmsgs) {
+    struct timeval tv;
+    char           host[HOST_NAME_MAX+1], name[NAME_MAX+1], tmpname[NAME_MAX+5], newname[NAME_MAX+5], *c;
+    int            i, len, seq = 0;
+
+    if (gethostname(host, sizeof(host)) == -1)
+        error();
+    host[HOST_NAME_MAX] = '\0';
+
+    /* '/' and ':' are not allowed in unique names */
+    for (c = host;  *c;  ++c)
+        if (*c == '/'  ||  *c == ':')
+            *c = '_';
+
+    for (i = 0;  i < nmsgs;  ++i) {
+        /* name may only be taken by a stale tmp/ entry of a reused pid */
+        for (;;) {
+            if (gettimeofday(&tv, NULL) == -1)
+                error();
+
+            len = snprintf(name, sizeof(name), "%ld.M%ldP%ldQ%d.%s",
+                           (long) tv.tv_sec, (long) tv.tv_usec, (long) getpid(), ++seq, host);
+            if (len < 0  ||  len >= sizeof(name))
+                flogexit(LOG_ERR, "could not create unique name");
+
+            snprintf(tmpname, sizeof(tmpname), "tmp/%s", name);
+            snprintf(newname, sizeof(newname), "new/%s", name);
+
+            if (linkat(AT_FDCWD, msgs[i], dfd, tmpname, 0) == 0)
+                break;
+            if (errno != EEXIST)
+                error();
+        }
+
+        if (linkat(dfd, tmpname, dfd, newname, 0) == -1)
+            error();
+        if (unlinkat(dfd, tmpname, 0) == -1  ||  unlink(msgs[i]) == -1)
+            error();
+
+        flog(LOG_INFO, "delivered %s/%s", mddir, newname);
+    }
+}
+
+
 int main(int argc, char *argv[]) {
     const  char   *mhdir;
-    struct dirent *de = NULL;
+    struct stat   st;
     DIR           *dir;
-    int           dfd, i, spret;
-    num_t         maxidx = 0, curidx;
-    char          numname[NUM_LEN+1];
+    int           dfd, i, maildir = 0;
+
+    if (argc > 1  &&  !strcmp(argv[1], "-m"))
+        maildir = 1;
 
-    if (argc < 3) {
-        fprintf(stderr, "%s <mh dir> <message on same fs> ...\n", argv[0]);
+    if (argc < 3 + maildir) {
+        fprintf(stderr, "%s [-m] <mh dir | maildir (-m)> <message on same fs> ...\n", argv[0]);
         return 1;
     }
 
-    mhdir = argv[1];
+    mhdir = argv[1 + maildir];
 
     /* init logging */
     syslog_init();
@@ -155,51 +530,17 @@ int main(int argc, char *argv[]) {
     if ((dfd = dirfd(dir)) == -1)
         error();
 
-    /* lock directory with timeout */
-    alarm(LOCK_TMOUT);
-    if (flock(dfd, LOCK_EX) == -1) {
-        if (errno == EINTR  &&  alrm)
-            flogexit(LOG_ERR, "timed out while locking %s", mhdir);
-        else
-            error();
-    }
-    alarm(0);
-
-    /* find max entry, don't bother with file types */
-    for (errno = 0;  (de = readdir(dir)) != NULL; )
-        if ((curidx = getidx(de->d_name)) != NOT_NUM  &&  curidx > maxidx)
-            maxidx = curidx;
-
-    if (de == NULL  &&  errno)
+    /* messages get the inbox directory's group */
+    if (fstat(dfd, &st) == -1)
         error();
 
-    
-    /* deliver messages */
-    for (i = 2, ++maxidx;  i < argc;  ++i, ++maxidx) {
-        if (maxidx == NOT_NUM  ||  maxidx == 0)
-            flogexit(LOG_ERR, "indexes exhausted, %llu not legal", maxidx);
-
-        /*
-          convert to string, but also check back due to possible locale-related problems
-          (unlikely if setlocale() is not explicitly invoked
-        */
-        spret = snprintf(numname, sizeof(numname), "%llu", maxidx);
-        if (spret < 0  ||  spret >= sizeof(numname)  ||  getidx(numname) != maxidx)
-            flogexit(LOG_ERR, "could not convert %llu to file name", maxidx);
-
-        /* rename() may replace an externally created file, so use link/unlink */
-        if (linkat(AT_FDCWD, argv[i], dfd, numname, 0) == -1)
-            error();
-        if (unlink(argv[i]) == -1)
-            error();
-
-        flog(LOG_INFO, "delivered %s/%s", mhdir, numname);
-    }
+    for (i = 2 + maildir;  i < argc;  ++i)
+        prepare(argv[i], st.st_gid, maildir);
 
-
-    /* unlock (explicitly) */
-    if (flock(dfd, LOCK_UN) == -1)
-        error();
+    if (maildir)
+        deliver_maildir(mhdir, dfd, argv + 3, argc - 3);
+    else
+        deliver_mh(mhdir, dir, dfd, argv + 2, argc - 2);
 
     /* close directory */
     if (closedir(dir) == -1)
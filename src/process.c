@@ -1,30 +1,99 @@
 /*
+  Child process accounting, driven by the main thread's event loop.
+
+  SIGCHLD, SIGINT and SIGTERM are blocked (in all threads, since this is
+  initialized before any threads are started) and read from a signalfd.
+  Each child is tracked with a pidfd, which becomes readable when the
+  child exits; the exit status and runtime are then recorded.  Without
+  pidfd support, children are reaped upon SIGCHLD.
+
+  Launches belong to a class, by the stage they run: CPU-bound stages
+  (key generation and derivation) and network-bound ones (fetch, comm)
+  have separate process limits.  When a class is at its limit, launches
+  are queued in it (up to maxpending for all classes, without duplicates),
+  and started as its children exit; urgent launches (completion work,
+  which frees resources) are queued before other ones.
+
+  Launches are run by pre-forked workers when available (see worker.c),
+  which report the exit status over a socket; otherwise, the daemon forks
+  the child itself.
+
+  Each launch carries a caller's tag (allocated with malloc()), which is
+  passed to the exit hook when the child exits (or with status -1 if the
+  launch fails), and freed afterwards.
+
   NOT thread-safe!
 */
 
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
-#include <assert.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
 
 #include "process.h"
+#include "event.h"
+#include "worker.h"
 #include "util.h"
 
 
+/* max. number of arguments of queued launches */
+#define MAX_ARGS 8
+
+
 /* fast shutdown indicator */
-static volatile int stop;
+static int stop;
 
+/* signal mask before init_process_acc(), restored in children */
+static sigset_t oldmask;
+static int      initok;
 
-/*
-  process counters (not used if initok is 0)
-  pstarted:  incremented in run_process()
-  pfinished: incremented in chld_handler()
-*/
-static volatile long pstarted = 0, pfinished = 0;
-static          int  initok;
+static struct event sigev = { -1, NULL };
+
+/* running children (event first, for callbacks) */
+struct child {
+    struct event    ev;
+    struct child    *next;
+    enum PROC_Class cls;
+    pid_t           pid;
+    int             inworker;
+    double          start;
+    char            *desc;
+    void            *tag;
+};
+
+static struct child *children;
+
+/* queued launches (FIFO, urgent ones first) */
+struct job {
+    struct job *next;
+    char       *argv[MAX_ARGS+1];
+    char *const *envp;
+    int        urgent;
+    void       *tag;
+};
+
+/* per-class limit, and queue (urgtail is the insertion point for urgent launches) */
+static struct pool {
+    const char    *name;
+    long          nchildren, maxproc;
+    struct job    *head, **tail, **urgtail;
+    long          njobs, nurgent;
+    unsigned long nlaunched;
+} pools[PROC_CLASSES] = { { "cpu" }, { "net" } };
+
+static long njobs, maxpending;
+
+/* called when a launched child exits (status is -1 if it is not tracked) */
+static void (*exit_hook)(void *tag, int status);
+
+/* statistics */
+static unsigned long nfinished, nfailed, nqueued;
+static double        runtime;
 
 
 int stop_requested() {
@@ -32,10 +101,246 @@ int stop_requested() {
 }
 
 
-static void stop_handler(int signum) {
-    assert(signum == SIGINT  ||  signum == SIGTERM);
-    if (signum == SIGINT  ||  signum == SIGTERM) {
-        if (!stop) {
+/* arguments (except the executable path), space-separated */
+static char* describe(const char *const argv[]) {
+    size_t len = 1;
+    char   *desc;
+    int    i;
+
+    for (i = 1;  argv[i];  ++i)
+        len += strlen(argv[i]) + 1;
+
+    if (!((desc = (char*) malloc(len))))
+        error("malloc failed");
+
+    for (*desc = '\0', i = 1;  argv[i];  ++i) {
+        if (i > 1)
+            strcat(desc, " ");
+        strcat(desc, argv[i]);
+    }
+
+    return desc;
+}
+
+
+static void free_job(struct job *j) {
+    int i;
+
+    for (i = 0;  j->argv[i];  ++i)
+        free(j->argv[i]);
+    free(j->tag);
+    free(j);
+}
+
+
+static void child_event(struct event *ev);
+static void worker_done(void *arg, int status);
+
+
+/* failed launch is reported to the exit hook as well, so that callers can rerun it */
+static void fail_launch(void *tag) {
+    if (exit_hook)
+        exit_hook(tag, -1);
+    free(tag);
+}
+
+
+/* new child is tracked at the head of children list (unless init failed); takes tag */
+static int launch(const char *const argv[], char *const envp[], enum PROC_Class cls, void *tag) {
+    struct child *c;
+    pid_t        pid;
+
+    if (!((c = (struct child*) calloc(1, sizeof(struct child)))))
+        error("calloc failed");
+
+    /* worker exits are reported from the event loop, so init must have succeeded */
+    if (initok  &&  worker_run(argv, envp, worker_done, c, &pid)) {
+        c->inworker = 1;
+        c->ev.fd    = -1;
+    }
+    else if ((pid = fork()) == -1) {
+        warning("fork failed");
+        free(c);
+        fail_launch(tag);
+        return 0;
+    }
+    else if (pid == 0) {
+        /* children don't inherit blocked signals */
+        if (initok)
+            sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
+        /* modifiable strings signature seems to be historic */
+        if (envp)
+            execve(argv[0], (char *const *) argv, envp);
+        else
+            execvp(argv[0], (char *const *) argv);
+
+        /* exits just the fork */
+        error("loop execution failed");
+    }
+
+    if (!initok) {
+        exit_hook(tag, -1);
+        free(tag);
+        free(c);
+        return 1;
+    }
+
+    c->cls   = cls;
+    c->pid   = pid;
+    c->start = getmontime();
+    c->desc  = describe(argv);
+    c->tag   = tag;
+    c->ev.fn = child_event;
+
+    /* without a pidfd, the child is reaped upon SIGCHLD */
+    if (!c->inworker  &&  (c->ev.fd = syscall(SYS_pidfd_open, pid, 0)) != -1  &&  !event_add(&c->ev)) {
+        close(c->ev.fd);
+        c->ev.fd = -1;
+    }
+
+    c->next  = children;
+    children = c;
+    ++pools[cls].nchildren;
+    ++pools[cls].nlaunched;
+
+    return 1;
+}
+
+
+static void push_job(struct pool *p, struct job *j) {
+    struct job ***at = j->urgent ? &p->urgtail : &p->tail;
+
+    j->next = **at;
+    **at    = j;
+
+    /* tail and urgent insertion point move if the job was put at their position */
+    if (p->tail == *at)
+        p->tail = &j->next;
+    if (j->urgent) {
+        p->urgtail = &j->next;
+        ++p->nurgent;
+    }
+
+    ++p->njobs;
+    ++njobs;
+}
+
+
+static struct job* pop_job(struct pool *p) {
+    struct job *j;
+
+    if ((j = p->head)) {
+        p->head = j->next;
+
+        if (p->tail == &j->next)
+            p->tail = &p->head;
+        if (p->urgtail == &j->next)
+            p->urgtail = &p->head;
+        if (j->urgent)
+            --p->nurgent;
+
+        --p->njobs;
+        --njobs;
+    }
+
+    return j;
+}
+
+
+/* start queued launches while below process limits */
+static void run_jobs() {
+    struct pool *p;
+    struct job  *j;
+
+    /* jobs are queued only if children are tracked */
+    for (p = pools;  p < pools + PROC_CLASSES;  ++p)
+        while (!stop  &&  p->head  &&  p->nchildren < p->maxproc) {
+            j = pop_job(p);
+
+            if (launch((const char *const*) j->argv, j->envp, (enum PROC_Class) (p - pools), j->tag))
+                flog(LOG_INFO, "processing (queued, %s): %s", p->name, children->desc);
+
+            j->tag = NULL;
+            free_job(j);
+        }
+}
+
+
+static void finish_child(struct child *c, int status) {
+    struct child **pc;
+    double       elapsed = getmontime() - c->start;
+
+    for (pc = &children;  *pc != c;  pc = &(*pc)->next)
+        ;
+    *pc = c->next;
+    --pools[c->cls].nchildren;
+
+    if (c->ev.fd != -1) {
+        event_del(&c->ev);
+        if (close(c->ev.fd))
+            warning("could not close pidfd");
+    }
+
+    ++nfinished;
+    runtime += elapsed;
+
+    if (status == -1) {
+        ++nfailed;
+        flog(LOG_DEBUG, "finished: %s (%.1f s, worker crashed)", c->desc, elapsed);
+    }
+    else if (WIFEXITED(status)  &&  !WEXITSTATUS(status))
+        flog(LOG_DEBUG, "finished: %s (%.1f s)", c->desc, elapsed);
+    else {
+        ++nfailed;
+        if (WIFEXITED(status))
+            flog(LOG_DEBUG, "finished: %s (%.1f s, status %d)", c->desc, elapsed, WEXITSTATUS(status));
+        else
+            flog(LOG_DEBUG, "finished: %s (%.1f s, signal %d)", c->desc, elapsed, WTERMSIG(status));
+    }
+
+    exit_hook(c->tag, status);
+
+    free(c->tag);
+    free(c->desc);
+    free(c);
+}
+
+
+/* job run by a worker has exited (status is -1 if the worker crashed) */
+static void worker_done(void *arg, int status) {
+    finish_child((struct child*) arg, status);
+    run_jobs();
+}
+
+
+/* pidfd is readable: child has exited */
+static void child_event(struct event *ev) {
+    struct child *c = (struct child*) ev;
+    int          status;
+
+    if (waitpid(c->pid, &status, WNOHANG) == c->pid) {
+        finish_child(c, status);
+        run_jobs();
+    }
+}
+
+
+static void signal_event(struct event *ev) {
+    struct signalfd_siginfo si;
+    struct child            *c, *next;
+    int                     status;
+
+    while (read(ev->fd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGCHLD) {
+            /* children without pidfd (multiple SIGCHLD instances are compressed) */
+            for (c = children;  c;  c = next) {
+                next = c->next;
+                if (c->ev.fd == -1  &&  !c->inworker  &&  waitpid(c->pid, &status, WNOHANG) == c->pid)
+                    finish_child(c, status);
+            }
+        }
+        else if (!stop) {
             stop = 1;
 
 #ifndef TESTING
@@ -44,82 +349,173 @@ static void stop_handler(int signum) {
 #endif
         }
     }
+
+    run_jobs();
+}
+
+
+int init_process_acc(long maxcpu, long maxnet, long maxjobs, void (*hook)(void *tag, int status)) {
+    sigset_t mask;
+    int      i;
+
+    stop       = 0;
+    exit_hook  = hook;
+    maxpending = maxjobs;
+
+    pools[PROC_CPU].maxproc = maxcpu;
+    pools[PROC_NET].maxproc = maxnet;
+
+    for (i = 0;  i < PROC_CLASSES;  ++i)
+        pools[i].tail = pools[i].urgtail = &pools[i].head;
+
+    initok =    !sigemptyset(&mask)
+             && !sigaddset(&mask, SIGCHLD)
+             && !sigaddset(&mask, SIGINT)
+             && !sigaddset(&mask, SIGTERM)
+             && !sigprocmask(SIG_BLOCK, &mask, &oldmask);
+
+    if (initok  &&  (sigev.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+        sigprocmask(SIG_SETMASK, &oldmask, NULL);
+        initok = 0;
+    }
+
+    if (initok) {
+        sigev.fn = signal_event;
+        if (!event_add(&sigev)) {
+            close(sigev.fd);
+            sigev.fd = -1;
+            sigprocmask(SIG_SETMASK, &oldmask, NULL);
+            initok = 0;
+        }
+    }
+
+    /* untracked children are reaped automatically */
+    if (!initok)
+        signal(SIGCHLD, SIG_IGN);
+
+    return initok;
 }
 
 
-static void chld_handler(int signum) {
-    pid_t pid;
-    int   status;
+/* running children are not waited for */
+void shutdown_process_acc() {
+    struct child *c;
+    struct job   *j;
+    int          i;
 
-    assert(signum == SIGCHLD);
-    if (signum == SIGCHLD) {
-        /*
-          multiple instances of pending signals are compressed, so
-          handle all completed processes as soon as possible
-        */
-        while ((pid = waitpid(0, &status, WNOHANG)) > 0)
-            ++pfinished;
+    for (i = 0;  i < PROC_CLASSES;  ++i)
+        while ((j = pop_job(&pools[i])))
+            free_job(j);
+
+    while ((c = children)) {
+        children = c->next;
+        if (c->ev.fd != -1) {
+            event_del(&c->ev);
+            close(c->ev.fd);
+        }
+        --pools[c->cls].nchildren;
+        free(c->tag);
+        free(c->desc);
+        free(c);
+    }
 
-        /* -1/ECHILD is returned for no pending completed processes */
-        assert(pid != -1  ||  errno == ECHILD);
+    if (sigev.fd != -1) {
+        event_del(&sigev);
+        if (close(sigev.fd))
+            warning("could not close signalfd");
+        sigev.fd = -1;
     }
+
+    if (nfinished)
+        flog(LOG_INFO, "processes: %lu finished (%lu failed), %.1f s avg. runtime, %lu queued, "
+             "%lu cpu / %lu net launches", nfinished, nfailed, runtime / nfinished, nqueued,
+             pools[PROC_CPU].nlaunched, pools[PROC_NET].nlaunched);
 }
 
 
-int init_process_acc() {
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
+void log_process_load(int priority) {
+    const struct pool *c = &pools[PROC_CPU], *n = &pools[PROC_NET];
 
-    stop = 0;
+    flog(priority, "load: cpu %ld/%ld running, %ld queued (%ld urgent); net %ld/%ld running, %ld queued (%ld urgent)",
+         c->nchildren, c->maxproc, c->njobs, c->nurgent, n->nchildren, n->maxproc, n->njobs, n->nurgent);
+}
 
-    /* restart system calls interrupted by SIGCHLD */
-    sa.sa_handler  = chld_handler;
-    sa.sa_flags    = SA_RESTART;
 
-    /* SIGCHLD is automatically added to the mask */
-    initok =    !sigemptyset(&sa.sa_mask)
-             && !sigaction(SIGCHLD, &sa, NULL);
+/* handle pending signals without waiting for the event loop (e.g., during long scans) */
+void poll_signals() {
+    if (sigev.fd != -1)
+        signal_event(&sigev);
+}
 
-    sa.sa_handler  = stop_handler;
-    sa.sa_flags    = 0;
 
-    initok =    initok
-             && !sigaction(SIGINT,  &sa, NULL)
-             && !sigaction(SIGTERM, &sa, NULL);
+/* launches of a class at its limit would be refused (launch queue is full) */
+int process_full() {
+    return initok  &&  njobs >= maxpending;
+}
 
-    return initok;
+
+static int same_args(const struct job *j, const char *const argv[]) {
+    int i;
+
+    for (i = 0;  j->argv[i]  &&  argv[i];  ++i)
+        if (strcmp(j->argv[i], argv[i]))
+            return 0;
+
+    return !j->argv[i]  &&  !argv[i];
 }
 
 
-int run_process(long maxproc, double waitsec, const char *const argv[]) {
-    int   res = 0;
-    long  pcount;
-    pid_t pid;
+/*
+  envp replaces the environment if not NULL (argv[0] must be a path then)
+  envp must remain valid while the launch is queued
+*/
+enum PROC_Status run_process(const char *const argv[], char *const envp[],
+                             enum PROC_Class cls, int urgent, void *tag) {
+    struct pool *p = &pools[cls];
+    struct job  *j;
+    int         i;
 
-    /*
-      wait if too many processes have been launched
-      SIGCHLD from terminated processes also interrupts sleep
-    */
-    while (initok  &&  !stop_requested()  &&  (pcount = pstarted - pfinished) >= maxproc) {
-        flog(LOG_NOTICE, "too many processes (%ld), waiting...", pcount);
-        sleepsec(waitsec);
+    if (stop) {
+        fail_launch(tag);
+        return PROC_ERR;
     }
 
-    if (!stop_requested()) {
-        if ((pid = fork()) == -1)
-            warning("fork failed");
-        else if (pid == 0) {
-            /* modifiable strings signature seems to be historic */
-            execvp(argv[0], (char *const *) argv);
+    if (!initok  ||  p->nchildren < p->maxproc)
+        return launch(argv, envp, cls, tag) ? PROC_STARTED : PROC_ERR;
 
-            /* exits just the fork */
-            error("loop execution failed");
-        }
-        else {
-            ++pstarted;
-            res = 1;
-        }
+    /* identical launch is already queued (possibly in another class, if its stage changed) */
+    for (i = 0;  i < PROC_CLASSES;  ++i)
+        for (j = pools[i].head;  j;  j = j->next)
+            if (j->envp == envp  &&  same_args(j, argv)) {
+                free(tag);
+                return PROC_QUEUED;
+            }
+
+    if (njobs >= maxpending) {
+        flog(LOG_NOTICE, "too many processes and queued launches (%s)", p->name);
+        log_process_load(LOG_NOTICE);
+        fail_launch(tag);
+        return PROC_ERR;
     }
 
-    return res;
+    for (i = 0;  argv[i];  ++i)
+        if (i == MAX_ARGS) {
+            fail_launch(tag);
+            return PROC_ERR;
+        }
+
+    if (!((j = (struct job*) calloc(1, sizeof(struct job)))))
+        error("calloc failed");
+
+    for (i = 0;  argv[i];  ++i)
+        if (!((j->argv[i] = strdup(argv[i]))))
+            error("strdup failed");
+    j->envp   = envp;
+    j->urgent = urgent;
+    j->tag    = tag;
+
+    push_job(p, j);
+    ++nqueued;
+
+    return PROC_QUEUED;
 }
@@ -1,8 +1,30 @@
 #ifndef PROCESS_H
 #define PROCESS_H
 
-int init_process_acc();
-int run_process(long maxproc, double waitsec, const char *const argv[]);
+enum PROC_Status {PROC_ERR, PROC_STARTED, PROC_QUEUED};
+
+/* launch classes, with separate process limits */
+enum PROC_Class {PROC_CPU, PROC_NET};
+#define PROC_CLASSES 2
+
+/* requires init_events(), and must precede thread creation */
+int init_process_acc(long maxcpu, long maxnet, long maxjobs, void (*hook)(void *tag, int status));
+void shutdown_process_acc();
+void poll_signals();
+
+/*
+  tag (malloc'ed or NULL) is passed to exit hook, and freed in all cases
+  (also if the launch fails, with status -1, before PROC_ERR is returned)
+  urgent launches are queued before other ones of their class
+*/
+enum PROC_Status run_process(const char *const argv[], char *const envp[],
+                             enum PROC_Class cls, int urgent, void *tag);
+
+/* running and queued launches per class */
+void log_process_load(int priority);
+
+/* new launches may be refused until a child exits */
+int process_full();
 
 int stop_requested();
 
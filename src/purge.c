@@ -0,0 +1,542 @@
+/*
+  Background removal of directory trees, at idle I/O priority:
+
+  stale:   temporary directories left by a crash, found during the daemon's
+           recovery scan, are removed by a few threads in parallel, while
+           the main loop already processes pending work; the last thread
+           to finish logs the duration
+  collect: <msgid>.del directories of finished messages (and expired key
+           sessions) are queued by the main loop, and removed in batches by
+           a collector thread, at most rate directories per second (so that
+           deletion storms don't compete with foreground I/O on shared
+           disks); each directory is locked first, as [loop] did, to let the
+           renaming action finish
+  usage:   disk usage of registered directory trees (the (r)queues) is
+           measured by the collector thread every period seconds (also
+           between batches), and reported to a callback from that thread
+
+  Trees are removed with unlinkat() relative to their parent's descriptor.
+  Each queued directory carries a caller's tag (allocated with malloc()),
+  which is passed to the completion hook from the event loop (via an
+  eventfd), and freed afterwards.
+
+  Functions are called from the main thread only.
+*/
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include "purge.h"
+#include "event.h"
+#include "util.h"
+
+
+/* removal threads for stale directories, and max. depth of removed trees (tmp.*\/<msgid>/ is 2) */
+#define PURGE_THREADS  4
+#define PURGE_DEPTH    8
+
+/* collector batch size, and lock wait for each directory (sec, as flock -w in [loop]) */
+#define GC_BATCH       32
+#define GC_LOCK_TMOUT   2
+#define GC_LOCK_POLL    0.05
+
+/* ioprio_set(2) parameters (no libc wrapper) */
+#define IOPRIO_WHO_PROCESS  1
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_CLASS_SHIFT 13
+
+
+/* stale directories */
+static char   **paths;
+static size_t npaths, allocpaths, next;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t       threads[PURGE_THREADS];
+static int             nthreads, nactive;
+
+static unsigned long nremoved;
+static double        start;
+
+
+/* collected directory (queued, then done) */
+struct item {
+    struct item *next;
+    char        *path;
+    void        *tag;
+    int         status;
+};
+
+static struct item *queue, **queuetail = &queue, *done, **donetail = &done;
+
+static pthread_cond_t workcond = PTHREAD_COND_INITIALIZER;
+static pthread_t      gcthread;
+static int            gcstarted, stop;
+static double         gcrate;
+
+static struct event   doneev = { -1, NULL };
+static void           (*done_hook)(void *tag, int status);
+
+static unsigned long  ncollected, nfailed, nbatches;
+
+
+/* measured directory tree (prepended under lock, freed at shutdown) */
+struct usage {
+    struct usage *next;
+    char         *path;
+    void         (*fn)(void *arg, unsigned long long bytes);
+    void         *arg;
+};
+
+static struct usage   *usages;
+static double         usageperiod, usagedue;
+
+
+/* lowest I/O priority for the calling thread (best effort) */
+static void set_idle_io() {
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT))
+        warning("failed to set idle I/O priority");
+}
+
+
+/* remove file or directory tree (name relative to dirfd), returning 1 if gone */
+static int remove_tree(int dirfd, const char *name, int depth) {
+    struct dirent *de;
+    DIR    *dir;
+    int    fd, ok = 1;
+
+    /* files are the common case in message directories */
+    if (!unlinkat(dirfd, name, 0))
+        return 1;
+    if (errno != EISDIR  &&  errno != EPERM)
+        return errno == ENOENT;
+
+    if (depth == PURGE_DEPTH
+        ||  (fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1)
+        return 0;
+
+    /* closedir() closes fd */
+    if (!((dir = fdopendir(fd)))) {
+        close(fd);
+        return 0;
+    }
+
+    while ((de = readdir(dir)))
+        if (strcmp(de->d_name, ".")  &&  strcmp(de->d_name, ".."))
+            ok = remove_tree(fd, de->d_name, depth + 1)  &&  ok;
+
+    if (closedir(dir))
+        warning("could not close directory");
+
+    return (!unlinkat(dirfd, name, AT_REMOVEDIR)  ||  errno == ENOENT)  &&  ok;
+}
+
+
+/* disk usage of a file or directory tree (hard-linked files are shared among their links) */
+static unsigned long long tree_usage(int dirfd, const char *name, int depth) {
+    unsigned long long size;
+    struct dirent *de;
+    struct stat   st;
+    DIR    *dir;
+    int    fd;
+
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW))
+        return 0;
+
+    size = st.st_blocks * 512ULL;
+    if (!S_ISDIR(st.st_mode))
+        return size / (st.st_nlink ? st.st_nlink : 1);
+
+    if (depth == PURGE_DEPTH
+        ||  (fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1)
+        return size;
+
+    /* closedir() closes fd */
+    if (!((dir = fdopendir(fd)))) {
+        close(fd);
+        return size;
+    }
+
+    while ((de = readdir(dir)))
+        if (strcmp(de->d_name, ".")  &&  strcmp(de->d_name, ".."))
+            size += tree_usage(fd, de->d_name, depth + 1);
+
+    if (closedir(dir))
+        warning("could not close directory");
+
+    return size;
+}
+
+
+/* lock and remove a collected directory, returning 1 if gone */
+static int collect_dir(const char *path) {
+    double until = getmontime() + GC_LOCK_TMOUT;
+    int    fd, locked, ok = 0;
+
+    if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1)
+        return errno == ENOENT;
+
+    while (!((locked = !flock(fd, LOCK_EX | LOCK_NB)))  &&  errno == EWOULDBLOCK  &&  getmontime() < until)
+        sleepsec(GC_LOCK_POLL);
+
+    if (!locked)
+        flog(LOG_NOTICE, "could not lock %s", path);
+    else if (!((ok = remove_tree(AT_FDCWD, path, 0))))
+        flog(LOG_WARNING, "could not remove %s", path);
+
+    /* lock is released with the last descriptor */
+    if (close(fd))
+        warning("could not close directory");
+
+    return ok;
+}
+
+
+static void* purge_thread(void *arg) {
+    size_t i;
+    int    ok;
+
+    set_idle_io();
+
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        i = next < npaths ? next++ : npaths;
+        pthread_mutex_unlock(&lock);
+
+        if (i == npaths)
+            break;
+
+        if (!((ok = remove_tree(AT_FDCWD, paths[i], 0))))
+            flog(LOG_WARNING, "could not remove %s", paths[i]);
+
+        pthread_mutex_lock(&lock);
+        nremoved += ok;
+        pthread_mutex_unlock(&lock);
+    }
+
+    pthread_mutex_lock(&lock);
+    if (!--nactive)
+        flog(LOG_INFO, "removed %lu of %lu stale directories, %.1f ms",
+             nremoved, (unsigned long) npaths, (getmontime() - start) * 1e3);
+    pthread_mutex_unlock(&lock);
+
+    return NULL;
+}
+
+
+/* wait for work or shutdown until monotonic time until (0 for no timeout), with lock held */
+static void wait_until(double until) {
+    struct timespec ts;
+    double          t;
+
+    if (!until) {
+        pthread_cond_wait(&workcond, &lock);
+        return;
+    }
+
+    if ((t = getmontime()) < until) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        t = ts.tv_nsec / 1e9 + (until - t);
+        ts.tv_sec  += (time_t) t;
+        ts.tv_nsec  = (long) ((t - (time_t) t) * 1e9);
+
+        pthread_cond_timedwait(&workcond, &lock, &ts);
+    }
+}
+
+
+/* measure registered trees (entries registered meanwhile are measured next time) */
+static void measure_usage(struct usage *u) {
+    for (;  u;  u = u->next)
+        u->fn(u->arg, tree_usage(AT_FDCWD, u->path, 0));
+}
+
+
+static void* collect_thread(void *arg) {
+    struct item     *batch, *it, **tail;
+    struct usage    *u;
+    uint64_t        one = 1;
+    double          until;
+    int             n, max;
+
+    set_idle_io();
+
+    /* fractional rates are spread over single-directory batches */
+    max = gcrate > 0  &&  gcrate < GC_BATCH ? (gcrate < 1 ? 1 : (int) gcrate) : GC_BATCH;
+
+    pthread_mutex_lock(&lock);
+
+    while (!stop) {
+        /* disk usage is measured when due, also between batches */
+        if (usages  &&  getmontime() >= usagedue) {
+            u = usages;
+            pthread_mutex_unlock(&lock);
+
+            measure_usage(u);
+
+            pthread_mutex_lock(&lock);
+            usagedue = getmontime() + usageperiod;
+            continue;
+        }
+
+        if (!queue) {
+            wait_until(usages ? usagedue : 0);
+            continue;
+        }
+
+        /* take a batch from queue head */
+        batch = queue;
+        for (n = 0, tail = &queue;  *tail  &&  n < max;  tail = &(*tail)->next, ++n)
+            ;
+        queue  = *tail;
+        *tail  = NULL;
+        if (!queue)
+            queuetail = &queue;
+
+        pthread_mutex_unlock(&lock);
+
+        until = getmontime() + (gcrate > 0 ? n / gcrate : 0);
+
+        for (it = batch;  it;  it = it->next)
+            if (!((it->status = !collect_dir(it->path))))
+                ++ncollected;
+            else
+                ++nfailed;
+
+        pthread_mutex_lock(&lock);
+
+        ++nbatches;
+
+        /* hand batch over to the event loop */
+        for (*donetail = batch;  *donetail;  donetail = &(*donetail)->next)
+            ;
+
+        if (write(doneev.fd, &one, sizeof(one)) == -1)
+            warning("failed to write eventfd");
+
+        /* rate limit (shutdown interrupts the wait) */
+        while (!stop  &&  getmontime() < until)
+            wait_until(until);
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    return NULL;
+}
+
+
+static void free_items(struct item *it) {
+    struct item *next;
+
+    for (;  it;  it = next) {
+        next = it->next;
+        free(it->path);
+        free(it->tag);
+        free(it);
+    }
+}
+
+
+/* eventfd is readable: run completion hook for collected directories */
+static void done_event(struct event *ev) {
+    struct item *list, *it;
+    uint64_t    count;
+
+    if (read(ev->fd, &count, sizeof(count)) == -1  &&  errno != EAGAIN)
+        warning("failed to read eventfd");
+
+    pthread_mutex_lock(&lock);
+    list     = done;
+    done     = NULL;
+    donetail = &done;
+    pthread_mutex_unlock(&lock);
+
+    for (it = list;  it;  it = it->next)
+        if (done_hook)
+            done_hook(it->tag, it->status);
+
+    free_items(list);
+}
+
+
+int init_purge(double rate, void (*hook)(void *tag, int status)) {
+    done_hook = hook;
+    gcrate    = rate;
+    stop      = 0;
+
+    if ((doneev.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        warning("failed to create eventfd");
+        return 0;
+    }
+
+    doneev.fn = done_event;
+    if (!event_add(&doneev)) {
+        close(doneev.fd);
+        doneev.fd = -1;
+        return 0;
+    }
+
+    if ((errno = pthread_create(&gcthread, NULL, collect_thread, NULL))) {
+        warning("failed to start collector thread");
+        event_del(&doneev);
+        close(doneev.fd);
+        doneev.fd = -1;
+        return 0;
+    }
+
+    gcstarted = 1;
+    return 1;
+}
+
+
+void purge_stale(const char *path) {
+    if (npaths == allocpaths) {
+        allocpaths = allocpaths ? allocpaths * 2 : 16;
+        if (!((paths = (char**) realloc(paths, allocpaths * sizeof(char*)))))
+            error("realloc failed");
+    }
+
+    if (!((paths[npaths++] = strdup(path))))
+        error("strdup failed");
+}
+
+
+void purge_start() {
+    int n;
+
+    if (!npaths  ||  nthreads)
+        return;
+
+    start   = getmontime();
+    n       = npaths < PURGE_THREADS ? (int) npaths : PURGE_THREADS;
+    nactive = n;
+
+    for (nthreads = 0;  nthreads < n;  ++nthreads)
+        if ((errno = pthread_create(&threads[nthreads], NULL, purge_thread, NULL))) {
+            warning("failed to start purge thread");
+            break;
+        }
+
+    /* remaining paths are removed by the main thread if no thread could be started */
+    pthread_mutex_lock(&lock);
+    nactive -= n - nthreads;
+    pthread_mutex_unlock(&lock);
+
+    if (!nthreads) {
+        nactive = 1;
+        purge_thread(NULL);
+    }
+}
+
+
+int purge_collect(const char *path, void *tag) {
+    struct item *it;
+
+    if (!gcstarted) {
+        free(tag);
+        return 0;
+    }
+
+    if (!((it = (struct item*) calloc(1, sizeof(struct item))))  ||  !((it->path = strdup(path))))
+        error("malloc failed");
+    it->tag = tag;
+
+    pthread_mutex_lock(&lock);
+    *queuetail = it;
+    queuetail  = &it->next;
+    pthread_cond_signal(&workcond);
+    pthread_mutex_unlock(&lock);
+
+    return 1;
+}
+
+
+int purge_usage(const char *path, double period,
+                void (*fn)(void *arg, unsigned long long bytes), void *arg) {
+    struct usage *u;
+
+    if (!gcstarted)
+        return 0;
+
+    if (!((u = (struct usage*) calloc(1, sizeof(struct usage))))  ||  !((u->path = strdup(path))))
+        error("malloc failed");
+    u->fn  = fn;
+    u->arg = arg;
+
+    /* the first measurement is due immediately */
+    pthread_mutex_lock(&lock);
+    u->next     = usages;
+    usages      = u;
+    usageperiod = period;
+    usagedue    = 0;
+    pthread_cond_signal(&workcond);
+    pthread_mutex_unlock(&lock);
+
+    return 1;
+}
+
+
+void shutdown_purge() {
+    struct usage *u;
+    size_t       i;
+    int          t;
+
+    /* trees being removed are completed, remaining ones are left for next startup */
+    pthread_mutex_lock(&lock);
+    next = npaths;
+    stop = 1;
+    pthread_cond_signal(&workcond);
+    pthread_mutex_unlock(&lock);
+
+    for (t = 0;  t < nthreads;  ++t)
+        if ((errno = pthread_join(threads[t], NULL)))
+            warning("failed to join purge thread");
+
+    for (i = 0;  i < npaths;  ++i)
+        free(paths[i]);
+    free(paths);
+
+    paths    = NULL;
+    npaths   = allocpaths = next = 0;
+    nthreads = 0;
+
+    if (gcstarted) {
+        if ((errno = pthread_join(gcthread, NULL)))
+            warning("failed to join collector thread");
+        gcstarted = 0;
+
+        if (nbatches)
+            flog(LOG_INFO, "collected %lu directories (%lu failed) in %lu batches",
+                 ncollected, nfailed, nbatches);
+    }
+
+    for (;  usages;  usages = u) {
+        u = usages->next;
+        free(usages->path);
+        free(usages);
+    }
+
+    /* completion hooks are not run */
+    free_items(queue);
+    free_items(done);
+    queue = done = NULL;
+    queuetail = &queue;
+    donetail  = &done;
+
+    if (doneev.fd != -1) {
+        event_del(&doneev);
+        if (close(doneev.fd))
+            warning("could not close eventfd");
+        doneev.fd = -1;
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef PURGE_H
+#define PURGE_H
+
+/*
+  start collector thread, removing at most rate directories per second (0 for no limit)
+  requires init_events(); hook is called from the event loop (status is 0 if removed)
+*/
+int init_purge(double rate, void (*hook)(void *tag, int status));
+void shutdown_purge();
+
+/* collect a stale directory tree (before purge_start()) */
+void purge_stale(const char *path);
+
+/* remove collected stale trees in background threads */
+void purge_start();
+
+/* queue a directory for the collector; tag (malloc'ed or NULL) is freed in all cases */
+int purge_collect(const char *path, void *tag);
+
+/*
+  measure disk usage of a directory tree every period seconds in the collector
+  thread, starting now; fn is called from that thread (0 if no collector)
+*/
+int purge_usage(const char *path, double period,
+                void (*fn)(void *arg, unsigned long long bytes), void *arg);
+
+#endif
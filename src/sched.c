@@ -0,0 +1,423 @@
+/*
+  Retry schedule of (r)queue entries (msgid or msgid.del directories) of
+  all served identities: a binary min-heap keyed by next retry deadline,
+  with a hash table for lookups by (identity, queue type, name).
+
+  Each time an entry becomes due, its backoff doubles (up to max);
+  activity (inotify events, webserver wakeups) resets it to init.
+  Inotify events are debounced: the entry is kicked (due soon, without
+  backoff), so that a burst of events results in a single run.
+
+  Entries with a running loop are marked, and further runs requested
+  meanwhile are collapsed into a single rerun after the loop exits.
+
+  Scans use generations, as msgid indexes do: entries which were not seen
+  during a complete scan are removed.
+
+  Message expiry times (wall clock) are kept in a timer wheel, with timers
+  embedded in the entries, so that removed entries don't expire.
+
+  NOT thread-safe (used by the main loop only)
+*/
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "sched.h"
+#include "wheel.h"
+#include "daemon.h"
+#include "util.h"
+
+
+#define INIT_BUCKETS 1024
+#define MAX_LOAD     2
+
+/* name: msgid[.del] */
+#define NAME_LENGTH  (MSGID_LENGTH+4)
+
+
+struct sentry {
+    struct sentry         *next;
+    const struct identity *id;
+    int                   rq;
+    size_t                pos;
+    unsigned long         gen;
+    double                deadline, backoff;
+    int                   kick, running, rerun;
+    struct timer          timer;
+    char                  name[NAME_LENGTH+1];
+};
+
+struct sched {
+    struct sentry **buckets, **heap;
+    struct wheel  *wheel;
+    size_t        nbuckets, count, heapalloc;
+    unsigned long gen;
+    unsigned      seed;
+    double        init, max;
+};
+
+
+static size_t hash(const struct sched *s, const struct identity *id, int rq, const char *name) {
+    unsigned h = 2166136261u ^ s->seed;
+
+    h = (h ^ (unsigned) (size_t) id) * 16777619u;
+    h = (h ^ (unsigned) rq)          * 16777619u;
+
+    for (; *name;  ++name)
+        h = (h ^ (unsigned char) *name) * 16777619u;
+
+    return h & (s->nbuckets - 1);
+}
+
+
+static struct sentry** find(struct sched *s, const struct identity *id, int rq, const char *name) {
+    struct sentry **pe;
+
+    for (pe = &s->buckets[hash(s, id, rq, name)];  *pe;  pe = &(*pe)->next)
+        if ((*pe)->id == id  &&  (*pe)->rq == rq  &&  !strcmp((*pe)->name, name))
+            break;
+
+    return pe;
+}
+
+
+static void alloc_buckets(struct sched *s, size_t nbuckets) {
+    if (!((s->buckets = (struct sentry**) calloc(nbuckets, sizeof(struct sentry*)))))
+        error("calloc failed");
+    s->nbuckets = nbuckets;
+}
+
+
+static void grow(struct sched *s) {
+    struct sentry **old = s->buckets, *e, *next;
+    size_t        oldn  = s->nbuckets, i, h;
+
+    alloc_buckets(s, oldn * 2);
+
+    for (i = 0;  i < oldn;  ++i)
+        for (e = old[i];  e;  e = next) {
+            next = e->next;
+            h    = hash(s, e->id, e->rq, e->name);
+
+            e->next       = s->buckets[h];
+            s->buckets[h] = e;
+        }
+
+    free(old);
+}
+
+
+static void heap_set(struct sched *s, size_t pos, struct sentry *e) {
+    s->heap[pos] = e;
+    e->pos       = pos;
+}
+
+
+static void sift_up(struct sched *s, size_t pos) {
+    struct sentry *e = s->heap[pos];
+    size_t        parent;
+
+    for (; pos > 0;  pos = parent) {
+        parent = (pos - 1) / 2;
+        if (s->heap[parent]->deadline <= e->deadline)
+            break;
+
+        heap_set(s, pos, s->heap[parent]);
+    }
+
+    heap_set(s, pos, e);
+}
+
+
+static void sift_down(struct sched *s, size_t pos) {
+    struct sentry *e = s->heap[pos];
+    size_t        child;
+
+    for (; (child = 2*pos + 1) < s->count;  pos = child) {
+        if (child+1 < s->count  &&  s->heap[child+1]->deadline < s->heap[child]->deadline)
+            ++child;
+        if (e->deadline <= s->heap[child]->deadline)
+            break;
+
+        heap_set(s, pos, s->heap[child]);
+    }
+
+    heap_set(s, pos, e);
+}
+
+
+/* deadline changed */
+static void update(struct sched *s, struct sentry *e) {
+    sift_up(s, e->pos);
+    sift_down(s, e->pos);
+}
+
+
+static struct sentry* insert(struct sched *s, struct sentry **pe,
+                             const struct identity *id, int rq, const char *name) {
+    struct sentry *e;
+
+    if (!((e = (struct sentry*) malloc(sizeof(struct sentry)))))
+        error("malloc failed");
+
+    e->next    = NULL;
+    e->id      = id;
+    e->rq      = rq;
+    e->gen     = s->gen;
+    e->backoff = s->init;
+    e->kick    = e->running = e->rerun = 0;
+    e->timer.next  = NULL;
+    e->timer.pprev = NULL;
+    strncpy(e->name, name, NAME_LENGTH);
+    e->name[NAME_LENGTH] = '\0';
+    *pe = e;
+
+    if (s->count == s->heapalloc) {
+        s->heapalloc = s->heapalloc ? s->heapalloc * 2 : INIT_BUCKETS;
+        if (!((s->heap = (struct sentry**) realloc(s->heap, s->heapalloc * sizeof(struct sentry*)))))
+            error("realloc failed");
+    }
+
+    /* deadline is set by the caller, before update() */
+    e->deadline = 0;
+    heap_set(s, s->count++, e);
+
+    if (s->count > s->nbuckets * MAX_LOAD)
+        grow(s);
+
+    return e;
+}
+
+
+static void delete(struct sched *s, struct sentry **pe) {
+    struct sentry *e = *pe;
+    size_t        pos = e->pos;
+
+    *pe = e->next;
+    wheel_del(&e->timer);
+
+    if (pos != --s->count) {
+        heap_set(s, pos, s->heap[s->count]);
+        update(s, s->heap[pos]);
+    }
+
+    free(e);
+}
+
+
+/* jittered delay, to spread retries */
+static double jitter(double sec) {
+    return sec * (1 + rand_shift() / 4);
+}
+
+
+struct sched* sched_create(double init, double max) {
+    struct sched *s;
+
+    if (!((s = (struct sched*) malloc(sizeof(struct sched)))))
+        error("malloc failed");
+
+    alloc_buckets(s, INIT_BUCKETS);
+    s->heap      = NULL;
+    s->wheel     = wheel_create(time(NULL));
+    s->count     = s->heapalloc = 0;
+    s->gen       = 0;
+    s->seed      = (unsigned) random();
+    s->init      = init;
+    s->max       = max;
+
+    return s;
+}
+
+
+void sched_destroy(struct sched *s) {
+    size_t i;
+
+    for (i = 0;  i < s->count;  ++i)
+        free(s->heap[i]);
+
+    wheel_destroy(s->wheel);
+    free(s->heap);
+    free(s->buckets);
+    free(s);
+}
+
+
+void sched_put(struct sched *s, const struct identity *id, int rq, const char *name, double deadline) {
+    struct sentry **pe, *e;
+
+    if ((e = *(pe = find(s, id, rq, name))))
+        e->gen = s->gen;
+    else {
+        e = insert(s, pe, id, rq, name);
+        e->deadline = deadline;
+        sift_up(s, e->pos);
+    }
+}
+
+
+void sched_reset(struct sched *s, const struct identity *id, int rq, const char *name, double now) {
+    struct sentry **pe, *e;
+
+    if (!((e = *(pe = find(s, id, rq, name)))))
+        e = insert(s, pe, id, rq, name);
+
+    e->gen      = s->gen;
+    e->backoff  = s->init;
+    e->deadline = now + jitter(s->init);
+    update(s, e);
+}
+
+
+void sched_kick(struct sched *s, const struct identity *id, int rq, const char *name, double deadline) {
+    struct sentry **pe, *e;
+
+    if (!((e = *(pe = find(s, id, rq, name))))) {
+        e = insert(s, pe, id, rq, name);
+        e->deadline = deadline;
+    }
+    else if (e->deadline > deadline)
+        e->deadline = deadline;
+
+    e->gen  = s->gen;
+    e->kick = 1;
+    update(s, e);
+}
+
+
+int sched_start(struct sched *s, const struct identity *id, int rq, const char *name) {
+    struct sentry *e;
+
+    if (!((e = *find(s, id, rq, name))))
+        return 1;
+
+    if (e->running) {
+        e->rerun = 1;
+        return 0;
+    }
+
+    e->running = 1;
+    return 1;
+}
+
+
+int sched_finish(struct sched *s, const struct identity *id, int rq, const char *name) {
+    struct sentry *e;
+    int           rerun;
+
+    if (!((e = *find(s, id, rq, name))))
+        return 0;
+
+    rerun      = e->rerun;
+    e->running = e->rerun = 0;
+
+    return rerun;
+}
+
+
+void sched_remove(struct sched *s, const struct identity *id, int rq, const char *name) {
+    struct sentry **pe;
+
+    if (*(pe = find(s, id, rq, name)))
+        delete(s, pe);
+}
+
+
+void sched_begin_scan(struct sched *s) {
+    ++s->gen;
+}
+
+
+void sched_end_scan(struct sched *s) {
+    struct sentry **pe;
+    size_t        i;
+
+    for (i = 0;  i < s->nbuckets;  ++i)
+        for (pe = &s->buckets[i];  *pe; ) {
+            if ((*pe)->gen != s->gen)
+                delete(s, pe);
+            else
+                pe = &(*pe)->next;
+        }
+}
+
+
+int sched_due(struct sched *s, double now, const struct identity **id, int *rq, char *name) {
+    struct sentry *e;
+
+    if (!s->count  ||  (e = s->heap[0])->deadline > now)
+        return 0;
+
+    *id = e->id;
+    *rq = e->rq;
+    strcpy(name, e->name);
+
+    /* kicked entries are run as if reset */
+    if (e->kick) {
+        e->kick     = 0;
+        e->backoff  = s->init;
+        e->deadline = now + jitter(e->backoff);
+    }
+    else {
+        e->deadline = now + jitter(e->backoff);
+        if ((e->backoff *= 2) > s->max)
+            e->backoff = s->max;
+    }
+
+    sift_down(s, 0);
+
+    return 1;
+}
+
+
+double sched_next(const struct sched *s) {
+    return s->count ? s->heap[0]->deadline : -1;
+}
+
+
+void sched_set_expiry(struct sched *s, const struct identity *id, int rq, const char *name, time_t expires) {
+    struct sentry *e;
+
+    if ((e = *find(s, id, rq, name))) {
+        e->timer.expires = expires;
+        wheel_add(s->wheel, &e->timer);
+    }
+}
+
+
+int sched_has_expiry(struct sched *s, const struct identity *id, int rq, const char *name) {
+    struct sentry *e;
+
+    return (e = *find(s, id, rq, name))  &&  e->timer.pprev;
+}
+
+
+int sched_expired(struct sched *s, time_t now, const struct identity **id, int *rq, char *name) {
+    struct timer  *t;
+    struct sentry *e;
+
+    if (!((t = wheel_expire(s->wheel, now))))
+        return 0;
+
+    e = (struct sentry*) ((char*) t - offsetof(struct sentry, timer));
+
+    *id = e->id;
+    *rq = e->rq;
+    strcpy(name, e->name);
+
+    return 1;
+}
+
+
+time_t sched_next_expiry(const struct sched *s) {
+    unsigned long next = wheel_next(s->wheel);
+
+    return next ? (time_t) next : -1;
+}
+
+
+unsigned long sched_count(const struct sched *s) {
+    return s->count;
+}
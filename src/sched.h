@@ -0,0 +1,54 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <time.h>
+
+struct identity;
+struct sched;
+
+struct sched* sched_create(double init, double max);
+void sched_destroy(struct sched *s);
+
+/* scan results: add entry (due at deadline) if absent, and mark it as seen */
+void sched_put(struct sched *s, const struct identity *id, int rq, const char *name, double deadline);
+
+/* loop was just run for entry: add if absent, and reset backoff */
+void sched_reset(struct sched *s, const struct identity *id, int rq, const char *name, double now);
+
+/* inotify event: run entry (add if absent) at deadline at the latest, with backoff reset */
+void sched_kick(struct sched *s, const struct identity *id, int rq, const char *name, double deadline);
+
+/*
+  loop is launched for entry: returns 0 if a loop is already running (the
+  entry is then marked for rerun), unknown entries are not tracked
+*/
+int sched_start(struct sched *s, const struct identity *id, int rq, const char *name);
+
+/* loop for entry exited: returns 1 if a rerun was requested meanwhile */
+int sched_finish(struct sched *s, const struct identity *id, int rq, const char *name);
+
+void sched_remove(struct sched *s, const struct identity *id, int rq, const char *name);
+
+/* entries not put since sched_begin_scan() are removed by sched_end_scan() */
+void sched_begin_scan(struct sched *s);
+void sched_end_scan(struct sched *s);
+
+/* pop a due entry (name has MSGID_LENGTH+4+1 chars), rescheduling it with backoff */
+int sched_due(struct sched *s, double now, const struct identity **id, int *rq, char *name);
+
+/* earliest deadline, or -1 if empty */
+double sched_next(const struct sched *s);
+
+/* arm (or re-arm) expiry timer of an existing entry, at wall clock time */
+void sched_set_expiry(struct sched *s, const struct identity *id, int rq, const char *name, time_t expires);
+int sched_has_expiry(struct sched *s, const struct identity *id, int rq, const char *name);
+
+/* pop an entry whose expiry time has passed (its timer is disarmed) */
+int sched_expired(struct sched *s, time_t now, const struct identity **id, int *rq, char *name);
+
+/* time at which an entry may expire next, or -1 if no timers are armed */
+time_t sched_next_expiry(const struct sched *s);
+
+unsigned long sched_count(const struct sched *s);
+
+#endif
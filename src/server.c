@@ -1,10 +1,16 @@
 /*
   + /<username>               common URL prefix: CABLE_CERTS/certs/username
+                              (looked up among all served identities)
   +   /certs/{ca,verify}.pem  serve  CABLE_CERTS/certs/{ca,verify}.pem
   +   /queue/<msgid>          serve  CABLE_QUEUES/queue/<msgid>/message.enc
   +   /queue/<msgid>.key      serve  CABLE_QUEUES/queue/<msgid>/speer.sig
+  +   /queue/<msgid>.env      serve  CABLE_QUEUES/queue/<msgid>/message.env
+                              (content key envelope of encrypt-once messages)
   +   /rqueue/<msgid>.key     serve  CABLE_QUEUES/rqueue/<msgid>/rpeer.sig
+  +   /prekeys                serve  CABLE_QUEUES/prekeys/bundle
+                              (signed single-use peer keys, see cable/prekeys)
   +   /request/...            invoke service(...), and return answer
+  (<msgid> is in a <shard>/ subdirectory of (r)queue if sharded, see identity.c)
  */
 
 #include <unistd.h>
@@ -22,6 +28,7 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <netdb.h>
+#include <limits.h>
 #include <sys/stat.h>
 
 #ifndef EAI_ADDRFAMILY
@@ -31,6 +38,8 @@
 #include "server.h"
 #include "daemon.h"
 #include "service.h"
+#include "identity.h"
+#include "index.h"
 #include "util.h"
 
 
@@ -44,19 +53,22 @@
 #endif
 
 /* path and url suffixes */
-#define USERNAME_SFX "username"
 #define CA_SFX       "ca.pem"
 #define VERIFY_SFX   "verify.pem"
 #define MESSAGE_SFX  "message.enc"
 #define SPEER_SFX    "speer.sig"
 #define RPEER_SFX    "rpeer.sig"
+#define ENVELOPE_SFX "message.env"
+#define BUNDLE_SFX   "bundle"
 #define KEY_SFX      ".key"
+#define ENV_SFX      ".env"
 
 /* url prefixes */
 #define CERTS_PFX    "/certs/"
 #define QUEUE_PFX    "/queue/"
 #define RQUEUE_PFX   "/rqueue/"
 #define REQUEST_PFX  "/request/"
+#define PREKEYS_URL  "/prekeys"
 
 /* service responses */
 #define SVC_RESP_OK  VERSION "\n"
@@ -66,8 +78,23 @@
 /* read-only values after server startup */
 static struct MHD_Daemon   *mhd_daemon;
 static struct MHD_Response *mhd_empty, *mhd_svc_ok, *mhd_svc_err;
-static const  char         *crt_path, *cq_path, *crq_path;
-static        char         username[USERNAME_LENGTH+2];
+
+
+/* advance past /<username>, returning the corresponding identity */
+static const struct identity* advance_username(const char **url) {
+    const struct identity *id = NULL;
+    const char            *end;
+
+    if (**url == '/') {
+        if (!((end = strchr(*url + 1, '/'))))
+            end = *url + strlen(*url);
+
+        if ((id = find_identity(*url + 1, end - (*url + 1))))
+            *url = end;
+    }
+
+    return id;
+}
 
 
 static int advance_pfx(const char **url, const char *pfx) {
@@ -83,16 +110,36 @@ static int advance_pfx(const char **url, const char *pfx) {
 }
 
 
+/* <msgid> + sfx (validated in place) */
+static int is_msgid(const char *s, const char *sfx) {
+    return strlen(s) == MSGID_LENGTH + strlen(sfx)
+        && vfyhexn(MSGID_LENGTH, s)  &&  !strcmp(s + MSGID_LENGTH, sfx);
+}
+
+
+static char* copy_msgid(char *msgid, const char *s) {
+    memcpy(msgid, s, MSGID_LENGTH);
+    msgid[MSGID_LENGTH] = '\0';
+
+    return msgid;
+}
+
+
 /*
   dir + [ / subdir ] + sfx
+  subdir is looked up in idx (if given), to answer unknown msgids immediately
+  (dir is NULL if the path is too long)
 */
-static int queue_fd(struct MHD_Connection *connection,
+static int queue_fd(struct MHD_Connection *connection, struct msgid_index *idx,
                     const char *dir, const char *subdir, const char *sfx) {
-    char   path[strlen(dir) + (subdir ? strlen(subdir) + 1 : 0) + strlen(sfx) + 1];
+    char   path[(dir ? strlen(dir) : 0) + (subdir ? strlen(subdir) + 1 : 0) + strlen(sfx) + 1];
     struct MHD_Response *resp;
     struct stat         st;
     int    ret, fd;
 
+    if (!dir)
+        return MHD_queue_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, mhd_empty);
+
     /* construct full path */
     strcpy(path, dir);
     if (subdir) {
@@ -101,7 +148,10 @@ static int queue_fd(struct MHD_Connection *connection,
     }
     strcat(path, sfx);
 
-    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) != -1) {
+    if (idx  &&  index_lookup(idx, subdir) == IDX_ABSENT)
+        ret = MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, mhd_empty);
+
+    else if ((fd = open(path, O_RDONLY | O_CLOEXEC)) != -1) {
         if (!fstat(fd, &st)  &&  ((resp = MHD_create_response_from_fd(st.st_size, fd)))) {
             ret = MHD_queue_response(connection, MHD_HTTP_OK, resp);
             MHD_destroy_response(resp);
@@ -122,8 +172,9 @@ static int handle_connection(void *cls, struct MHD_Connection *connection,
                              const char *url, const char *method, const char *version,
                              const char *upload_data, size_t *upload_data_size,
                              void **con_cls) {
+    const  struct identity *id;
     enum   SVC_Status svc_status;
-    char   msgid[MSGID_LENGTH + sizeof(KEY_SFX)];
+    char   msgid[MSGID_LENGTH+1], dir[PATH_MAX];
     int    ret;
 
     /* support GET only, close connection otherwise */
@@ -138,42 +189,46 @@ static int handle_connection(void *cls, struct MHD_Connection *connection,
     }
 
     /* check /<username> prefix, close connection if no match */
-    else if (!(*(url++) == '/'  &&  advance_pfx(&url, username)))
+    else if (!((id = advance_username(&url))))
         ret  = MHD_queue_response(connection, MHD_HTTP_FORBIDDEN, mhd_empty);
 
     /* handle username-authenticated queries */
     else {
         /* serve /certs/ files */
         if (     !strcmp(url, CERTS_PFX CA_SFX))
-            ret = queue_fd(connection, crt_path, NULL, "/" CA_SFX);
+            ret = queue_fd(connection, NULL, id->crtpath, NULL, "/" CA_SFX);
         else if (!strcmp(url, CERTS_PFX VERIFY_SFX))
-            ret = queue_fd(connection, crt_path, NULL, "/" VERIFY_SFX);
+            ret = queue_fd(connection, NULL, id->crtpath, NULL, "/" VERIFY_SFX);
 
-        /* serve /queue/<msgid>{,.key} and /rqueue/<msgid>.key */
-        else if (advance_pfx(&url, QUEUE_PFX)) {
-            strncpy(msgid, url, sizeof(msgid));
+        /* serve /prekeys bundle (absent unless prekeys are published) */
+        else if (!strcmp(url, PREKEYS_URL))
+            ret = queue_fd(connection, NULL, id->pkpath, NULL, "/" BUNDLE_SFX);
 
-            if (!msgid[MSGID_LENGTH]  &&  vfyhex(MSGID_LENGTH, msgid))
-                ret = queue_fd(connection, cq_path, msgid, "/" MESSAGE_SFX);
-            else if (!strncmp(msgid + MSGID_LENGTH, KEY_SFX, sizeof(KEY_SFX))
-                     &&  (msgid[MSGID_LENGTH] = '\0', vfyhex(MSGID_LENGTH, msgid)))
-                ret = queue_fd(connection, cq_path, msgid, "/" SPEER_SFX);
+        /* serve /queue/<msgid>{,.key,.env} and /rqueue/<msgid>.key */
+        else if (advance_pfx(&url, QUEUE_PFX)) {
+            if (is_msgid(url, ""))
+                ret = queue_fd(connection, id->qidx, queue_dir(id, 0, url, dir, sizeof(dir)),
+                               copy_msgid(msgid, url), "/" MESSAGE_SFX);
+            else if (is_msgid(url, KEY_SFX))
+                ret = queue_fd(connection, id->qidx, queue_dir(id, 0, url, dir, sizeof(dir)),
+                               copy_msgid(msgid, url), "/" SPEER_SFX);
+            else if (is_msgid(url, ENV_SFX))
+                ret = queue_fd(connection, id->qidx, queue_dir(id, 0, url, dir, sizeof(dir)),
+                               copy_msgid(msgid, url), "/" ENVELOPE_SFX);
             else
                 ret = MHD_queue_response(connection, MHD_HTTP_FORBIDDEN, mhd_empty);
         }
         else if (advance_pfx(&url, RQUEUE_PFX)) {
-            strncpy(msgid, url, sizeof(msgid));
-
-            if (!strncmp(msgid + MSGID_LENGTH, KEY_SFX, sizeof(KEY_SFX))
-                &&  (msgid[MSGID_LENGTH] = '\0', vfyhex(MSGID_LENGTH, msgid)))
-                ret = queue_fd(connection, crq_path, msgid, "/" RPEER_SFX);
+            if (is_msgid(url, KEY_SFX))
+                ret = queue_fd(connection, id->rqidx, queue_dir(id, 1, url, dir, sizeof(dir)),
+                               copy_msgid(msgid, url), "/" RPEER_SFX);
             else
                 ret = MHD_queue_response(connection, MHD_HTTP_FORBIDDEN, mhd_empty);
         }
 
         /* handle /request/ interface */
         else if (advance_pfx(&url, REQUEST_PFX)) {
-            svc_status = handle_request(url, cq_path, crq_path);
+            svc_status = handle_request(url, id);
 
             switch (svc_status) {
             case SVC_OK:
@@ -182,6 +237,9 @@ static int handle_connection(void *cls, struct MHD_Connection *connection,
             case SVC_ERR:
                 ret = MHD_queue_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, mhd_svc_err);
                 break;
+            case SVC_FULL:
+                ret = MHD_queue_response(connection, MHD_HTTP_SERVICE_UNAVAILABLE, mhd_svc_err);
+                break;
             case SVC_BADFMT:
                 ret = MHD_queue_response(connection, MHD_HTTP_BAD_REQUEST, mhd_svc_err);
                 break;
@@ -197,32 +255,6 @@ static int handle_connection(void *cls, struct MHD_Connection *connection,
 }
 
 
-static int read_username(const char *certs) {
-    int  res = 0, len;
-    FILE *file;
-    char path[strlen(certs) + sizeof("/" USERNAME_SFX)];
-
-    strcpy(path, certs);
-    strcat(path, "/" USERNAME_SFX);
-
-    if ((file = fopen(path, "re"))) {
-        if(fgets(username, sizeof(username), file)  &&  fgetc(file) == EOF) {
-            len = strlen(username);
-            if (username[len-1] == '\n')
-                username[len-1] = '\0';
-
-            if (vfybase32(USERNAME_LENGTH, username))
-                res = 1;
-        }
-
-        if (fclose(file))
-            res = 0;
-    }
-
-    return res;
-}
-
-
 static int ignore_sigpipe() {
     struct sigaction sa;
     memset(&sa, 0, sizeof(sa));
@@ -237,8 +269,7 @@ static int ignore_sigpipe() {
 }
 
 
-int init_server(const char *certs, const char *qpath, const char *rqpath,
-                const char *host,  const char *port) {
+int init_server(const char *host, const char *port) {
 #ifdef TESTING
     const enum MHD_FLAG extra_flags = MHD_USE_DEBUG;
 #else
@@ -248,23 +279,11 @@ int init_server(const char *certs, const char *qpath, const char *rqpath,
     int                addr_res;
 
 
-    /* save paths */
-    crt_path = certs;
-    cq_path  = qpath;
-    crq_path = rqpath;
-
-
     /* ignore SIGPIPE, as recommended by libmicrohttpd */
     if (!ignore_sigpipe())
         warning("failed to ignore PIPE signal");
 
 
-    if (!read_username(certs)) {
-        flog(LOG_ERR, "could not read %s/username", certs);
-        return 0;
-    }
-
-
     /* create immutable responses */
     if (   !(mhd_empty   = MHD_create_response_from_buffer(0,                      NULL,         MHD_RESPMEM_PERSISTENT))
         || !(mhd_svc_ok  = MHD_create_response_from_buffer(sizeof(SVC_RESP_OK)-1,  SVC_RESP_OK,  MHD_RESPMEM_PERSISTENT))
@@ -1,7 +1,8 @@
 #ifndef SERVER_H
 #define SERVER_H
 
-int init_server(const char *certs, const char *qpath, const char *rqpath, const char *host,  const char *port);
+/* served identities must be loaded before */
+int init_server(const char *host, const char *port);
 int shutdown_server();
 
 #endif
@@ -3,45 +3,204 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <pthread.h>
 
 #include "service.h"
 #include "daemon.h"
+#include "commit.h"
+#include "identity.h"
+#include "index.h"
+#include "wakeup.h"
 #include "util.h"
 
+#ifdef USE_IO_URING
+#include "uring.h"
+#endif
+
 
 #define MAX_REQUEST_LENGTH  255
 
+/* cache of recently successful idempotent (msg, ses, pre, snd) requests, per identity */
+#define RECENT_SIZE          64
+#define RECENT_TMOUT         30
+
 #define TOR_HOSTNAME_LENGTH  16
 #define I2P_HOSTNAME_LENGTH  52
 #define MAC_LENGTH          128
 
+#define TOR_SFX             ".onion"
+#define I2P_SFX             ".b32.i2p"
+
+/* max. fields in a request, and max. field length */
+#define MAX_FIELDS            5
+#define MAX_FIELD_LENGTH    MAC_LENGTH
+
 #define DCREAT_MODE         (S_IRWXU | S_IRWXG | S_IRWXO)
 #define FCREAT_MODE         (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)
 
 
-/* lowercase hostnames: recognizes .onion and .b32.i2p addresses */
-static int vfyhost(char *s) {
-    int  result = 0;
-    char *dot   = strchr(s, '.');
+/* optional protocol features, answered by ver/<feature> ("session", "prekeys" if enabled) */
+static const char *features[] = { "shared", NULL };
+
+/* ephemeral key sessions: max. messages and age in seconds (0 if disabled) */
+static unsigned long long session_msgs, session_ttl;
+
+/* published prekeys can be claimed (CABLE_QUEUES/prekeys, see cable/prekeys) */
+static int prekeys;
+
+
+/*
+  direct-mapped recent responses cache, answers duplicate retries without disk access
+  (entries are per served identity)
+*/
+static struct {
+    const struct identity *id;
+    char                  request[MAX_REQUEST_LENGTH+1];
+    double                time;
+} recent[RECENT_SIZE];
+
+static pthread_mutex_t recent_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    if (dot) {
-        *dot = '\0';
 
-        /* Tor .onion hostnames */
-        if (!strcmp("onion", dot+1))
-            result = vfybase32(TOR_HOSTNAME_LENGTH, s);
+/* request field, pointing into the original request (not NUL-terminated) */
+struct field {
+    const char *s;
+    int        len;
+};
 
-        /* I2P .b32.i2p hostnames */
-        else if (!strcmp("b32.i2p", dot+1))
-            result = vfybase32(I2P_HOSTNAME_LENGTH, s);
 
-        *dot = '.';
+/*
+  split request into '/'-separated fields in a single pass, without copying
+  returns number of fields, or 0 if there are empty or too many fields,
+  or if the request is too long
+*/
+static int split_request(const char *request, struct field fields[MAX_FIELDS]) {
+    const char *p = request;
+    int        n;
+
+    for (n = 0;  n < MAX_FIELDS;  ++p) {
+        for (fields[n].s = p;  *p  &&  *p != '/';  ++p)
+            ;
+
+        if (!((fields[n].len = p - fields[n].s))  ||  p - request > MAX_REQUEST_LENGTH)
+            break;
+
+        ++n;
+        if (!*p)
+            return n;
     }
 
-    return result;
+    return 0;
+}
+
+
+static int is_cmd(const struct field *f, const char *cmd) {
+    return f->len == strlen(cmd)  &&  !strncmp(f->s, cmd, f->len);
+}
+
+
+static int is_feature(const struct field *f) {
+    const char **feature;
+
+    for (feature = features;  *feature;  ++feature)
+        if (is_cmd(f, *feature))
+            return 1;
+
+    return (session_msgs  &&  is_cmd(f, "session"))
+        || (prekeys       &&  is_cmd(f, "prekeys"));
+}
+
+
+static int vfyhexf(int sz, const struct field *f) {
+    return f->len == sz  &&  vfyhexn(sz, f->s);
+}
+
+
+static int vfybase32f(int sz, const struct field *f) {
+    return f->len == sz  &&  vfybase32n(sz, f->s);
+}
+
+
+/* lowercase hostnames: recognizes .onion and .b32.i2p addresses */
+static int vfyhost(const struct field *f) {
+    /* Tor .onion hostnames */
+    if (f->len == TOR_HOSTNAME_LENGTH + sizeof(TOR_SFX)-1)
+        return !strncmp(TOR_SFX, f->s + TOR_HOSTNAME_LENGTH, sizeof(TOR_SFX)-1)
+            && vfybase32n(TOR_HOSTNAME_LENGTH, f->s);
+
+    /* I2P .b32.i2p hostnames */
+    else if (f->len == I2P_HOSTNAME_LENGTH + sizeof(I2P_SFX)-1)
+        return !strncmp(I2P_SFX, f->s + I2P_HOSTNAME_LENGTH, sizeof(I2P_SFX)-1)
+            && vfybase32n(I2P_HOSTNAME_LENGTH, f->s);
+
+    return 0;
+}
+
+
+/* NUL-terminated copy of a validated field (dst has MAX_FIELD_LENGTH+1 chars) */
+static char* copy_field(char *dst, const struct field *f) {
+    memcpy(dst, f->s, f->len);
+    dst[f->len] = '\0';
+
+    return dst;
+}
+
+
+/* only msg, ses, pre and snd requests can be answered again without side effects */
+static int is_idempotent(const char *request) {
+    return !strncmp(request, "msg/", 4)  ||  !strncmp(request, "ses/", 4)
+        || !strncmp(request, "pre/", 4)  ||  !strncmp(request, "snd/", 4);
+}
+
+
+static size_t recent_slot(const char *request, const struct identity *id) {
+    unsigned h = 2166136261u;
+    size_t   i;
+
+    for (i = 0;  i < sizeof(id);  ++i)
+        h = (h ^ ((const unsigned char*) &id)[i]) * 16777619u;
+
+    for (; *request; ++request)
+        h = (h ^ (unsigned char) *request) * 16777619u;
+
+    return h % RECENT_SIZE;
+}
+
+
+static int recent_hit(const char *request, const struct identity *id) {
+    size_t slot = recent_slot(request, id);
+    int    res;
+
+    pthread_mutex_lock(&recent_lock);
+    res =   recent[slot].id == id
+        &&  !strcmp(recent[slot].request, request)
+        &&  getmontime() - recent[slot].time < RECENT_TMOUT;
+    pthread_mutex_unlock(&recent_lock);
+
+    return res;
+}
+
+
+static void recent_put(const char *request, const struct identity *id) {
+    size_t slot = recent_slot(request, id);
+
+    pthread_mutex_lock(&recent_lock);
+    recent[slot].id = id;
+    strcpy(recent[slot].request, request);
+    recent[slot].time = getmontime();
+    pthread_mutex_unlock(&recent_lock);
+}
+
+
+/* whether msgid may exist (definite misses avoid filesystem access) */
+static int maybe_exists(struct msgid_index *idx, const char *msgid) {
+    return index_lookup(idx, msgid) != IDX_ABSENT;
 }
 
 
@@ -110,8 +269,135 @@ static int try_lock(int fd) {
 }
 
 
-static int handle_msg(const char *msgid, const char *hostname,
-                       const char *username, int cqdir) {
+/*
+  open (r)queue directory holding msgid (its shard if sharded)
+  missing shard is created if requested (e.g., not yet created by the daemon)
+*/
+static int open_queue(const struct identity *id, int rq, const char *msgid, int create) {
+    char path[PATH_MAX];
+    int  fd = -1;
+
+    if (queue_dir(id, rq, msgid, path, sizeof(path))) {
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1  &&  errno == ENOENT  &&  create  &&  id->sharded
+            &&  (!mkdir(path, DCREAT_MODE)  ||  errno == EEXIST))
+            fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+
+    return fd;
+}
+
+
+/*
+  hand (r)queue/<msgid> to the daemon's main loop, or touch msgdir if the
+  wakeup queue is full (touch triggers inotify IN_ATTRIB, as for external writers)
+*/
+static int wake_loop(int msgdir, const struct identity *id, int rq, const char *msgid) {
+    return wakeup_push(id, rq, msgid)
+        /* euid owns msgdir, so O_RDWR is not needed (NOTE: unless overlayfs) */
+        || !futimens(msgdir, NULL);
+}
+
+
+/*
+  write hostname, username, [session,] peer.req in temp base, and rename it to msgid
+  (single io_uring submission if available)
+*/
+static int create_msg(int cqdir, int msgdir, const char *msgidnew, const char *msgid,
+                      const char *hostname, const char *username, const char *session) {
+#ifdef USE_IO_URING
+    struct uring_chain *ch;
+
+    if ((ch = uring_begin())) {
+        uring_write_line(ch, msgdir, "hostname", hostname);
+        uring_write_line(ch, msgdir, "username", username);
+        if (session)
+            uring_write_line(ch, msgdir, "session", session);
+        uring_write_line(ch, msgdir, "peer.req", NULL);
+        uring_renameat(ch, cqdir, msgidnew, cqdir, msgid);
+
+        return uring_submit(ch);
+    }
+#endif
+
+    return
+        /* write hostname */
+           write_line(msgdir, "hostname", hostname)
+        /* write username */
+        && write_line(msgdir, "username", username)
+        /* write session (first message of a key session) */
+        && (!session  ||  write_line(msgdir, "session", session))
+        /* create peer.req */
+        && create_file(msgdir, "peer.req")
+        /* rename .../cables/rqueue/<msgid>.new -> <msgid> */
+        && !renameat(cqdir, msgidnew, cqdir, msgid);
+}
+
+
+/*
+  write hostname, username, session, link the session's derive.pem and create
+  peer.ok in temp base (no peer key is generated), and rename it to msgid
+*/
+static int create_ses(int cqdir, int msgdir, const char *msgidnew, const char *msgid,
+                      const char *hostname, const char *username, const char *origin, int sesdir) {
+    return
+        /* write hostname, username and session */
+           write_line(msgdir, "hostname", hostname)
+        && write_line(msgdir, "username", username)
+        && write_line(msgdir, "session",  origin)
+        /* link /cables/rsession/<origin>/derive.pem */
+        && !linkat(sesdir, "derive.pem", msgdir, "derive.pem", 0)
+        /* create peer.ok */
+        && create_file(msgdir, "peer.ok")
+        /* rename .../cables/rqueue/<msgid>.new -> <msgid> */
+        && !renameat(cqdir, msgidnew, cqdir, msgid);
+}
+
+
+/*
+  write hostname, username, move the prekey's derive.pem (single use: a second
+  claim fails) and create peer.ok in temp base, and rename it to msgid
+*/
+static int create_pre(int cqdir, int msgdir, const char *msgidnew, const char *msgid,
+                      const char *hostname, const char *username, int keydir) {
+    return
+        /* write hostname and username */
+           write_line(msgdir, "hostname", hostname)
+        && write_line(msgdir, "username", username)
+        /* move /cables/prekeys/<keyid>/derive.pem (ok if already moved here) */
+        && (check_file(msgdir, "derive.pem")
+            ||  (errno == ENOENT  &&  !renameat(keydir, "derive.pem", msgdir, "derive.pem")))
+        /* create peer.ok */
+        && create_file(msgdir, "peer.ok")
+        /* rename .../cables/rqueue/<msgid>.new -> <msgid> */
+        && !renameat(cqdir, msgidnew, cqdir, msgid);
+}
+
+
+/*
+  write send.mac (unless mac is NULL), and create recv.req (atomic)
+  errno == EEXIST if recv.req exists
+  (single io_uring submission if available)
+*/
+static int create_recv_req(int msgdir, const char *mac) {
+#ifdef USE_IO_URING
+    struct uring_chain *ch;
+
+    if ((ch = uring_begin())) {
+        if (mac)
+            uring_write_line(ch, msgdir, "send.mac", mac);
+        uring_linkat(ch, msgdir, "peer.ok", msgdir, "recv.req");
+
+        return uring_submit(ch);
+    }
+#endif
+
+    return (!mac  ||  write_line(msgdir, "send.mac", mac))
+        && !linkat(msgdir, "peer.ok", msgdir, "recv.req", 0);
+}
+
+
+static int handle_msg(const char *msgid, const char *hostname, const char *username,
+                      int session, int cqdir, struct msgid_index *idx) {
     int  res = 0, msgdir;
     char msgidnew[MSGID_LENGTH+4+1];
 
@@ -130,14 +416,13 @@ static int handle_msg(const char *msgid, const char *hostname,
                 res =
                     /* lock temp base */
                        try_lock(msgdir)
-                    /* write hostname */
-                    && write_line(msgdir, "hostname", hostname)
-                    /* write username */
-                    && write_line(msgdir, "username", username)
-                    /* create peer.req */
-                    && create_file(msgdir, "peer.req")
-                    /* rename .../cables/rqueue/<msgid>.new -> <msgid> */
-                    && !renameat(cqdir, msgidnew, cqdir, msgid);
+                    /* write files and rename */
+                    && create_msg(cqdir, msgdir, msgidnew, msgid, hostname, username,
+                                  session ? msgid : NULL);
+
+                /* peer fetches <msgid>.key next, don't wait for inotify */
+                if (res)
+                    index_add(idx, msgid);
 
                 /* close base (and unlock if locked) */
                 if (close(msgdir))
@@ -150,8 +435,162 @@ static int handle_msg(const char *msgid, const char *hostname,
 }
 
 
-static int handle_snd(const char *msgid, const char *mac, int cqdir) {
-    int res = 0, msgdir;
+/* files of a saved key session (see save_session in cable/crypto) */
+static const char *session_files[] = { "derive.pem", "hostname", "username", "origin", "count", "count.tmp", NULL };
+
+
+/* remove expired or used up key session, with its private key */
+static void remove_session(int sesdir, const char *path) {
+    const char **file;
+
+    for (file = session_files;  *file;  ++file)
+        unlinkat(sesdir, *file, 0);
+
+    rmdir(path);
+}
+
+
+/*
+  check that key session origin (saved by [crypto] after <peer>) belongs to
+  hostname/username, and is within count and age limits, returning its count
+  (expired or used up sessions are removed)
+  session stays locked until closed; a concurrent claim fails (new session)
+*/
+static int check_session(int sesdir, const char *path, const char *hostname, const char *username,
+                         unsigned long long *n) {
+    char        line[MAX_FIELD_LENGTH+2], count[32];
+    struct stat st;
+
+    if (/* lock session (non-blocking) */
+           !try_lock(sesdir)
+        /* compare peer */
+        || !read_line(sesdir, "hostname", line, sizeof(line))  ||  strcmp(line, hostname)
+        || !read_line(sesdir, "username", line, sizeof(line))  ||  strcmp(line, username)
+        || !read_line(sesdir, "count",    count, sizeof(count)))
+        return 0;
+
+    /* check age of derive.pem, and count */
+    if (fstatat(sesdir, "derive.pem", &st, 0)
+        ||  time(NULL) - st.st_mtime >= (time_t) session_ttl
+        ||  (*n = strtoull(count, NULL, 10)) >= session_msgs) {
+        remove_session(sesdir, path);
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/* count a claimed message (atomic replacement of count) */
+static int count_session(int sesdir, unsigned long long n) {
+    char count[32];
+
+    snprintf(count, sizeof(count), "%llu", n + 1);
+    return write_line(sesdir, "count.tmp", count)
+        && !renameat(sesdir, "count.tmp", sesdir, "count");
+}
+
+
+static int handle_ses(const char *msgid, const char *origin, const char *hostname, const char *username,
+                      int cqdir, const struct identity *id) {
+    int  res = 0, msgdir, sesdir;
+    char msgidnew[MSGID_LENGTH+4+1], path[PATH_MAX];
+    unsigned long long n;
+
+    /* checkno /cables/rqueue/<msgid> (ok and skip if exists) */
+    if (check_file(cqdir, msgid))
+        res = 1;
+
+    /* open /cables/rsession/<origin> */
+    else if (errno == ENOENT
+             &&  (size_t) snprintf(path, sizeof(path), "%s/%s", id->rspath, origin) < sizeof(path)
+             &&  (sesdir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1) {
+
+        if (check_session(sesdir, path, hostname, username, &n)) {
+            /* temp base: .../cables/rqueue/<msgid>.new */
+            strncpy(msgidnew, msgid, MSGID_LENGTH);
+            strcpy(msgidnew + MSGID_LENGTH, ".new");
+
+            /* create directory (ok if exists) */
+            if (!mkdirat(cqdir, msgidnew, DCREAT_MODE)  ||  errno == EEXIST) {
+                if ((msgdir = openat(cqdir, msgidnew, O_RDONLY | O_CLOEXEC)) != -1) {
+                    res =
+                        /* lock temp base */
+                           try_lock(msgdir)
+                        /* write files, link key and rename */
+                        && create_ses(cqdir, msgdir, msgidnew, msgid, hostname, username, origin, sesdir);
+
+                    if (res)
+                        index_add(id->rqidx, msgid);
+
+                    /* close base (and unlock if locked) */
+                    if (close(msgdir))
+                        res = 0;
+                }
+            }
+
+            /* the message counts once its directory exists */
+            if (res  &&  !count_session(sesdir, n))
+                res = 0;
+        }
+
+        /* close session (and unlock) */
+        close(sesdir);
+    }
+
+    return res;
+}
+
+
+static int handle_pre(const char *msgid, const char *keyid, const char *hostname, const char *username,
+                      int cqdir, const struct identity *id) {
+    int  res = 0, msgdir, keydir;
+    char msgidnew[MSGID_LENGTH+4+1], path[PATH_MAX];
+
+    /* checkno /cables/rqueue/<msgid> (ok and skip if exists) */
+    if (check_file(cqdir, msgid))
+        res = 1;
+
+    /* open /cables/prekeys/<keyid> */
+    else if (errno == ENOENT
+             &&  (size_t) snprintf(path, sizeof(path), "%s/%s", id->pkpath, keyid) < sizeof(path)
+             &&  (keydir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1) {
+
+        /* temp base: .../cables/rqueue/<msgid>.new */
+        strncpy(msgidnew, msgid, MSGID_LENGTH);
+        strcpy(msgidnew + MSGID_LENGTH, ".new");
+
+        /* create directory (ok if exists) */
+        if (!mkdirat(cqdir, msgidnew, DCREAT_MODE)  ||  errno == EEXIST) {
+            if ((msgdir = openat(cqdir, msgidnew, O_RDONLY | O_CLOEXEC)) != -1) {
+                res =
+                    /* lock temp base */
+                       try_lock(msgdir)
+                    /* write files, move key and rename */
+                    && create_pre(cqdir, msgdir, msgidnew, msgid, hostname, username, keydir);
+
+                if (res)
+                    index_add(id->rqidx, msgid);
+
+                /* close base (and unlock if locked) */
+                if (close(msgdir))
+                    res = 0;
+            }
+        }
+
+        /* consumed prekey leaves the pool (the bundle is rebuilt by [prekeys]) */
+        if (res  &&  !unlinkat(keydir, "rpeer.sig", 0))
+            rmdir(path);
+
+        close(keydir);
+    }
+
+    return res;
+}
+
+
+static int handle_snd(const char *msgid, const char *mac, int cqdir, const struct identity *id) {
+    int res = 0, msgdir, wmac;
 
     /* base: .../cables/rqueue/<msgid> */
     if ((msgdir = openat(cqdir, msgid, O_RDONLY | O_CLOEXEC)) != -1) {
@@ -159,20 +598,18 @@ static int handle_snd(const char *msgid, const char *mac, int cqdir) {
                try_lock(msgdir)
             /* check peer.ok */
             && check_file(msgdir, "peer.ok")
-            /* write send.mac (skip if exists) */
-            && (check_file(msgdir, "send.mac")
-                || (errno == ENOENT  &&  write_line(msgdir, "send.mac", mac)))) {
+            /* check send.mac (write below if doesn't exist) */
+            && (!((wmac = !check_file(msgdir, "send.mac")))  ||  errno == ENOENT)) {
 
-            /* create recv.req (atomic, ok if exists) */
-            if (linkat(msgdir, "peer.ok", msgdir, "recv.req", 0))
+            /* write send.mac, create recv.req (atomic, ok if exists) */
+            if (!create_recv_req(msgdir, wmac ? mac : NULL))
                 res = (errno == EEXIST);
             else
                 res =
-                    /* unlock base (touch triggers loop's lock) */
+                    /* unlock base (loop takes the lock) */
                        !flock(msgdir, LOCK_UN)
-                    /* touch /cables/rqueue/<msgid>/ (if recv.req didn't exist) */
-                    /* euid owns msgdir, so O_RDWR is not needed (NOTE: unless overlayfs) */
-                    && !futimens(msgdir, NULL);
+                    /* run loop for rqueue/<msgid> (if recv.req didn't exist) */
+                    && wake_loop(msgdir, id, 1, msgid);
         }
 
         /* close base (and unlock if locked) */
@@ -184,7 +621,7 @@ static int handle_snd(const char *msgid, const char *mac, int cqdir) {
 }
 
 
-static int handle_rcp(const char *msgid, const char *mac, int cqdir) {
+static int handle_rcp(const char *msgid, const char *mac, int cqdir, const struct identity *id) {
     int  res = 0, msgdir;
     char exmac[MAC_LENGTH+2];
 
@@ -204,11 +641,10 @@ static int handle_rcp(const char *msgid, const char *mac, int cqdir) {
                 res = (errno == EEXIST);
             else
                 res =
-                    /* unlock base (touch triggers loop's lock) */
+                    /* unlock base (loop takes the lock) */
                        !flock(msgdir, LOCK_UN)
-                    /* touch /cables/queue/<msgid>/ (if ack.req didn't exist) */
-                    /* euid owns msgdir, so O_RDWR is not needed (NOTE: unless overlayfs) */
-                    && !futimens(msgdir, NULL);
+                    /* run loop for queue/<msgid> (if ack.req didn't exist) */
+                    && wake_loop(msgdir, id, 0, msgid);
         }
 
         /* close base (and unlock if locked) */
@@ -250,115 +686,186 @@ static int handle_ack(const char *msgid, const char *mac, int cqdir) {
 }
 
 
+void service_set_session(unsigned long long maxmsgs, unsigned long long ttl) {
+    session_msgs = ttl ? maxmsgs : 0;
+    session_ttl  = ttl;
+}
+
+
+void service_set_prekeys(int enable) {
+    prekeys = enable;
+}
+
+
 /*
   returns memory-persistent response (including trailing newline)
   thread-safe
   does not leak memory / file descriptors
  */
-enum SVC_Status handle_request(const char *request, const char *queues, const char *rqueues) {
+enum SVC_Status handle_request(const char *request, const struct identity *id) {
     enum   SVC_Status status = SVC_BADFMT;
-    char   buf[MAX_REQUEST_LENGTH+1], *saveptr, *cmd, *msgid, *arg1, *arg2;
-    int    cqdir;
-    size_t reqlen;
-
-
-    /* Copy request to modifiable buffer, check for length and bad delimiters */
-    reqlen = strlen(request);
-    if (reqlen < sizeof(buf)  &&  reqlen > 0
-        &&  !strstr(request, "//")
-        &&  request[0] != '/'  &&  request[reqlen-1] != '/') {
-        strcpy(buf, request);
-
-        /* Tokenize the request */
-        cmd   = strtok_r(buf,  "/", &saveptr);
-        msgid = strtok_r(NULL, "/", &saveptr);
-        arg1  = strtok_r(NULL, "/", &saveptr);
-        arg2  = strtok_r(NULL, "/", &saveptr);
-
-        if (cmd  &&  !strtok_r(NULL, "/", &saveptr)) {
-            /*
-               ver
-               msg/<msgid>/<hostname>/<username>
-               snd/<msgid>/<mac>
-               rcp/<msgid>/<mac>
-               ack/<msgid>/<mac>
-
-               msgid:    MSGID_LENGTH        lowercase xdigits
-               mac:      MAC_LENGTH          lowercase xdigits
-               hostname: TOR_HOSTNAME_LENGTH lowercase base-32 chars + ".onion"
-                         I2P_HOSTNAME_LENGTH lowercase base-32 chars + ".b32.i2p"
-               username: USERNAME_LENGTH     lowercase base-32 chars
-            */
-            if (!strcmp("ver", cmd)) {
-                if (!msgid)
-                    status = SVC_OK;
+    struct field f[MAX_FIELDS];
+    char   msgid[MAX_FIELD_LENGTH+1], arg1[MAX_FIELD_LENGTH+1], arg2[MAX_FIELD_LENGTH+1],
+           arg3[MAX_FIELD_LENGTH+1];
+    int    nf, cqdir;
+
+
+    /* Answer duplicate retries of recently successful requests */
+    if (is_idempotent(request)  &&  recent_hit(request, id))
+        status = SVC_OK;
+
+    /* Split the request, checking for length and bad delimiters */
+    else if ((nf = split_request(request, f))) {
+        /*
+           ver
+           ver/<feature>   (error if unsupported)
+           msg/<msgid>/<hostname>/<username>
+           msg/<msgid>/<hostname>/<username>/ses   (first message of a key session)
+           ses/<msgid>/<origin>/<hostname>/<username>
+           pre/<msgid>/<keyid>/<hostname>/<username>
+           snd/<msgid>/<mac>
+           rcp/<msgid>/<mac>
+           ack/<msgid>/<mac>
+
+           msgid:    MSGID_LENGTH        lowercase xdigits (also origin, keyid)
+           mac:      MAC_LENGTH          lowercase xdigits
+           hostname: TOR_HOSTNAME_LENGTH lowercase base-32 chars + ".onion"
+                     I2P_HOSTNAME_LENGTH lowercase base-32 chars + ".b32.i2p"
+           username: USERNAME_LENGTH     lowercase base-32 chars
+        */
+        if (is_cmd(&f[0], "ver")) {
+            if (nf == 1  ||  (nf == 2  &&  is_feature(&f[1])))
+                status = SVC_OK;
+        }
+        else if (is_cmd(&f[0], "msg")) {
+            if ((nf == 4  ||  (nf == 5  &&  session_msgs  &&  is_cmd(&f[4], "ses")))
+                && vfyhexf(MSGID_LENGTH, &f[1])
+                && vfyhost(&f[2])
+                && vfybase32f(USERNAME_LENGTH, &f[3])) {
+
+                status = SVC_ERR;
+                copy_field(msgid, &f[1]);
+
+                /* rqueue is full: refuse new messages, but keep serving in-flight ones */
+                if (index_full(id->rqidx)  &&  index_lookup(id->rqidx, msgid) != IDX_PRESENT)
+                    status = SVC_FULL;
+
+                else if ((cqdir = open_queue(id, 1, msgid, 1)) != -1) {
+                    if (handle_msg(msgid, copy_field(arg1, &f[2]),
+                                   copy_field(arg2, &f[3]), nf == 5, cqdir, id->rqidx)
+                        && wait_commit(cqdir))
+                        status = SVC_OK;
+
+                    if (close(cqdir))
+                        status = SVC_ERR;
+                }
             }
-            else if (!strcmp("msg", cmd)) {
-                if (arg2
-                    && vfyhex(MSGID_LENGTH, msgid)
-                    && vfyhost(arg1)
-                    && vfybase32(USERNAME_LENGTH, arg2)) {
-
-                    status = SVC_ERR;
-
-                    if ((cqdir = open(rqueues, O_RDONLY | O_CLOEXEC)) != -1) {
-                        if (handle_msg(msgid, arg1, arg2, cqdir))
-                            status = SVC_OK;
-
-                        if (close(cqdir))
-                            status = SVC_ERR;
-                    }
+        }
+        else if (is_cmd(&f[0], "ses")) {
+            if (nf == 5  &&  session_msgs
+                && vfyhexf(MSGID_LENGTH, &f[1])
+                && vfyhexf(MSGID_LENGTH, &f[2])
+                && vfyhost(&f[3])
+                && vfybase32f(USERNAME_LENGTH, &f[4])) {
+
+                status = SVC_ERR;
+                copy_field(msgid, &f[1]);
+
+                if (index_full(id->rqidx)  &&  index_lookup(id->rqidx, msgid) != IDX_PRESENT)
+                    status = SVC_FULL;
+
+                else if ((cqdir = open_queue(id, 1, msgid, 1)) != -1) {
+                    if (handle_ses(msgid, copy_field(arg1, &f[2]), copy_field(arg2, &f[3]),
+                                   copy_field(arg3, &f[4]), cqdir, id)
+                        && wait_commit(cqdir))
+                        status = SVC_OK;
+
+                    if (close(cqdir))
+                        status = SVC_ERR;
+                }
+            }
+        }
+        else if (is_cmd(&f[0], "pre")) {
+            if (nf == 5  &&  prekeys
+                && vfyhexf(MSGID_LENGTH, &f[1])
+                && vfyhexf(MSGID_LENGTH, &f[2])
+                && vfyhost(&f[3])
+                && vfybase32f(USERNAME_LENGTH, &f[4])) {
+
+                status = SVC_ERR;
+                copy_field(msgid, &f[1]);
+
+                if (index_full(id->rqidx)  &&  index_lookup(id->rqidx, msgid) != IDX_PRESENT)
+                    status = SVC_FULL;
+
+                else if ((cqdir = open_queue(id, 1, msgid, 1)) != -1) {
+                    if (handle_pre(msgid, copy_field(arg1, &f[2]), copy_field(arg2, &f[3]),
+                                   copy_field(arg3, &f[4]), cqdir, id)
+                        && wait_commit(cqdir))
+                        status = SVC_OK;
+
+                    if (close(cqdir))
+                        status = SVC_ERR;
                 }
             }
-            else if (!strcmp("snd", cmd)) {
-                if (arg1 && !arg2
-                    && vfyhex(MSGID_LENGTH, msgid)
-                    && vfyhex(MAC_LENGTH, arg1)) {
+        }
+        else if (is_cmd(&f[0], "snd")) {
+            if (nf == 3
+                && vfyhexf(MSGID_LENGTH, &f[1])
+                && vfyhexf(MAC_LENGTH,   &f[2])) {
 
-                    status = SVC_ERR;
+                status = SVC_ERR;
+                copy_field(msgid, &f[1]);
 
-                    if ((cqdir = open(rqueues, O_RDONLY | O_CLOEXEC)) != -1) {
-                        if (handle_snd(msgid, arg1, cqdir))
-                            status = SVC_OK;
+                if (maybe_exists(id->rqidx, msgid)  &&  (cqdir = open_queue(id, 1, msgid, 0)) != -1) {
+                    if (handle_snd(msgid, copy_field(arg1, &f[2]), cqdir, id)
+                        && wait_commit(cqdir))
+                        status = SVC_OK;
 
-                        if (close(cqdir))
-                            status = SVC_ERR;
-                    }
+                    if (close(cqdir))
+                        status = SVC_ERR;
                 }
             }
-            else if (!strcmp("rcp", cmd)) {
-                if (arg1 && !arg2
-                    && vfyhex(MSGID_LENGTH, msgid)
-                    && vfyhex(MAC_LENGTH, arg1)) {
+        }
+        else if (is_cmd(&f[0], "rcp")) {
+            if (nf == 3
+                && vfyhexf(MSGID_LENGTH, &f[1])
+                && vfyhexf(MAC_LENGTH,   &f[2])) {
 
-                    status = SVC_ERR;
+                status = SVC_ERR;
+                copy_field(msgid, &f[1]);
 
-                    if ((cqdir = open(queues, O_RDONLY | O_CLOEXEC)) != -1) {
-                        if (handle_rcp(msgid, arg1, cqdir))
-                            status = SVC_OK;
+                if (maybe_exists(id->qidx, msgid)  &&  (cqdir = open_queue(id, 0, msgid, 0)) != -1) {
+                    if (handle_rcp(msgid, copy_field(arg1, &f[2]), cqdir, id)
+                        && wait_commit(cqdir))
+                        status = SVC_OK;
 
-                        if (close(cqdir))
-                            status = SVC_ERR;
-                    }
+                    if (close(cqdir))
+                        status = SVC_ERR;
                 }
             }
-            else if (!strcmp("ack", cmd)) {
-                if (arg1 && !arg2
-                    && vfyhex(MSGID_LENGTH, msgid)
-                    && vfyhex(MAC_LENGTH, arg1)) {
+        }
+        else if (is_cmd(&f[0], "ack")) {
+            if (nf == 3
+                && vfyhexf(MSGID_LENGTH, &f[1])
+                && vfyhexf(MAC_LENGTH,   &f[2])) {
 
-                    status = SVC_ERR;
+                status = SVC_ERR;
+                copy_field(msgid, &f[1]);
 
-                    if ((cqdir = open(rqueues, O_RDONLY | O_CLOEXEC)) != -1) {
-                        if (handle_ack(msgid, arg1, cqdir))
-                            status = SVC_OK;
+                if (maybe_exists(id->rqidx, msgid)  &&  (cqdir = open_queue(id, 1, msgid, 0)) != -1) {
+                    if (handle_ack(msgid, copy_field(arg1, &f[2]), cqdir)
+                        && wait_commit(cqdir))
+                        status = SVC_OK;
 
-                        if (close(cqdir))
-                            status = SVC_ERR;
-                    }
+                    if (close(cqdir))
+                        status = SVC_ERR;
                 }
             }
         }
+
+        if (status == SVC_OK  &&  is_idempotent(request))
+            recent_put(request, id);
     }
 
     return status;
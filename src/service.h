@@ -4,9 +4,18 @@
 enum SVC_Status {
     SVC_BADFMT = -1,
     SVC_ERR    = 0,
-    SVC_OK     = 1
+    SVC_OK     = 1,
+    SVC_FULL   = 2
 };
 
-enum SVC_Status handle_request(const char *request, const char *queues, const char *rqueues);
+struct identity;
+
+enum SVC_Status handle_request(const char *request, const struct identity *id);
+
+/* enable ephemeral key sessions (ses/... requests), before the webserver starts */
+void service_set_session(unsigned long long maxmsgs, unsigned long long ttl);
+
+/* enable claims of published prekeys (pre/... requests), before the webserver starts */
+void service_set_prekeys(int enable);
 
 #endif
@@ -0,0 +1,360 @@
+/*
+  Minimal io_uring interface (raw system calls, no liburing) for executing
+  short chains of linked filesystem operations in a single system call.
+
+  Each thread lazily sets up its own ring (with one registered file slot,
+  used for direct descriptors of created files), which is torn down when
+  the thread exits.  If io_uring or any of the required operations is not
+  supported (Linux < 5.15, or disabled by seccomp/sysctl), uring_begin()
+  returns NULL, and callers use synchronous system calls instead.
+
+  thread-safe (rings are per-thread)
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+#include "util.h"
+
+
+/* max. operations in a chain, and max. written line length */
+#define MAX_OPS             16
+#define MAX_LINE_LENGTH    255
+
+/* direct descriptor slot for created files */
+#define FILE_SLOT            0
+
+#define FCREAT_MODE         (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)
+
+
+struct uring_chain {
+    int                 fd;
+
+    void                *sqring, *cqring;
+    size_t              sqringsz, cqringsz, sqessz;
+    unsigned            *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned            *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+
+    /* current chain: number of operations, expected write lengths */
+    unsigned            nops;
+    int                 overflow;
+    unsigned            wlen[MAX_OPS];
+    char                lines[MAX_OPS][MAX_LINE_LENGTH+2];
+};
+
+
+/* per-thread ring, or &unavailable */
+static pthread_key_t  key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static char           unavailable;
+
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nargs) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+
+static void destroy(struct uring_chain *ch) {
+    if (ch->sqes != MAP_FAILED)
+        munmap(ch->sqes, ch->sqessz);
+    if (ch->cqring != MAP_FAILED  &&  ch->cqring != ch->sqring)
+        munmap(ch->cqring, ch->cqringsz);
+    if (ch->sqring != MAP_FAILED)
+        munmap(ch->sqring, ch->sqringsz);
+    if (ch->fd != -1)
+        close(ch->fd);
+
+    free(ch);
+}
+
+
+static void destroy_key(void *value) {
+    if (value != &unavailable)
+        destroy((struct uring_chain*) value);
+}
+
+
+static void make_key() {
+    if (pthread_key_create(&key, destroy_key))
+        error("failed to create thread-specific key");
+}
+
+
+/* check that all operations used in chains are supported */
+static int probe_ops(int fd) {
+    const int ops[] = { IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE,
+                        IORING_OP_RENAMEAT, IORING_OP_LINKAT };
+    struct io_uring_probe *probe;
+    int    res = 0, i;
+
+    if (!((probe = (struct io_uring_probe*)
+                   calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op)))))
+        error("calloc failed");
+
+    if (!sys_register(fd, IORING_REGISTER_PROBE, probe, 256)) {
+        for (i = 0;  i < sizeof(ops) / sizeof(ops[0]);  ++i)
+            if (ops[i] > probe->last_op  ||  !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+                break;
+
+        res = (i == sizeof(ops) / sizeof(ops[0]));
+    }
+
+    free(probe);
+    return res;
+}
+
+
+static struct uring_chain* create() {
+    struct uring_chain     *ch;
+    struct io_uring_params p;
+    int    slots[FILE_SLOT+1];
+
+    if (!((ch = (struct uring_chain*) malloc(sizeof(struct uring_chain)))))
+        error("malloc failed");
+
+    ch->sqring = ch->cqring = ch->sqes = MAP_FAILED;
+
+    memset(&p, 0, sizeof(p));
+    if ((ch->fd = sys_setup(MAX_OPS, &p)) == -1) {
+        flog(LOG_NOTICE, "io_uring is not available, using synchronous calls");
+        destroy(ch);
+        return NULL;
+    }
+
+    ch->sqringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ch->cqringsz = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+    ch->sqessz   = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ch->cqringsz > ch->sqringsz)
+            ch->sqringsz = ch->cqringsz;
+        ch->cqringsz = ch->sqringsz;
+    }
+
+    ch->sqring = mmap(NULL, ch->sqringsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ch->fd, IORING_OFF_SQ_RING);
+
+    if (ch->sqring != MAP_FAILED  &&  (p.features & IORING_FEAT_SINGLE_MMAP))
+        ch->cqring = ch->sqring;
+    else
+        ch->cqring = mmap(NULL, ch->cqringsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ch->fd, IORING_OFF_CQ_RING);
+
+    ch->sqes = mmap(NULL, ch->sqessz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ch->fd, IORING_OFF_SQES);
+
+    memset(slots, 0xff, sizeof(slots));
+
+    if (   ch->sqring == MAP_FAILED  ||  ch->cqring == MAP_FAILED  ||  ch->sqes == MAP_FAILED
+        || !probe_ops(ch->fd)
+        /* sparse file table (-1 entries) for direct descriptors */
+        || sys_register(ch->fd, IORING_REGISTER_FILES, slots, FILE_SLOT+1)) {
+
+        flog(LOG_NOTICE, "io_uring setup failed, using synchronous calls");
+        destroy(ch);
+        return NULL;
+    }
+
+    ch->sqhead  = (unsigned*) ((char*) ch->sqring + p.sq_off.head);
+    ch->sqtail  = (unsigned*) ((char*) ch->sqring + p.sq_off.tail);
+    ch->sqmask  = (unsigned*) ((char*) ch->sqring + p.sq_off.ring_mask);
+    ch->sqarray = (unsigned*) ((char*) ch->sqring + p.sq_off.array);
+
+    ch->cqhead  = (unsigned*) ((char*) ch->cqring + p.cq_off.head);
+    ch->cqtail  = (unsigned*) ((char*) ch->cqring + p.cq_off.tail);
+    ch->cqmask  = (unsigned*) ((char*) ch->cqring + p.cq_off.ring_mask);
+    ch->cqes    = (struct io_uring_cqe*) ((char*) ch->cqring + p.cq_off.cqes);
+
+    return ch;
+}
+
+
+struct uring_chain* uring_begin() {
+    struct uring_chain *ch;
+
+    pthread_once(&key_once, make_key);
+
+    if (!((ch = (struct uring_chain*) pthread_getspecific(key)))) {
+        if (!((ch = create())))
+            ch = (struct uring_chain*) &unavailable;
+
+        if (pthread_setspecific(key, ch))
+            error("failed to set thread-specific value");
+    }
+
+    if (ch == (struct uring_chain*) &unavailable)
+        return NULL;
+
+    ch->nops     = 0;
+    ch->overflow = 0;
+
+    return ch;
+}
+
+
+/* next zeroed SQE of the chain (user_data is the operation index) */
+static struct io_uring_sqe* next_sqe(struct uring_chain *ch, unsigned wlen) {
+    struct io_uring_sqe *sqe;
+    unsigned            idx;
+
+    if (ch->nops == MAX_OPS) {
+        ch->overflow = 1;
+        return NULL;
+    }
+
+    idx = (*ch->sqtail + ch->nops) & *ch->sqmask;
+    sqe = &ch->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data       = ch->nops;
+    ch->sqarray[idx]     = idx;
+    ch->wlen[ch->nops++] = wlen;
+
+    return sqe;
+}
+
+
+void uring_write_line(struct uring_chain *ch, int dir, const char *path, const char *s) {
+    struct io_uring_sqe *sqe;
+    char                *line = ch->lines[ch->nops < MAX_OPS ? ch->nops : 0];
+    unsigned            len   = 0;
+
+    if (s) {
+        if (strlen(s) > MAX_LINE_LENGTH) {
+            ch->overflow = 1;
+            return;
+        }
+
+        strcpy(line, s);
+        strcat(line, "\n");
+        len = strlen(line);
+    }
+
+    /* open into direct descriptor slot (O_CLOEXEC is not allowed) */
+    if ((sqe = next_sqe(ch, 0))) {
+        sqe->opcode     = IORING_OP_OPENAT;
+        sqe->fd         = dir;
+        sqe->addr       = (unsigned long) path;
+        sqe->len        = FCREAT_MODE;
+        sqe->open_flags = O_CREAT | O_WRONLY | O_TRUNC;
+        sqe->file_index = FILE_SLOT + 1;
+    }
+
+    if (len  &&  (sqe = next_sqe(ch, len))) {
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->flags  = IOSQE_FIXED_FILE;
+        sqe->fd     = FILE_SLOT;
+        sqe->addr   = (unsigned long) line;
+        sqe->len    = len;
+    }
+
+    if ((sqe = next_sqe(ch, 0))) {
+        sqe->opcode     = IORING_OP_CLOSE;
+        sqe->file_index = FILE_SLOT + 1;
+    }
+}
+
+
+static void add_link_op(struct uring_chain *ch, int opcode,
+                        int olddir, const char *oldpath, int newdir, const char *newpath) {
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = next_sqe(ch, 0))) {
+        sqe->opcode = opcode;
+        sqe->fd     = olddir;
+        sqe->addr   = (unsigned long) oldpath;
+        sqe->len    = newdir;
+        sqe->addr2  = (unsigned long) newpath;
+    }
+}
+
+
+void uring_renameat(struct uring_chain *ch, int olddir, const char *oldpath, int newdir, const char *newpath) {
+    add_link_op(ch, IORING_OP_RENAMEAT, olddir, oldpath, newdir, newpath);
+}
+
+
+void uring_linkat(struct uring_chain *ch, int olddir, const char *oldpath, int newdir, const char *newpath) {
+    add_link_op(ch, IORING_OP_LINKAT, olddir, oldpath, newdir, newpath);
+}
+
+
+int uring_submit(struct uring_chain *ch) {
+    int      res[MAX_OPS], err = 0;
+    unsigned i, head, tail, ncomp = 0, nsub;
+
+    if (ch->overflow) {
+        errno = ENOBUFS;
+        return 0;
+    }
+
+    if (!ch->nops)
+        return 1;
+
+    /* link all operations, so that a failure cancels the rest (-ECANCELED) */
+    tail = *ch->sqtail;
+    for (i = 0;  i+1 < ch->nops;  ++i)
+        ch->sqes[(tail + i) & *ch->sqmask].flags |= IOSQE_IO_LINK;
+
+    __atomic_store_n(ch->sqtail, tail + ch->nops, __ATOMIC_RELEASE);
+
+    /* submit and wait for all completions (EINTR can interrupt waiting) */
+    for (nsub = ch->nops;  ncomp < ch->nops; ) {
+        if (sys_enter(ch->fd, nsub, ch->nops - ncomp) == -1  &&  errno != EINTR) {
+            /* ring state is unknown, don't use it in this thread anymore */
+            warning("io_uring_enter failed");
+            err = errno;
+
+            destroy(ch);
+            pthread_setspecific(key, &unavailable);
+
+            errno = err;
+            return 0;
+        }
+
+        nsub = tail + ch->nops - __atomic_load_n(ch->sqhead, __ATOMIC_ACQUIRE);
+
+        head = *ch->cqhead;
+        for (; head != __atomic_load_n(ch->cqtail, __ATOMIC_ACQUIRE);  ++head, ++ncomp) {
+            struct io_uring_cqe *cqe = &ch->cqes[head & *ch->cqmask];
+
+            i      = (unsigned) cqe->user_data;
+            res[i] = cqe->res;
+
+            /* short writes are failures */
+            if (ch->wlen[i]  &&  res[i] >= 0  &&  res[i] != ch->wlen[i])
+                res[i] = -EIO;
+        }
+        __atomic_store_n(ch->cqhead, head, __ATOMIC_RELEASE);
+    }
+
+    /* report first failure */
+    for (i = 0;  i < ch->nops;  ++i)
+        if (res[i] < 0) {
+            errno = -res[i];
+            return 0;
+        }
+
+    return 1;
+}
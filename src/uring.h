@@ -0,0 +1,21 @@
+#ifndef URING_H
+#define URING_H
+
+/*
+  chain of linked io_uring operations, executed by a single io_uring_enter()
+  an operation is started only if all preceding operations have succeeded
+*/
+struct uring_chain;
+
+/* returns NULL if io_uring is not available (use synchronous calls then) */
+struct uring_chain* uring_begin();
+
+/* create/truncate file at dir/path, and write s + '\n' (if s is not NULL) */
+void uring_write_line(struct uring_chain *ch, int dir, const char *path, const char *s);
+void uring_renameat(struct uring_chain *ch, int olddir, const char *oldpath, int newdir, const char *newpath);
+void uring_linkat(struct uring_chain *ch, int olddir, const char *oldpath, int newdir, const char *newpath);
+
+/* returns 1 if all operations succeeded, else 0 with errno of the first failure */
+int uring_submit(struct uring_chain *ch);
+
+#endif
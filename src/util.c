@@ -8,6 +8,10 @@
 #include <stdio.h>
 #endif
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "util.h"
 
 
@@ -44,29 +48,90 @@ void error(const char *prefix) {
 }
 
 
-/* lowercase hexadecimal (0-9, a-f) */
-int vfyhex(int sz, const char *s) {
-    if (strlen(s) != sz)
-        return 0;
+/*
+  character classes for request fields validation
+  table lookups avoid per-character range comparison branches
+*/
+#define CC_HEX    1
+#define CC_BASE32 2
+
+static const unsigned char charclass[256] = {
+    ['0'] = CC_HEX,             ['1'] = CC_HEX,
+    ['2'] = CC_HEX | CC_BASE32, ['3'] = CC_HEX | CC_BASE32,
+    ['4'] = CC_HEX | CC_BASE32, ['5'] = CC_HEX | CC_BASE32,
+    ['6'] = CC_HEX | CC_BASE32, ['7'] = CC_HEX | CC_BASE32,
+    ['8'] = CC_HEX,             ['9'] = CC_HEX,
+    ['a'] = CC_HEX | CC_BASE32, ['b'] = CC_HEX | CC_BASE32,
+    ['c'] = CC_HEX | CC_BASE32, ['d'] = CC_HEX | CC_BASE32,
+    ['e'] = CC_HEX | CC_BASE32, ['f'] = CC_HEX | CC_BASE32,
+    ['g'] = CC_BASE32, ['h'] = CC_BASE32, ['i'] = CC_BASE32, ['j'] = CC_BASE32,
+    ['k'] = CC_BASE32, ['l'] = CC_BASE32, ['m'] = CC_BASE32, ['n'] = CC_BASE32,
+    ['o'] = CC_BASE32, ['p'] = CC_BASE32, ['q'] = CC_BASE32, ['r'] = CC_BASE32,
+    ['s'] = CC_BASE32, ['t'] = CC_BASE32, ['u'] = CC_BASE32, ['v'] = CC_BASE32,
+    ['w'] = CC_BASE32, ['x'] = CC_BASE32, ['y'] = CC_BASE32, ['z'] = CC_BASE32
+};
+
+
+#ifdef __SSE2__
+/* number of leading characters in s[0..sz) within [lo1, hi1] or [lo2, hi2], 16 at a time */
+static int vfyranges(int sz, const char *s, char lo1, char hi1, char lo2, char hi2) {
+    const __m128i l1 = _mm_set1_epi8(lo1 - 1), h1 = _mm_set1_epi8(hi1 + 1),
+                  l2 = _mm_set1_epi8(lo2 - 1), h2 = _mm_set1_epi8(hi2 + 1);
+    __m128i       v, ok;
+    int           i;
+
+    /* signed comparisons also reject non-ASCII characters */
+    for (i = 0;  i + 16 <= sz;  i += 16) {
+        v  = _mm_loadu_si128((const __m128i*) (s + i));
+        ok = _mm_or_si128(_mm_and_si128(_mm_cmpgt_epi8(v, l1), _mm_cmplt_epi8(v, h1)),
+                          _mm_and_si128(_mm_cmpgt_epi8(v, l2), _mm_cmplt_epi8(v, h2)));
+
+        if (_mm_movemask_epi8(ok) != 0xFFFF)
+            break;
+    }
+
+    return i;
+}
+#endif
+
+
+static int vfyclass(int sz, const char *s, unsigned char cc) {
+    const unsigned char *u = (const unsigned char*) s;
+    int                 i  = 0;
 
-    for (; *s; ++s)
-        if (!((*s >= '0' && *s <= '9') || (*s >= 'a' && *s <= 'f')))
+#ifdef __SSE2__
+    i = (cc == CC_HEX) ? vfyranges(sz, s, '0', '9', 'a', 'f')
+                       : vfyranges(sz, s, 'a', 'z', '2', '7');
+#endif
+
+    for (;  i < sz;  ++i)
+        if (!(charclass[u[i]] & cc))
             return 0;
 
     return 1;
 }
 
 
-/* lowercase Base-32 encoding (a-z, 2-7) */
-int vfybase32(int sz, const char *s) {
-    if (strlen(s) != sz)
-        return 0;
+/* sz lowercase hexadecimal chars (0-9, a-f), s has at least sz chars (no NUL needed) */
+int vfyhexn(int sz, const char *s) {
+    return vfyclass(sz, s, CC_HEX);
+}
 
-    for (; *s; ++s)
-        if (!((*s >= 'a' && *s <= 'z') || (*s >= '2' && *s <= '7')))
-            return 0;
+/* sz lowercase Base-32 chars (a-z, 2-7), s has at least sz chars (no NUL needed) */
+int vfybase32n(int sz, const char *s) {
+    return vfyclass(sz, s, CC_BASE32);
+}
 
-    return 1;
+
+/* lowercase hexadecimal (0-9, a-f) */
+int vfyhex(int sz, const char *s) {
+    return strlen(s) == sz  &&  vfyhexn(sz, s);
+}
+
+
+/* lowercase Base-32 encoding (a-z, 2-7) */
+int vfybase32(int sz, const char *s) {
+    return strlen(s) == sz  &&  vfybase32n(sz, s);
 }
 
 
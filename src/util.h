@@ -12,6 +12,8 @@ void error(const char *prefix);
 
 int vfyhex(int sz, const char *s);
 int vfybase32(int sz, const char *s);
+int vfyhexn(int sz, const char *s);
+int vfybase32n(int sz, const char *s);
 
 char* alloc_env(const char *var, const char *suffix);
 void dealloc_env(char *env);
@@ -0,0 +1,138 @@
+/*
+  Work items (identity, queue type, msgid) handed by webserver threads to
+  the daemon's main loop, which runs the next loop stage immediately,
+  without relying on filesystem notifications.
+
+  Bounded lock-free multi-producer / single-consumer queue (sequence
+  numbers per cell), with an eventfd for waking up the consumer.  When the
+  queue is full, producers fall back to touching the message directory,
+  which is also what external writers (loop scripts) do.
+*/
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+#include "wakeup.h"
+#include "daemon.h"
+#include "util.h"
+
+
+/* queue capacity (power of 2) */
+#ifndef TESTING
+#define QUEUE_SIZE  1024
+#else
+#define QUEUE_SIZE     4
+#endif
+
+
+static struct cell {
+    size_t                seq;
+    const struct identity *id;
+    int                   rq;
+    char                  msgid[MSGID_LENGTH+1];
+} cells[QUEUE_SIZE];
+
+/* producers' and consumer's positions */
+static size_t enqpos, deqpos;
+
+static int evfd = -1;
+
+
+int wakeup_init() {
+    size_t i;
+
+    for (i = 0;  i < QUEUE_SIZE;  ++i)
+        cells[i].seq = i;
+
+    enqpos = deqpos = 0;
+
+    if ((evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+        warning("failed to create eventfd");
+
+    return evfd != -1;
+}
+
+
+void wakeup_close() {
+    if (evfd != -1) {
+        if (close(evfd))
+            warning("could not close eventfd");
+        evfd = -1;
+    }
+}
+
+
+int wakeup_fd() {
+    return evfd;
+}
+
+
+/* thread-safe */
+int wakeup_push(const struct identity *id, int rq, const char *msgid) {
+    struct cell *c;
+    size_t      pos, seq;
+    uint64_t    one = 1;
+
+    if (evfd == -1)
+        return 0;
+
+    for (pos = __atomic_load_n(&enqpos, __ATOMIC_RELAXED); ; ) {
+        c   = &cells[pos & (QUEUE_SIZE-1)];
+        seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+
+        /* cell is free: claim it (pos is updated on failure) */
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&enqpos, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        /* cell is not consumed yet: queue is full */
+        else if ((ssize_t) (seq - pos) < 0)
+            return 0;
+        else
+            pos = __atomic_load_n(&enqpos, __ATOMIC_RELAXED);
+    }
+
+    c->id = id;
+    c->rq = rq;
+    strncpy(c->msgid, msgid, MSGID_LENGTH);
+    c->msgid[MSGID_LENGTH] = '\0';
+
+    /* publish */
+    __atomic_store_n(&c->seq, pos+1, __ATOMIC_RELEASE);
+
+    /* counter overflow (EAGAIN) is harmless: the consumer is woken up anyway */
+    if (write(evfd, &one, sizeof(one)) == -1  &&  errno != EAGAIN)
+        warning("failed to signal eventfd");
+
+    return 1;
+}
+
+
+/* NOT thread-safe (single consumer) */
+int wakeup_pop(const struct identity **id, int *rq, char *msgid) {
+    struct cell *c = &cells[deqpos & (QUEUE_SIZE-1)];
+
+    if (__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) != deqpos+1)
+        return 0;
+
+    *id = c->id;
+    *rq = c->rq;
+    strcpy(msgid, c->msgid);
+
+    /* release the cell for the producer one lap ahead */
+    __atomic_store_n(&c->seq, deqpos + QUEUE_SIZE, __ATOMIC_RELEASE);
+    ++deqpos;
+
+    return 1;
+}
+
+
+void wakeup_clear() {
+    uint64_t cnt;
+
+    if (read(evfd, &cnt, sizeof(cnt)) == -1  &&  errno != EAGAIN  &&  errno != EINTR)
+        warning("failed to read eventfd");
+}
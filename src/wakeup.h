@@ -0,0 +1,19 @@
+#ifndef WAKEUP_H
+#define WAKEUP_H
+
+struct identity;
+
+int wakeup_init();
+void wakeup_close();
+int wakeup_fd();
+
+/* producers (webserver threads): returns 0 if the queue is full or unavailable */
+int wakeup_push(const struct identity *id, int rq, const char *msgid);
+
+/* consumer (main loop): msgid has MSGID_LENGTH+1 chars, returns 0 if queue is empty */
+int wakeup_pop(const struct identity **id, int *rq, char *msgid);
+
+/* consumer: clear eventfd counter before draining the queue */
+void wakeup_clear();
+
+#endif
@@ -0,0 +1,780 @@
+/*
+  Change notification for (r)queue directories, with a backend selected
+  per directory by filesystem type (CABLE_WATCH=auto), or forced:
+
+  fanotify: FAN_REPORT_DFID_NAME (Linux 5.9+, unprivileged since 5.13),
+            events are matched to directories by fsid and file handle;
+            attribute changes of subdirectories are reported with the
+            subdirectory's own handle, so handles of entries are tracked
+  inotify:  local filesystems without fanotify support
+  poll:     FUSE and network filesystems, where inotify is unreliable;
+            directory mtime / ctime are checked periodically, and entries
+            are read and diffed only if these changed
+
+  All backends report inotify-style masks (fanotify masks have the same
+  values); polling reports new entries as IN_MOVED_TO and vanished ones
+  as IN_DELETE, and doesn't notice attribute changes of entries.
+
+  After registration, delivery of inotify / fanotify events is probed by
+  creating and removing a subdirectory in each watched directory, which
+  is switched to polling if the events don't arrive in time (e.g., FUSE
+  filesystems with inotify emulation that stabilizes only after a while).
+
+  NOT thread-safe (main loop only)
+*/
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/inotify.h>
+#include <sys/fanotify.h>
+#include <sys/syscall.h>
+#include <linux/magic.h>
+
+#include "watch.h"
+#include "event.h"
+#include "identity.h"
+#include "process.h"
+#include "util.h"
+
+
+/* polling interval, and age of directory timestamps which are trusted (coarse on some fs) */
+#ifndef TESTING
+#define POLL_INTERVAL  2
+#else
+#define POLL_INTERVAL  1
+#endif
+#define POLL_SETTLE    2
+
+/* events reading buffer (holds at least one max. event) */
+#define EVENTS_BUFSZ   (64 * 1024)
+
+/* probe subdirectory (not a valid entry name, and skipped by polling) */
+#define PROBE_NAME     ".cable-probe"
+
+/* max. file handle size (MAX_HANDLE_SZ) */
+#define HANDLE_SZ      128
+
+/*
+  inotify / fanotify masks for for (r)queue directories
+  creation and removal events only maintain the msgid indexes
+*/
+#define INOTIFY_MASK  (IN_ATTRIB | IN_MOVED_TO | IN_MOVE_SELF | IN_DONT_FOLLOW | IN_ONLYDIR \
+                       | IN_CREATE | IN_DELETE | IN_MOVED_FROM)
+#define FANOTIFY_MASK (FAN_ATTRIB | FAN_MOVED_TO | FAN_MOVE_SELF | FAN_DELETE_SELF \
+                       | FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_ONDIR | FAN_EVENT_ON_CHILD)
+
+/* events requiring re-registration */
+#define INOTIFY_RESET  (IN_IGNORED | IN_UNMOUNT | IN_Q_OVERFLOW | IN_MOVE_SELF)
+#define FANOTIFY_RESET (FAN_Q_OVERFLOW | FAN_DELETE_SELF | FAN_MOVE_SELF)
+
+/* reported mask bits */
+#define REPORT_MASK    (IN_ATTRIB | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_ISDIR)
+
+
+static const char *const backend_names[] = { "auto", "inotify", "fanotify", "poll" };
+
+
+/* struct file_handle */
+struct fhandle {
+    unsigned int  handle_bytes;
+    int           handle_type;
+    unsigned char f_handle[HANDLE_SZ];
+};
+
+/* entry of a fanotify-watched directory (handle is allocated to its actual size) */
+struct child {
+    char           *name;
+    struct fhandle *handle;
+};
+
+/* watched directory ((r)queue or its shard) */
+struct wdir {
+    struct identity    *id;
+    int                rq;
+    char               *path;
+    enum WATCH_Backend type;
+    int                probing;
+
+    /* inotify */
+    int                wd;
+
+    /* fanotify */
+    fsid_t             fsid;
+    struct fhandle     handle;
+    struct child       *children;
+    size_t             nchildren, allocchildren;
+
+    /* poll (sorted entry names) */
+    struct timespec    mtime, ctime;
+    int                dirty;
+    char               **names;
+    size_t             nnames;
+};
+
+static struct wdir *dirs;
+static int         ndirs, allocdirs;
+
+static watch_fn           handler;
+static enum WATCH_Backend forced;
+static int                nofanotify;
+static double             nextpoll = -1;
+
+static struct event inotev = { -1, NULL }, fanev = { -1, NULL };
+
+/* events reading buffer, aligned for event structures */
+static union {
+    struct inotify_event           iev;
+    struct fanotify_event_metadata fev;
+    char                           buf[EVENTS_BUFSZ];
+} events;
+
+/* statistics */
+static unsigned long nevents[4], npolls, ndiffs;
+
+
+static const char* dir_path(const struct wdir *d) {
+    return d->path;
+}
+
+
+static void reset() {
+    handler(NULL, 0, 0, NULL);
+}
+
+
+static void report(struct wdir *d, uint32_t mask, const char *name) {
+    /* probe events are not passed on */
+    if (!strcmp(name, PROBE_NAME)) {
+        d->probing = 0;
+        return;
+    }
+
+    ++nevents[d->type];
+    handler(d->id, d->rq, mask & REPORT_MASK, name);
+}
+
+
+static int same_handle(const struct fhandle *a, const struct fhandle *b) {
+    return a->handle_type  == b->handle_type
+        &&  a->handle_bytes == b->handle_bytes
+        &&  !memcmp(a->f_handle, b->f_handle, a->handle_bytes);
+}
+
+
+static void untrack_child(struct wdir *d, const char *name) {
+    size_t i;
+
+    for (i = 0;  i < d->nchildren;  ++i)
+        if (!strcmp(d->children[i].name, name)) {
+            free(d->children[i].name);
+            free(d->children[i].handle);
+            d->children[i] = d->children[--d->nchildren];
+            break;
+        }
+}
+
+
+/* remember handle of a subdirectory (entries which vanished meanwhile are skipped) */
+static void track_child(struct wdir *d, const char *name) {
+    struct fhandle fh;
+    struct child   *c;
+    char           path[PATH_MAX];
+    size_t         size;
+    int            mntid;
+
+    untrack_child(d, name);
+
+    fh.handle_bytes = HANDLE_SZ;
+    if (snprintf(path, sizeof(path), "%s/%s", dir_path(d), name) >= (int) sizeof(path)
+        ||  syscall(SYS_name_to_handle_at, AT_FDCWD, path, &fh, &mntid, 0))
+        return;
+
+    if (d->nchildren == d->allocchildren) {
+        d->allocchildren = d->allocchildren ? d->allocchildren * 2 : 64;
+        if (!((d->children = (struct child*) realloc(d->children, d->allocchildren * sizeof(struct child)))))
+            error("realloc failed");
+    }
+
+    size = offsetof(struct fhandle, f_handle) + fh.handle_bytes;
+    c    = &d->children[d->nchildren];
+
+    if (!((c->name = strdup(name)))  ||  !((c->handle = (struct fhandle*) malloc(size))))
+        error("malloc failed");
+    memcpy(c->handle, &fh, size);
+
+    ++d->nchildren;
+}
+
+
+static void free_children(struct wdir *d) {
+    size_t i;
+
+    for (i = 0;  i < d->nchildren;  ++i) {
+        free(d->children[i].name);
+        free(d->children[i].handle);
+    }
+    free(d->children);
+
+    d->children  = NULL;
+    d->nchildren = d->allocchildren = 0;
+}
+
+
+static struct wdir* find_inotify(int wd) {
+    int i;
+
+    for (i = 0;  i < ndirs;  ++i)
+        if (dirs[i].type == WATCH_INOTIFY  &&  dirs[i].wd == wd)
+            return &dirs[i];
+
+    return NULL;
+}
+
+
+static void inotify_event(struct event *ev) {
+    struct inotify_event *iev;
+    struct wdir          *d;
+    ssize_t              sz, offset;
+
+    /* sz = -1 and 0 are automatically ignored */
+    if ((sz = read(ev->fd, events.buf, sizeof(events.buf))) == -1  &&  errno != EINTR  &&  errno != EAGAIN) {
+        warning("error while reading from inotify queue");
+        reset();
+    }
+
+    for (offset = 0;  offset < sz  &&  !stop_requested(); ) {
+        iev     = (struct inotify_event*) (events.buf + offset);
+        offset += sizeof(struct inotify_event) + iev->len;
+
+        /*
+          IN_IGNORED is triggered by watched directory removal / fs unmount
+          IN_MOVE_SELF is only triggered by move of actual watched directory
+          (i.e., not its parent)
+          IN_IGNORED also follows removal of watches by watch_probe_finish()
+        */
+        if ((iev->mask & INOTIFY_RESET)) {
+            if (!(iev->mask & IN_IGNORED)  ||  find_inotify(iev->wd))
+                reset();
+        }
+        else if (iev->len > 0) {
+            if ((d = find_inotify(iev->wd)))
+                report(d, iev->mask, iev->name);
+            else
+                flog(LOG_WARNING, "unknown watch descriptor");
+        }
+    }
+}
+
+
+static void fanotify_event(struct event *ev) {
+    struct fanotify_event_metadata *md;
+    struct fanotify_event_info_fid *fid;
+    struct fhandle                 *fh;
+    const char                     *name;
+    ssize_t                        sz;
+    size_t                         j;
+    int                            i;
+
+    if ((sz = read(ev->fd, events.buf, sizeof(events.buf))) == -1  &&  errno != EINTR  &&  errno != EAGAIN) {
+        warning("error while reading from fanotify queue");
+        reset();
+    }
+
+    for (md = &events.fev;  sz > 0  &&  FAN_EVENT_OK(md, sz)  &&  !stop_requested();  md = FAN_EVENT_NEXT(md, sz)) {
+        if (md->vers != FANOTIFY_METADATA_VERSION) {
+            flog(LOG_WARNING, "unsupported fanotify metadata version");
+            reset();
+            break;
+        }
+
+        if ((md->mask & FANOTIFY_RESET)) {
+            reset();
+            continue;
+        }
+
+        /* directory fid record, followed by entry name */
+        fid = (struct fanotify_event_info_fid*) ((char*) md + md->metadata_len);
+        if (md->event_len < md->metadata_len + sizeof(*fid) + sizeof(unsigned int) * 2
+            ||  fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+            continue;
+
+        fh   = (struct fhandle*) fid->handle;
+        name = (const char*) fh->f_handle + fh->handle_bytes;
+
+        for (i = 0;  i < ndirs;  ++i)
+            if (dirs[i].type == WATCH_FANOTIFY
+                &&  !memcmp(&dirs[i].fsid, &fid->fsid, sizeof(fsid_t))  &&  same_handle(&dirs[i].handle, fh))
+                break;
+
+        /* entry events are reported with directory handle and entry name */
+        if (i < ndirs) {
+            if (strcmp(name, ".")) {
+                if ((md->mask & FAN_ONDIR)  &&  (md->mask & (FAN_CREATE | FAN_MOVED_TO)))
+                    track_child(&dirs[i], name);
+                else if ((md->mask & (FAN_DELETE | FAN_MOVED_FROM)))
+                    untrack_child(&dirs[i], name);
+
+                report(&dirs[i], md->mask, name);
+            }
+            continue;
+        }
+
+        /* attribute changes of subdirectories are reported with their own handle */
+        for (i = 0;  i < ndirs;  ++i)
+            if (dirs[i].type == WATCH_FANOTIFY  &&  !memcmp(&dirs[i].fsid, &fid->fsid, sizeof(fsid_t)))
+                for (j = 0;  j < dirs[i].nchildren;  ++j)
+                    if (same_handle(dirs[i].children[j].handle, fh)) {
+                        report(&dirs[i], md->mask, dirs[i].children[j].name);
+                        break;
+                    }
+    }
+}
+
+
+static int cmp_names(const void *a, const void *b) {
+    return strcmp(*(char *const*) a, *(char *const*) b);
+}
+
+
+static void free_names(char **names, size_t count) {
+    size_t i;
+
+    for (i = 0;  i < count;  ++i)
+        free(names[i]);
+    free(names);
+}
+
+
+/* sorted subdirectory names, returning 0 if the directory is not readable */
+static int read_names(const char *path, char ***names, size_t *count) {
+    struct dirent *de;
+    struct stat   st;
+    DIR           *dir;
+    size_t        alloc = 0;
+    int           isdir;
+
+    *names = NULL;
+    *count = 0;
+
+    if (!((dir = opendir(path))))
+        return 0;
+
+    while ((de = readdir(dir))) {
+        if (de->d_name[0] == '.')
+            continue;
+
+        if (de->d_type == DT_UNKNOWN)
+            isdir = !fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW)  &&  S_ISDIR(st.st_mode);
+        else
+            isdir = (de->d_type == DT_DIR);
+
+        if (!isdir)
+            continue;
+
+        if (*count == alloc) {
+            alloc = alloc ? alloc * 2 : 64;
+            if (!((*names = (char**) realloc(*names, alloc * sizeof(char*)))))
+                error("realloc failed");
+        }
+
+        if (!(((*names)[(*count)++] = strdup(de->d_name))))
+            error("strdup failed");
+    }
+
+    if (closedir(dir))
+        warning("could not close directory");
+
+    qsort(*names, *count, sizeof(char*), cmp_names);
+    return 1;
+}
+
+
+/* update directory timestamps: returns -1 if directory is gone, 1 if changed (or recently) */
+static int check_stamps(struct wdir *d) {
+    struct stat st;
+
+    if (stat(dir_path(d), &st)  ||  !S_ISDIR(st.st_mode))
+        return -1;
+
+    if (!d->dirty
+        &&  st.st_mtim.tv_sec == d->mtime.tv_sec  &&  st.st_mtim.tv_nsec == d->mtime.tv_nsec
+        &&  st.st_ctim.tv_sec == d->ctime.tv_sec  &&  st.st_ctim.tv_nsec == d->ctime.tv_nsec)
+        return 0;
+
+    d->mtime = st.st_mtim;
+    d->ctime = st.st_ctim;
+
+    /* changes within the same (coarse) timestamp could be missed otherwise */
+    d->dirty = time(NULL) - st.st_mtime < POLL_SETTLE  ||  time(NULL) - st.st_ctime < POLL_SETTLE;
+
+    return 1;
+}
+
+
+/* check directory timestamps, and diff entries if changed; returns 0 if directory is gone */
+static int poll_dir(struct wdir *d) {
+    char   **names;
+    size_t count, i, j;
+    int    cmp;
+
+    if ((cmp = check_stamps(d)) <= 0)
+        return cmp == 0;
+
+    if (!read_names(dir_path(d), &names, &count))
+        return 0;
+
+    ++ndiffs;
+
+    /* merge sorted lists */
+    for (i = j = 0;  (i < d->nnames  ||  j < count)  &&  !stop_requested(); ) {
+        if (i == d->nnames)
+            cmp = 1;
+        else if (j == count)
+            cmp = -1;
+        else
+            cmp = strcmp(d->names[i], names[j]);
+
+        if (cmp < 0)
+            report(d, IN_DELETE   | IN_ISDIR, d->names[i++]);
+        else if (cmp > 0)
+            report(d, IN_MOVED_TO | IN_ISDIR, names[j++]);
+        else
+            ++i, ++j;
+    }
+
+    free_names(d->names, d->nnames);
+    d->names  = names;
+    d->nnames = count;
+
+    return 1;
+}
+
+
+static enum WATCH_Backend select_backend(const char *path) {
+    struct statfs sf;
+
+    if (forced != WATCH_AUTO)
+        return forced;
+
+    if (!statfs(path, &sf)) {
+        switch ((unsigned long) sf.f_type) {
+        case FUSE_SUPER_MAGIC:
+        case NFS_SUPER_MAGIC:
+        case SMB_SUPER_MAGIC:
+        case CIFS_SUPER_MAGIC:
+        case SMB2_SUPER_MAGIC:
+        case V9FS_MAGIC:
+        case CEPH_SUPER_MAGIC:
+            return WATCH_POLL;
+        }
+    }
+    else
+        warning("statfs failed");
+
+    return nofanotify ? WATCH_INOTIFY : WATCH_FANOTIFY;
+}
+
+
+static int add_inotify(struct wdir *d) {
+    /* don't block on read(), since epoll is used for polling */
+    if (inotev.fd == -1) {
+        if ((inotev.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+            warning("failed to initialize inotify instance");
+            return 0;
+        }
+
+        inotev.fn = inotify_event;
+        if (!event_add(&inotev)) {
+            close(inotev.fd);
+            inotev.fd = -1;
+            return 0;
+        }
+    }
+
+    /* existing watch is ok */
+    if ((d->wd = inotify_add_watch(inotev.fd, dir_path(d), INOTIFY_MASK)) == -1) {
+        warning("could not add inotify watch");
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/* returns -1 if fanotify is not supported (for fallback to inotify) */
+static int add_fanotify(struct wdir *d) {
+    struct statfs sf;
+    char          **names;
+    size_t        count, i;
+    int           mntid;
+
+    if (fanev.fd == -1) {
+        if ((fanev.fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_NONBLOCK | FAN_CLOEXEC,
+                                      O_RDONLY | O_CLOEXEC)) == -1) {
+            flog(LOG_INFO, "fanotify is not available, using inotify");
+            nofanotify = 1;
+            return -1;
+        }
+
+        fanev.fn = fanotify_event;
+        if (!event_add(&fanev)) {
+            close(fanev.fd);
+            fanev.fd = -1;
+            return 0;
+        }
+    }
+
+    /* filesystems without file handles are not supported */
+    d->handle.handle_bytes = HANDLE_SZ;
+    if (statfs(dir_path(d), &sf)
+        ||  syscall(SYS_name_to_handle_at, AT_FDCWD, dir_path(d), &d->handle, &mntid, 0))
+        return -1;
+
+    d->fsid = sf.f_fsid;
+
+    if (fanotify_mark(fanev.fd, FAN_MARK_ADD | FAN_MARK_ONLYDIR | FAN_MARK_DONT_FOLLOW,
+                      FANOTIFY_MASK, AT_FDCWD, dir_path(d))) {
+        if (errno == EXDEV  ||  errno == ENODEV  ||  errno == EOPNOTSUPP)
+            return -1;
+
+        warning("could not add fanotify mark");
+        return 0;
+    }
+
+    /* existing entries (entries created meanwhile are tracked from events) */
+    if (!read_names(dir_path(d), &names, &count)) {
+        warning("could not read directory");
+        return 0;
+    }
+
+    for (i = 0;  i < count;  ++i)
+        track_child(d, names[i]);
+    free_names(names, count);
+
+    return 1;
+}
+
+
+int init_watch(const char *mode, watch_fn fn) {
+    int ok = 1, i;
+
+    handler = fn;
+    forced  = WATCH_AUTO;
+
+    if (mode  &&  *mode) {
+        for (i = WATCH_AUTO;  i <= WATCH_POLL;  ++i)
+            if (!strcmp(mode, backend_names[i]))
+                break;
+
+        if (i <= WATCH_POLL)
+            forced = (enum WATCH_Backend) i;
+        else
+            ok = 0;
+    }
+
+    return ok;
+}
+
+
+void watch_clear() {
+    int i;
+
+    for (i = 0;  i < ndirs;  ++i) {
+        free_names(dirs[i].names, dirs[i].nnames);
+        free_children(&dirs[i]);
+        free(dirs[i].path);
+    }
+    ndirs    = 0;
+    nextpoll = -1;
+
+    /*
+      closing/reopening an inotify fd is an expensive operation, but must be done
+      because otherwise fd provides infinite stream of IN_IGNORED events
+      (fanotify marks are likewise removed by closing the group)
+    */
+    if (inotev.fd != -1) {
+        event_del(&inotev);
+        if (close(inotev.fd))
+            warning("could not close inotify fd");
+        inotev.fd = -1;
+    }
+
+    if (fanev.fd != -1) {
+        event_del(&fanev);
+        if (close(fanev.fd))
+            warning("could not close fanotify fd");
+        fanev.fd = -1;
+    }
+}
+
+
+void shutdown_watch() {
+    watch_clear();
+    free(dirs);
+
+    dirs      = NULL;
+    allocdirs = 0;
+
+    flog(LOG_INFO, "watch events: %lu inotify, %lu fanotify, %lu poll (%lu polls, %lu diffs)",
+         nevents[WATCH_INOTIFY], nevents[WATCH_FANOTIFY], nevents[WATCH_POLL], npolls, ndiffs);
+}
+
+
+int watch_add(struct identity *id, int rq, const char *path) {
+    struct wdir *d;
+    int         ok = 1, ret;
+
+    if (ndirs == allocdirs) {
+        allocdirs = allocdirs ? allocdirs * 2 : 8;
+        if (!((dirs = (struct wdir*) realloc(dirs, allocdirs * sizeof(struct wdir)))))
+            error("realloc failed");
+    }
+
+    d = &dirs[ndirs];
+    memset(d, 0, sizeof(struct wdir));
+    d->id   = id;
+    d->rq   = rq;
+    d->wd   = -1;
+
+    if (!((d->path = strdup(path))))
+        error("strdup failed");
+
+    d->type = select_backend(dir_path(d));
+
+    if (d->type == WATCH_FANOTIFY  &&  (ret = add_fanotify(d)) != -1)
+        ok = ret;
+    else if (d->type != WATCH_POLL) {
+        d->type = WATCH_INOTIFY;
+        ok = add_inotify(d);
+    }
+    else {
+        /* baseline for diffs (entries are scanned by the caller) */
+        if (check_stamps(d) == -1  ||  !read_names(dir_path(d), &d->names, &d->nnames)) {
+            warning("could not read directory");
+            ok = 0;
+        }
+        else if (nextpoll < 0)
+            nextpoll = getmontime() + POLL_INTERVAL;
+    }
+
+    if (!ok) {
+        free(d->path);
+        return 0;
+    }
+
+    /* shards of a (r)queue are logged once */
+    if (!ndirs  ||  d[-1].id != id  ||  d[-1].rq != rq  ||  d[-1].type != d->type)
+        flog(LOG_INFO, "watching %s: %s", rq ? id->rqpath : id->qpath, backend_names[d->type]);
+
+    ++ndirs;
+    return 1;
+}
+
+
+int watch_probe_start() {
+    char path[PATH_MAX];
+    int  count = 0, i;
+
+    for (i = 0;  i < ndirs;  ++i) {
+        if (dirs[i].type == WATCH_POLL)
+            continue;
+
+        /* directories which cannot be probed are trusted (a leftover probe is removed) */
+        if (snprintf(path, sizeof(path), "%s/" PROBE_NAME, dir_path(&dirs[i])) >= (int) sizeof(path)
+            ||  (mkdir(path, S_IRWXU)  &&  errno != EEXIST)  ||  rmdir(path)) {
+            flog(LOG_NOTICE, "could not probe %s", dir_path(&dirs[i]));
+            continue;
+        }
+
+        dirs[i].probing = 1;
+        ++count;
+    }
+
+    return count;
+}
+
+
+int watch_probing() {
+    int i;
+
+    for (i = 0;  i < ndirs;  ++i)
+        if (dirs[i].probing)
+            return 1;
+
+    return 0;
+}
+
+
+void watch_probe_finish() {
+    struct wdir *d, *last = NULL;
+    int         i;
+
+    for (i = 0;  i < ndirs;  ++i) {
+        d = &dirs[i];
+        if (!d->probing)
+            continue;
+
+        if (d->type == WATCH_INOTIFY) {
+            if (inotify_rm_watch(inotev.fd, d->wd))
+                warning("could not remove inotify watch");
+            d->wd = -1;
+        }
+        else {
+            if (fanotify_mark(fanev.fd, FAN_MARK_REMOVE | FAN_MARK_ONLYDIR | FAN_MARK_DONT_FOLLOW,
+                              FANOTIFY_MASK, AT_FDCWD, dir_path(d)))
+                warning("could not remove fanotify mark");
+            free_children(d);
+        }
+
+        d->type    = WATCH_POLL;
+        d->probing = 0;
+
+        /* shards of a (r)queue are logged once */
+        if (!last  ||  last->id != d->id  ||  last->rq != d->rq)
+            flog(LOG_NOTICE, "no events from %s, polling", d->rq ? d->id->rqpath : d->id->qpath);
+        last = d;
+
+        /* baseline for diffs (entries are scanned by the caller) */
+        if (check_stamps(d) == -1  ||  !read_names(dir_path(d), &d->names, &d->nnames)) {
+            flog(LOG_NOTICE, "%s is not accessible", dir_path(d));
+            reset();
+            break;
+        }
+
+        if (nextpoll < 0)
+            nextpoll = getmontime() + POLL_INTERVAL;
+    }
+}
+
+
+double watch_next_poll() {
+    return nextpoll;
+}
+
+
+void watch_poll() {
+    int i;
+
+    if (nextpoll < 0  ||  getmontime() < nextpoll)
+        return;
+
+    ++npolls;
+    for (i = 0;  i < ndirs  &&  !stop_requested();  ++i)
+        if (dirs[i].type == WATCH_POLL  &&  !poll_dir(&dirs[i])) {
+            flog(LOG_NOTICE, "%s is not accessible", dir_path(&dirs[i]));
+            reset();
+            break;
+        }
+
+    nextpoll = getmontime() + POLL_INTERVAL;
+}
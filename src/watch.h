@@ -0,0 +1,36 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdint.h>
+
+struct identity;
+
+enum WATCH_Backend {WATCH_AUTO, WATCH_INOTIFY, WATCH_FANOTIFY, WATCH_POLL};
+
+/*
+  change of an entry in a watched (r)queue, with inotify-style mask
+  id is NULL if watches must be re-registered (overflow, unmount, etc.)
+*/
+typedef void (*watch_fn)(struct identity *id, int rq, uint32_t mask, const char *name);
+
+/* mode: auto (or NULL/empty), inotify, fanotify, poll (requires init_events()) */
+int init_watch(const char *mode, watch_fn fn);
+void shutdown_watch();
+
+/* watch (r)queue (or shard) directory of identity, with backend selected for its filesystem */
+int watch_add(struct identity *id, int rq, const char *path);
+void watch_clear();
+
+/*
+  probe event delivery of registered watches: start returns the number of
+  probed directories, and finish switches those without events to polling
+*/
+int watch_probe_start();
+int watch_probing();
+void watch_probe_finish();
+
+/* polling backend: time of next poll (getmontime()), or -1 if not used */
+double watch_next_poll();
+void watch_poll();
+
+#endif
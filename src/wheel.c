@@ -0,0 +1,193 @@
+/*
+  Hierarchical timer wheel with 1-second ticks: LEVELS levels of SLOTS
+  slots each, level l covering timers expiring within SLOTS^(l+1) ticks.
+  When a lower level wraps around, the corresponding slot of the next level
+  is cascaded (its timers are re-added at lower levels).  Timers further
+  away than the top level are kept in its last reachable slot, and are
+  cascaded until due.
+
+  Adding and removing timers is O(1), and advancing is O(1) per tick
+  (amortized over cascades), independent of the number of timers.  When
+  more than SLOTS ticks have elapsed (e.g., after a stall or a suspend),
+  advancing jumps to the next tick with an occupied slot (a due timer, or
+  a cascade), so that it costs O(LEVELS * SLOTS) per occupied slot rather
+  than O(1) per elapsed tick.
+
+  NOT thread-safe
+*/
+
+#include <stdlib.h>
+
+#include "wheel.h"
+#include "util.h"
+
+
+#define LEVELS    4
+#define SLOT_BITS 6
+#define SLOTS     (1 << SLOT_BITS)
+#define SLOT_MASK (SLOTS - 1)
+
+/* max. delta representable at the top level */
+#define MAX_DELTA ((1UL << (LEVELS * SLOT_BITS)) - 1)
+
+
+struct wheel {
+    struct timer  *slots[LEVELS][SLOTS];
+    struct timer  *expired;
+    unsigned long now;
+};
+
+
+static void link_timer(struct timer **head, struct timer *t) {
+    if ((t->next = *head))
+        t->next->pprev = &t->next;
+
+    t->pprev = head;
+    *head    = t;
+}
+
+
+static void place(struct wheel *w, struct timer *t) {
+    unsigned long expires = t->expires, delta;
+    int           level;
+
+    if (expires <= w->now) {
+        link_timer(&w->expired, t);
+        return;
+    }
+
+    if ((delta = expires - w->now) > MAX_DELTA)
+        expires = w->now + MAX_DELTA;
+
+    for (level = 0;  level < LEVELS-1;  ++level)
+        if (delta < 1UL << ((level+1) * SLOT_BITS))
+            break;
+
+    link_timer(&w->slots[level][(expires >> (level * SLOT_BITS)) & SLOT_MASK], t);
+}
+
+
+/* re-add timers of a slot at lower levels */
+static void cascade(struct wheel *w, int level, int slot) {
+    struct timer *t = w->slots[level][slot], *next;
+
+    w->slots[level][slot] = NULL;
+
+    for (;  t;  t = next) {
+        next     = t->next;
+        t->pprev = NULL;
+        place(w, t);
+    }
+}
+
+
+/* next tick after w->now at which an occupied slot of level is due or cascaded, or 0 if none */
+static unsigned long next_occupied(const struct wheel *w, int level) {
+    unsigned long tick;
+    int           shift = level * SLOT_BITS, i;
+
+    for (i = 1;  i <= SLOTS;  ++i) {
+        tick = ((w->now >> shift) + i) << shift;
+        if (w->slots[level][(tick >> shift) & SLOT_MASK])
+            return tick;
+    }
+
+    return 0;
+}
+
+
+struct wheel* wheel_create(unsigned long now) {
+    struct wheel *w;
+
+    if (!((w = (struct wheel*) calloc(1, sizeof(struct wheel)))))
+        error("calloc failed");
+
+    w->now = now;
+
+    return w;
+}
+
+
+/* timers are not owned by the wheel */
+void wheel_destroy(struct wheel *w) {
+    free(w);
+}
+
+
+void wheel_add(struct wheel *w, struct timer *t) {
+    wheel_del(t);
+    place(w, t);
+}
+
+
+void wheel_del(struct timer *t) {
+    if (t->pprev) {
+        if ((*t->pprev = t->next))
+            t->next->pprev = t->pprev;
+
+        t->next  = NULL;
+        t->pprev = NULL;
+    }
+}
+
+
+struct timer* wheel_expire(struct wheel *w, unsigned long now) {
+    struct timer  *t;
+    unsigned long tick, next;
+    int           level, slot;
+
+    while (!w->expired  &&  w->now < now) {
+        /* after a stall, skip ticks without due timers or cascades */
+        if (now - w->now > SLOTS) {
+            for (next = now, level = 0;  level < LEVELS;  ++level)
+                if ((tick = next_occupied(w, level))  &&  tick < next)
+                    next = tick;
+
+            w->now = next - 1;
+        }
+
+        ++w->now;
+
+        /* cascade higher levels whose lower level wrapped around */
+        for (level = 1;  level < LEVELS;  ++level) {
+            if ((w->now >> ((level-1) * SLOT_BITS)) & SLOT_MASK)
+                break;
+
+            cascade(w, level, (w->now >> (level * SLOT_BITS)) & SLOT_MASK);
+        }
+
+        /* due timers */
+        slot = w->now & SLOT_MASK;
+        for (t = w->slots[0][slot];  t;  t = w->slots[0][slot]) {
+            wheel_del(t);
+            link_timer(&w->expired, t);
+        }
+    }
+
+    if ((t = w->expired))
+        wheel_del(t);
+
+    return t;
+}
+
+
+unsigned long wheel_next(const struct wheel *w) {
+    unsigned long tick;
+    int           level, slot;
+
+    if (w->expired)
+        return w->now;
+
+    /* next non-empty slot of the lowest level (before it wraps around) */
+    for (tick = w->now + 1;  tick & SLOT_MASK;  ++tick)
+        if (w->slots[0][tick & SLOT_MASK])
+            return tick;
+
+    /* otherwise, wake up at the next cascade, if any timers remain */
+    for (level = 0;  level < LEVELS;  ++level)
+        for (slot = 0;  slot < SLOTS;  ++slot)
+            if (w->slots[level][slot])
+                return tick;
+
+    return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+/* timer embedded in the caller's structure (not linked if pprev is NULL) */
+struct timer {
+    struct timer  *next, **pprev;
+    unsigned long expires;
+};
+
+struct wheel;
+
+struct wheel* wheel_create(unsigned long now);
+void wheel_destroy(struct wheel *w);
+
+void wheel_add(struct wheel *w, struct timer *t);
+void wheel_del(struct timer *t);
+
+/* advance wheel to now, and return next expired timer (unlinked), or NULL */
+struct timer* wheel_expire(struct wheel *w, unsigned long now);
+
+/* time at which a timer may expire next (not earlier), or 0 if no timers */
+unsigned long wheel_next(const struct wheel *w);
+
+#endif
@@ -0,0 +1,517 @@
+/*
+  Pre-forked worker processes, which launch jobs (loop scripts) on behalf
+  of process accounting.
+
+  Forking the daemon itself gets slower with its size and number of
+  threads, so a zygote is forked at startup, before the webserver threads
+  and any large allocations.  On request, the zygote forks a worker,
+  connected to the daemon by a SOCK_SEQPACKET socketpair whose daemon end
+  is passed back with SCM_RIGHTS.  A worker receives one job at a time
+  (argv and envp), forks and execs it from its small address space, waits
+  for it, and reports the exit status.
+
+  Workers are recycled after WORKER_JOBS jobs, idle ones beyond
+  WORKER_IDLE are retired, and crashed ones are replaced on demand.  The
+  zygote is watched with a pidfd, and is reaped when it exits.  It is not
+  forked again, since the daemon is then multithreaded (and workers log
+  after forking): jobs are launched by process accounting directly.
+
+  Workers and the zygote exit when their socket is closed by the daemon.
+
+  NOT thread-safe (main loop only)
+*/
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+#include "worker.h"
+#include "event.h"
+#include "util.h"
+
+
+/* jobs before a worker is recycled, and max. number of idle workers */
+#ifndef TESTING
+#define WORKER_JOBS  1000
+#define WORKER_IDLE    16
+#else
+#define WORKER_JOBS     3
+#define WORKER_IDLE     2
+#endif
+
+/* job message size, and max. number of arguments and environment variables */
+#define WORKER_MSGSZ  (64 * 1024)
+#define WORKER_ARGS     16
+#define WORKER_ENVS   1024
+
+
+/* job message header, followed by argc + envc NUL-terminated strings */
+struct job_hdr {
+    int32_t argc, envc;
+};
+
+/* worker, as seen by the daemon (event first, for callbacks) */
+struct worker {
+    struct event  ev;
+    struct worker *next;
+    pid_t         pid;
+    unsigned long njobs;
+    int           busy;
+    void          (*done)(void *arg, int status);
+    void          *arg;
+};
+
+static struct worker *workers;
+static int           nidle;
+
+/* daemon end of the zygote socket, zygote pid and pidfd */
+static int          zfd  = -1;
+static pid_t        zpid = -1;
+static struct event zev  = { -1, NULL };
+
+/* job message buffer (daemon and worker) */
+static char msg[WORKER_MSGSZ];
+
+/* statistics */
+static unsigned long nspawned, ncrashed, nretired;
+
+
+/* run job (in worker), returning its waitpid() status, or -1 if it could not be started */
+static int run_job(char *argv[], char *envp[]) {
+    pid_t pid;
+    int   status;
+
+    if ((pid = fork()) == -1)
+        return -1;
+    else if (pid == 0) {
+        /* modifiable strings signature seems to be historic */
+        if (envp)
+            execve(argv[0], argv, envp);
+        else
+            execvp(argv[0], argv);
+
+        flog(LOG_ERR, "loop execution failed");
+        _exit(EXIT_FAILURE);
+    }
+
+    while (waitpid(pid, &status, 0) == -1)
+        if (errno != EINTR)
+            return -1;
+
+    return status;
+}
+
+
+/* split received job message into argv and envp (NULL if envc is -1), returning 0 if malformed */
+static int unpack_job(size_t len, char *argv[], char *envp[], char ***penvp) {
+    struct job_hdr hdr;
+    char           *s = msg + sizeof(hdr), *end = msg + len;
+    int            i;
+
+    if (len < sizeof(hdr)  ||  len >= sizeof(msg)  ||  msg[len-1])
+        return 0;
+
+    memcpy(&hdr, msg, sizeof(hdr));
+    if (hdr.argc < 1  ||  hdr.argc > WORKER_ARGS  ||  hdr.envc < -1  ||  hdr.envc > WORKER_ENVS)
+        return 0;
+
+    for (i = 0;  i < hdr.argc  &&  s < end;  ++i, s += strlen(s) + 1)
+        argv[i] = s;
+    if (i < hdr.argc)
+        return 0;
+    argv[i] = NULL;
+
+    for (i = 0;  i < hdr.envc  &&  s < end;  ++i, s += strlen(s) + 1)
+        envp[i] = s;
+    if (i < hdr.envc)
+        return 0;
+    envp[i] = NULL;
+
+    *penvp = hdr.envc == -1 ? NULL : envp;
+    return 1;
+}
+
+
+/* worker process: run received jobs until the socket is closed */
+static void worker_main(int fd) {
+    char    *argv[WORKER_ARGS+1], *envp[WORKER_ENVS+1], **env;
+    ssize_t sz;
+    int     status;
+
+    while ((sz = recv(fd, msg, sizeof(msg), MSG_TRUNC)) > 0) {
+        if (unpack_job(sz, argv, envp, &env))
+            status = run_job(argv, env);
+        else {
+            flog(LOG_WARNING, "bad job message");
+            status = -1;
+        }
+
+        if (send(fd, &status, sizeof(status), MSG_NOSIGNAL) != sizeof(status))
+            break;
+    }
+
+    close(fd);
+    closelog();
+    _exit(EXIT_SUCCESS);
+}
+
+
+/* zygote process: fork a worker for each request, and pass its socket back */
+static void zygote_main(int fd) {
+    union {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct msghdr  mh;
+    struct iovec   iov;
+    struct cmsghdr *cm;
+    pid_t          pid;
+    char           req;
+    int            sv[2], ok;
+
+    /* workers are reaped automatically (but wait for their jobs) */
+    signal(SIGCHLD, SIG_IGN);
+
+    while (recv(fd, &req, 1, 0) == 1) {
+        pid = -1;
+
+        if (!socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+            if ((pid = fork()) == 0) {
+                signal(SIGCHLD, SIG_DFL);
+                close(fd);
+                close(sv[0]);
+                worker_main(sv[1]);
+            }
+
+            close(sv[1]);
+            if (pid == -1)
+                close(sv[0]);
+        }
+
+        memset(&mh, 0, sizeof(mh));
+        iov.iov_base  = &pid;
+        iov.iov_len   = sizeof(pid);
+        mh.msg_iov    = &iov;
+        mh.msg_iovlen = 1;
+
+        if (pid != -1) {
+            mh.msg_control    = ctl.buf;
+            mh.msg_controllen = sizeof(ctl.buf);
+
+            cm             = CMSG_FIRSTHDR(&mh);
+            cm->cmsg_level = SOL_SOCKET;
+            cm->cmsg_type  = SCM_RIGHTS;
+            cm->cmsg_len   = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cm), &sv[0], sizeof(int));
+        }
+
+        /* descriptor is duplicated by the message */
+        ok = sendmsg(fd, &mh, MSG_NOSIGNAL) != -1;
+        if (pid != -1)
+            close(sv[0]);
+
+        if (!ok)
+            break;
+    }
+
+    close(fd);
+    closelog();
+    _exit(EXIT_SUCCESS);
+}
+
+
+static void unwatch_zygote() {
+    if (zev.fd != -1) {
+        event_del(&zev);
+        if (close(zev.fd))
+            warning("could not close pidfd");
+        zev.fd = -1;
+    }
+}
+
+
+/* close zygote socket, and reap the zygote (which exits once the socket is closed) */
+static void stop_zygote() {
+    int status;
+
+    unwatch_zygote();
+
+    if (zfd != -1) {
+        if (close(zfd))
+            warning("could not close zygote socket");
+        zfd = -1;
+    }
+
+    if (zpid != -1) {
+        while (waitpid(zpid, &status, 0) == -1  &&  errno == EINTR)
+            ;
+        zpid = -1;
+    }
+}
+
+
+static void zygote_event(struct event *ev);
+
+/* watch the zygote for exit (without a pidfd, exits are noticed by spawn_worker()) */
+static void watch_zygote() {
+    if (zpid == -1  ||  zev.fd != -1)
+        return;
+
+    zev.fn = zygote_event;
+    if ((zev.fd = syscall(SYS_pidfd_open, zpid, 0)) != -1  &&  !event_add(&zev)) {
+        close(zev.fd);
+        zev.fd = -1;
+    }
+}
+
+
+/* zygote has exited (or closed its socket): reap it, and fall back to direct launches */
+static void lose_zygote() {
+    stop_zygote();
+    flog(LOG_WARNING, "zygote exited, launching jobs directly");
+}
+
+
+/* pidfd is readable: zygote has exited */
+static void zygote_event(struct event *ev) {
+    lose_zygote();
+}
+
+
+static void remove_worker(struct worker *w) {
+    struct worker **pw;
+
+    for (pw = &workers;  *pw != w;  pw = &(*pw)->next)
+        ;
+    *pw = w->next;
+
+    if (!w->busy)
+        --nidle;
+
+    event_del(&w->ev);
+    if (close(w->ev.fd))
+        warning("could not close worker socket");
+    free(w);
+}
+
+
+/* worker socket is readable: job finished, or worker exited */
+static void worker_event(struct event *ev) {
+    struct worker *w = (struct worker*) ev;
+    void          (*done)(void *arg, int status) = w->done;
+    void          *arg = w->arg;
+    ssize_t       sz;
+    int           status, busy = w->busy;
+
+    if ((sz = recv(w->ev.fd, &status, sizeof(status), MSG_DONTWAIT)) == -1  &&  errno == EAGAIN)
+        return;
+
+    if (sz != sizeof(status)) {
+        if (busy) {
+            flog(LOG_WARNING, "worker %ld exited during a job", (long) w->pid);
+            ++ncrashed;
+        }
+
+        remove_worker(w);
+        status = -1;
+    }
+    else {
+        w->busy = 0;
+        ++nidle;
+
+        /* recycle worker, or retire it if too many are idle */
+        if (++w->njobs >= WORKER_JOBS  ||  nidle > WORKER_IDLE) {
+            remove_worker(w);
+            ++nretired;
+        }
+    }
+
+    /* the hook may start further jobs */
+    if (busy)
+        done(arg, status);
+}
+
+
+/* request a new worker from the zygote (blocks briefly) */
+static struct worker* spawn_worker() {
+    union {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct msghdr  mh;
+    struct iovec   iov;
+    struct cmsghdr *cm;
+    struct worker  *w;
+    pid_t          pid = -1;
+    int            fd = -1;
+
+    if (zfd == -1)
+        return NULL;
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base       = &pid;
+    iov.iov_len        = sizeof(pid);
+    mh.msg_iov         = &iov;
+    mh.msg_iovlen      = 1;
+    mh.msg_control     = ctl.buf;
+    mh.msg_controllen  = sizeof(ctl.buf);
+
+    if (send(zfd, "w", 1, MSG_NOSIGNAL) != 1  ||  recvmsg(zfd, &mh, MSG_CMSG_CLOEXEC) != sizeof(pid)) {
+        lose_zygote();
+        return NULL;
+    }
+
+    if ((cm = CMSG_FIRSTHDR(&mh))  &&  cm->cmsg_level == SOL_SOCKET  &&  cm->cmsg_type == SCM_RIGHTS)
+        memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+
+    if (pid == -1  ||  fd == -1) {
+        flog(LOG_WARNING, "zygote failed to fork a worker");
+        if (fd != -1)
+            close(fd);
+        return NULL;
+    }
+
+    if (!((w = (struct worker*) calloc(1, sizeof(struct worker)))))
+        error("calloc failed");
+
+    w->ev.fd = fd;
+    w->ev.fn = worker_event;
+    w->pid   = pid;
+
+    if (!event_add(&w->ev)) {
+        close(fd);
+        free(w);
+        return NULL;
+    }
+
+    w->next = workers;
+    workers = w;
+    ++nidle;
+    ++nspawned;
+
+    return w;
+}
+
+
+int init_workers() {
+    int   sv[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+        warning("failed to create zygote socket");
+        return 0;
+    }
+
+    if ((pid = fork()) == -1) {
+        warning("failed to fork zygote");
+        close(sv[0]);
+        close(sv[1]);
+        return 0;
+    }
+    else if (pid == 0) {
+        close(sv[0]);
+        zygote_main(sv[1]);
+    }
+
+    close(sv[1]);
+    zfd  = sv[0];
+    zpid = pid;
+
+    return 1;
+}
+
+
+/* running jobs are not reported, workers exit once their job is done */
+void shutdown_workers() {
+    while (workers)
+        remove_worker(workers);
+
+    stop_zygote();
+
+    if (nspawned)
+        flog(LOG_INFO, "workers: %lu spawned, %lu retired, %lu crashed", nspawned, nretired, ncrashed);
+}
+
+
+void worker_prefork(int count) {
+    watch_zygote();
+
+    while (nidle < count  &&  nidle < WORKER_IDLE  &&  spawn_worker())
+        ;
+}
+
+
+/* serialize job into msg, returning its size, or 0 if it doesn't fit */
+static size_t pack_job(const char *const argv[], char *const envp[]) {
+    struct job_hdr hdr;
+    size_t         len = sizeof(hdr), sz;
+    int            i;
+
+    for (hdr.argc = 0;  argv[hdr.argc];  ++hdr.argc)
+        ;
+    if (envp)
+        for (hdr.envc = 0;  envp[hdr.envc];  ++hdr.envc)
+            ;
+    else
+        hdr.envc = -1;
+
+    if (hdr.argc > WORKER_ARGS  ||  hdr.envc > WORKER_ENVS)
+        return 0;
+
+    memcpy(msg, &hdr, sizeof(hdr));
+
+    for (i = 0;  i < hdr.argc + (hdr.envc > 0 ? hdr.envc : 0);  ++i) {
+        const char *s = i < hdr.argc ? argv[i] : envp[i - hdr.argc];
+
+        if ((sz = strlen(s) + 1) > sizeof(msg) - len)
+            return 0;
+
+        memcpy(msg + len, s, sz);
+        len += sz;
+    }
+
+    return len;
+}
+
+
+int worker_run(const char *const argv[], char *const envp[],
+               void (*done)(void *arg, int status), void *arg, pid_t *pid) {
+    struct worker *w;
+    size_t        len;
+    int           tries;
+
+    if ((!workers  &&  zfd == -1)  ||  !((len = pack_job(argv, envp))))
+        return 0;
+
+    /* a worker which exited meanwhile is replaced once */
+    for (tries = 0;  tries < 2;  ++tries) {
+        for (w = workers;  w  &&  w->busy;  w = w->next)
+            ;
+
+        if (!w  &&  !((w = spawn_worker())))
+            return 0;
+
+        if (send(w->ev.fd, msg, len, MSG_NOSIGNAL) == (ssize_t) len) {
+            w->busy = 1;
+            w->done = done;
+            w->arg  = arg;
+            --nidle;
+
+            *pid = w->pid;
+            return 1;
+        }
+
+        ++ncrashed;
+        remove_worker(w);
+    }
+
+    return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <sys/types.h>
+
+/* fork the zygote (before any threads are started, and before large allocations) */
+int init_workers();
+void shutdown_workers();
+
+/* spawn idle workers in advance, and watch the zygote (requires init_events()) */
+void worker_prefork(int count);
+
+/*
+  run job in an idle (or newly spawned) worker, returning 0 if none is available
+  done(arg, status) is called from the event loop when the job exits, with
+  status as from waitpid(), or -1 if the job could not be run (e.g., worker crash)
+*/
+int worker_run(const char *const argv[], char *const envp[],
+               void (*done)(void *arg, int status), void *arg, pid_t *pid);
+
+#endif